@@ -0,0 +1,79 @@
+// Check: hierarchical reduction keeps the DC response of the net at its ports
+//
+// A resistive grid driven through voltage source ports is split into parts, each
+// reduced on its own (concurrently), and assembled; optionally the macromodel is
+// reduced again.  Each part's basis contains its exact DC solution, so the port
+// admittance B^T G^-1 B of the macromodel must match that of the unreduced net.
+//
+// usage: check_hierarchical [k [parts]]      k x k grid; exits nonzero on a mismatch
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "eigen_shim.hpp"
+#include "hierarchical_reduction.hpp"
+
+using L         = EigenShim;
+using triplet_t = L::triplet_t;
+
+// the port response at DC, B^T G^-1 B
+static Eigen::MatrixXd
+dc_response( L::sparsemat_t const & G, L::sparsemat_t const & B ) {
+    Eigen::MatrixXd Gd = G.wrapped(), Bd = B.wrapped();
+    return Bd.transpose() * Gd.partialPivLu().solve(Bd);
+}
+
+int main( int argc, char ** argv ) {
+    int k     = (argc > 1) ? std::atoi(argv[1]) : 30;
+    int parts = (argc > 2) ? std::atoi(argv[2]) : 4;
+    int const ports = 4;
+    int nodes = k * k, n = nodes + ports;
+
+    std::vector<triplet_t> G, B;
+    auto id = [k]( int x, int y ) { return y * k + x; };
+    auto stamp = [&G]( int a, int b, double g ) {
+        G.emplace_back(a, a, g);
+        G.emplace_back(b, b, g);
+        G.emplace_back(a, b, -g);
+        G.emplace_back(b, a, -g);
+    };
+    for ( int y = 0; y < k; ++y ) {
+        for ( int x = 0; x < k; ++x ) {
+            if ( x + 1 < k ) {
+                stamp(id(x, y), id(x + 1, y), 1.0 + 0.1 * ((7 * x + y) % 5));
+            }
+            if ( y + 1 < k ) {
+                stamp(id(x, y), id(x, y + 1), 1.0 + 0.1 * ((x + 3 * y) % 4));
+            }
+            G.emplace_back(id(x, y), id(x, y), 1e-3);     // a little leakage to ground
+        }
+    }
+    // voltage source ports at the corners
+    int corner[ports] = {id(0, 0), id(k - 1, 0), id(0, k - 1), id(k - 1, k - 1)};
+    for ( int p = 0; p < ports; ++p ) {
+        G.emplace_back(corner[p], nodes + p, 1.0);
+        G.emplace_back(nodes + p, corner[p], -1.0);
+        B.emplace_back(nodes + p, p, -1.0);
+    }
+
+    Eigen::MatrixXd expected = dc_response(L::sparsemat_t(n, n, G.begin(), G.end()),
+                                           L::sparsemat_t(n, ports, B.begin(), B.end()));
+
+    bool ok = true;
+    for ( bool rereduce : {false, true} ) {
+        hierarchical_options opts;
+        opts.parts    = parts;
+        opts.threads  = 4;
+        opts.rereduce = rereduce;
+        hierarchical_reduction<L> h(n, ports, G.begin(), G.end(), B.begin(), B.end(), opts);
+        double err = (dc_response(h.G(), h.B()) - expected).norm() / expected.norm();
+        std::printf("%zu parts, %s: order %d, DC mismatch %g\n", h.part_seconds().size(),
+                    rereduce ? "reduced again" : "assembled", int(h.size()), err);
+        ok = ok && (h.size() < n) && (err < 1e-10);
+    }
+    std::printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
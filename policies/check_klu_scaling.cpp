@@ -0,0 +1,98 @@
+// Check: the level-scheduled solves of the SuiteSparse policy agree with klu_solve
+//
+// KLU scales rows by default, and hands its scale factors back in pivotal order, so
+// a matrix whose rows differ by many orders of magnitude (and that needs pivoting)
+// shows whether the extracted factors are being applied the way KLU applies them.
+// The factors are also saved and mapped back, which goes through lu_file's solver.
+//
+// usage: check_klu_scaling [n]      exits nonzero on a mismatch
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "suitesparse_shim.hpp"
+
+using L         = SuiteSparse::Shim;
+using index_t   = L::index_t;
+using triplet_t = L::triplet_t;
+using sparsemat_t = L::sparsemat_t;
+using traits    = SuiteSparse::ss_traits<index_t>;
+
+// largest difference relative to the largest entry of "expected"
+static double
+mismatch( std::vector<double> const & x, std::vector<double> const & expected ) {
+    double diff = 0, scale = 0;
+    for ( std::size_t i = 0; i < x.size(); ++i ) {
+        diff  = std::max(diff, std::abs(x[i] - expected[i]));
+        scale = std::max(scale, std::abs(expected[i]));
+    }
+    return (scale > 0) ? diff / scale : diff;
+}
+
+int main( int argc, char ** argv ) {
+    index_t n = (argc > 1) ? index_t(std::atoi(argv[1])) : 200;
+    index_t const nrhs = 3;
+
+    // a chain with a weak diagonal, so partial pivoting has to choose, and rows
+    // scaled over twelve orders of magnitude
+    std::vector<triplet_t> At, Bt;
+    for ( index_t i = 0; i < n; ++i ) {
+        double s = std::pow(10.0, double(i % 13) - 6.0);
+        At.push_back(triplet_t{i, i, s * ((i % 3 == 0) ? 1e-3 : 4.0)});
+        if ( i > 0 ) {
+            At.push_back(triplet_t{i, i - 1, -s});
+        }
+        if ( i + 1 < n ) {
+            At.push_back(triplet_t{i, i + 1, -1.5 * s});
+        }
+        if ( i + 7 < n ) {
+            At.push_back(triplet_t{i, i + 7, 0.25 * s});
+        }
+        for ( index_t c = 0; c < nrhs; ++c ) {
+            Bt.push_back(triplet_t{i, c, std::sin(double(i * (c + 1)))});
+        }
+    }
+    sparsemat_t A(n, n, At.begin(), At.end());
+    sparsemat_t B(n, nrhs, Bt.begin(), Bt.end());
+
+    // KLU itself
+    cholmod_sparse * a = A.wrapped().get();
+    auto kc = SuiteSparse::klu_common<index_t>.get();
+    auto S = traits::analyze(n, static_cast<index_t *>(a->p), static_cast<index_t *>(a->i), kc);
+    auto N = traits::factor(static_cast<index_t *>(a->p), static_cast<index_t *>(a->i),
+                            static_cast<double *>(a->x), S, kc);
+    if ( !S || !N ) {
+        std::printf("FAIL: KLU could not factor the test matrix\n");
+        return 1;
+    }
+    std::vector<double> expected(std::size_t(n) * nrhs, 0.0);
+    B.for_each_nonzero([&expected, n](index_t i, index_t j, double v) { expected[std::size_t(j) * n + i] = v; });
+    traits::solve(S, N, n, nrhs, expected.data(), kc);
+    traits::free(N, kc);
+    traits::free(S, kc);
+
+    // the policy, solving level by level
+    L::lu_t lu(A);
+    std::vector<double> x(expected.size());
+    L::lu_t::workspace_t ws;
+    lu.solve_into(B, x.data(), ws);
+    double err = mismatch(x, expected);
+    std::printf("level-scheduled solve: %g\n", err);
+
+    // and through a saved, mapped copy
+    std::string path = "check_klu_scaling.lu";
+    lu.save(path);
+    L::lu_t mapped = L::lu_t::load(path);
+    mapped.solve_into(B, x.data(), ws);
+    double merr = mismatch(x, expected);
+    std::remove(path.c_str());
+    std::printf("mapped solve:          %g\n", merr);
+
+    bool ok = (err < 1e-10) && (merr < 1e-10);
+    std::printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,95 @@
+// Check: re-stamping values in place gives the matrices a fresh assembly would
+//
+// An RC net with a voltage source and three ports is assembled once, then swept
+// through a few corners with set_value() and assemble(), which only scatters the new
+// stamps into the existing value arrays.  At each corner G, C and B must match those
+// of a new assembler given the same values from the start.
+//
+// usage: check_mna      exits nonzero on a mismatch
+
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+
+#include <Eigen/Dense>
+
+#include "eigen_shim.hpp"
+#include "mna_assembler.hpp"
+
+using L         = EigenShim;
+using index_t   = L::index_t;
+using assembler = mna_assembler<L>;
+
+struct element {
+    bool    capacitor;
+    index_t a, b;
+    double  value;
+};
+
+// two RC ladders joined by a source and a coupling capacitor, at one corner
+static std::vector<element>
+net( double r_scale, double c_scale ) {
+    std::vector<element> es;
+    for ( index_t i = 0; i + 1 < 12; ++i ) {
+        if ( i != 5 ) {
+            es.push_back(element{false, i, i + 1, r_scale * (100.0 + 50.0 * (i % 4))});
+        }
+    }
+    es.push_back(element{false, 5, assembler::ground, r_scale * 1e4});
+    for ( index_t i = 1; i < 12; i += 2 ) {
+        es.push_back(element{true, i, assembler::ground, c_scale * 1e-12});
+    }
+    es.push_back(element{true, 2, 9, c_scale * 0.2e-12});
+    return es;
+}
+
+// returns the element numbers for set_value()
+static std::vector<index_t>
+add( assembler & a, std::vector<element> const & es ) {
+    std::vector<index_t> ids;
+    for ( auto const & e : es ) {
+        ids.push_back(e.capacitor ? a.add_capacitor(e.a, e.b, e.value) : a.add_resistor(e.a, e.b, e.value));
+    }
+    a.add_vsource(11, 6);
+    a.add_port(0);
+    a.add_port(6);
+    a.add_port(3, 8);
+    return ids;
+}
+
+// the largest relative difference among G, C and B (compared separately, since
+// capacitances are many orders of magnitude below conductances)
+static double
+mismatch( assembler const & a, assembler const & expected ) {
+    auto rel = []( L::sparsemat_t const & x, L::sparsemat_t const & y ) {
+        Eigen::MatrixXd X(x.wrapped()), Y(y.wrapped());
+        return (X - Y).norm() / Y.norm();
+    };
+    return std::max({rel(a.G(), expected.G()), rel(a.C(), expected.C()), rel(a.B(), expected.B())});
+}
+
+int main() {
+    assembler swept(12);
+    std::vector<index_t> ids = add(swept, net(1.0, 1.0));
+    swept.assemble();
+
+    bool ok = true;
+    double const corners[][2] = {{2.0, 1.0}, {0.5, 3.0}, {1.0, 0.25}, {1.0, 1.0}};
+    for ( auto const & k : corners ) {
+        std::vector<element> es = net(k[0], k[1]);
+        for ( std::size_t i = 0; i < es.size(); ++i ) {
+            swept.set_value(ids[i], es[i].value);
+        }
+        swept.assemble();
+
+        assembler fresh(12);
+        add(fresh, es);
+        fresh.assemble();
+
+        double err = mismatch(swept, fresh);
+        std::printf("R x %g, C x %g: mismatch %g\n", k[0], k[1], err);
+        ok = ok && (swept.size() == fresh.size()) && (err < 1e-14);
+    }
+    std::printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+// Check: the asynchronous Prima pipeline gives the same bases as doing it in order
+//
+// A stream of small nets (resistive ladders with scrambled node numbers, driven
+// through voltage source ports) goes through prima_pipeline, and each Q it delivers
+// is compared with the one from the synchronous path: lu_t, solve, qr_t.  Bases are
+// compared as subspaces, since renumbering or a different column sign is allowed.
+// The same nets are also run with the nodes renumbered inside the pipeline, and
+// with a memory budget that makes them queue for factorization.
+//
+// usage: check_pipeline [nets]      exits nonzero on a mismatch
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <future>
+#include <iostream>
+
+#include <Eigen/Dense>
+
+#include "eigen_shim.hpp"
+#include "prima_pipeline.hpp"
+
+using L         = EigenShim;
+using index_t   = L::index_t;
+using triplet_t = L::triplet_t;
+using pipeline  = prima_pipeline<L>;
+
+// a ladder of rungs sections with two ports, its nodes numbered out of order
+static pipeline::net_t
+ladder( int rungs, int seed ) {
+    int nodes = 2 * rungs;
+    // a stride coprime to nodes scrambles the numbering
+    int stride = 1;
+    for ( int s = 7 + seed % 5; s < nodes; ++s ) {
+        int a = s, b = nodes;
+        while ( b ) {
+            int t = a % b;
+            a = b;
+            b = t;
+        }
+        if ( a == 1 ) {
+            stride = s;
+            break;
+        }
+    }
+    auto id = [nodes, stride]( int v ) { return index_t((v * stride) % nodes); };
+
+    pipeline::net_t net;
+    net.nodes = nodes + 2;
+    net.ports = 2;
+    auto stamp = [&net]( index_t a, index_t b, double g ) {
+        net.G.emplace_back(a, a, g);
+        net.G.emplace_back(b, b, g);
+        net.G.emplace_back(a, b, -g);
+        net.G.emplace_back(b, a, -g);
+    };
+    for ( int r = 0; r < rungs; ++r ) {
+        stamp(id(2 * r), id(2 * r + 1), 0.5 + 0.1 * ((r + seed) % 3));     // the rung
+        if ( r + 1 < rungs ) {
+            stamp(id(2 * r), id(2 * r + 2), 1.0 + 0.1 * ((r * seed) % 4));
+            stamp(id(2 * r + 1), id(2 * r + 3), 2.0);
+        }
+        net.G.emplace_back(id(2 * r), id(2 * r), 1e-4);
+        net.G.emplace_back(id(2 * r + 1), id(2 * r + 1), 1e-4);
+    }
+    // voltage source ports at the two ends
+    index_t end[2] = {id(0), id(nodes - 1)};
+    for ( int p = 0; p < 2; ++p ) {
+        net.G.emplace_back(end[p], nodes + p, 1.0);
+        net.G.emplace_back(nodes + p, end[p], -1.0);
+        net.B.emplace_back(nodes + p, p, -1.0);
+    }
+    return net;
+}
+
+// the synchronous path
+static Eigen::MatrixXd
+reference_basis( pipeline::net_t const & net ) {
+    L::sparsemat_t G(net.nodes, net.nodes, net.G.begin(), net.G.end());
+    L::sparsemat_t B(net.nodes, net.ports, net.B.begin(), net.B.end());
+    L::lu_t lu(G);
+    L::qr_t qr(lu.solve(B));
+    return Eigen::MatrixXd(qr.Q().wrapped());
+}
+
+// how far the columns of expected are from the span of Q
+static double
+subspace_mismatch( Eigen::MatrixXd const & Q, Eigen::MatrixXd const & expected ) {
+    if ( (Q.rows() != expected.rows()) || (Q.cols() != expected.cols()) ) {
+        return 1.0;
+    }
+    return (expected - Q * (Q.transpose() * expected)).norm() / expected.norm();
+}
+
+static bool
+run( std::string const & name, pipeline & p, int nets ) {
+    std::vector<pipeline::net_t> inputs;
+    std::vector<std::future<L::sparsemat_t>> results;
+    for ( int k = 0; k < nets; ++k ) {
+        inputs.push_back(ladder(20 + 15 * (k % 7), k));
+        results.push_back(p.submit(inputs.back()));
+    }
+    double worst = 0;
+    for ( int k = 0; k < nets; ++k ) {
+        Eigen::MatrixXd Q(results[k].get().wrapped());
+        worst = std::max(worst, subspace_mismatch(Q, reference_basis(inputs[k])));
+    }
+    p.wait();
+    std::printf("%-20s %d nets, worst mismatch %g\n", name.c_str(), nets, worst);
+    return worst < 1e-10;
+}
+
+int main( int argc, char ** argv ) {
+    int nets = (argc > 1) ? std::atoi(argv[1]) : 24;
+
+    bool ok = true;
+    {
+        pipeline p(3, 4);
+        ok = run("plain", p, nets) && ok;
+    }
+    // renumbered for locality, with Q brought back to the original numbering
+    for ( auto m : {node_reorder::method::rcm, node_reorder::method::partition} ) {
+        pipeline p(3, 4, m);
+        ok = run(std::string("reordered, ") + node_reorder::method_name(m), p, nets) && ok;
+    }
+    // a memory budget of about one large net, so most nets wait to be factored
+    {
+        pipeline p(3, 4, node_reorder::method::none, thread_budget(), std::size_t(1) << 18);
+        ok = run("memory budget", p, nets) && ok;
+        p.print_report(std::cout);
+    }
+    std::printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
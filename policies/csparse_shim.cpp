@@ -1,17 +1,19 @@
-// Implementation of CSparseShim
+// Implementation of CSparseShimT
 // some very small functions are implemented in the header...
 
 #include "csparse_shim.hpp"
 
 // sparse matrix entry iterator
+template<typename Index, typename Value>
 void
-CSparseShim::sparse_entry_iterator::increment() {
+CSparseShimT<Index, Value>::sparse_entry_iterator::increment() {
     entry_.row++;
     advance_to_valid();
 }
 
+template<typename Index, typename Value>
 bool
-CSparseShim::sparse_entry_iterator::equal( sparse_entry_iterator const& other ) const {
+CSparseShimT<Index, Value>::sparse_entry_iterator::equal( sparse_entry_iterator const& other ) const {
     if ( !mat_ && !other.mat_ ) {
         // both end iterators
         return true;
@@ -22,8 +24,9 @@ CSparseShim::sparse_entry_iterator::equal( sparse_entry_iterator const& other )
             (entry_.col == other.entry_.col));
 }
 
+template<typename Index, typename Value>
 void
-CSparseShim::sparse_entry_iterator::advance_to_valid() {
+CSparseShimT<Index, Value>::sparse_entry_iterator::advance_to_valid() {
     if (!mat_) {
         // end iterator; always valid
         return;
@@ -56,98 +59,392 @@ CSparseShim::sparse_entry_iterator::advance_to_valid() {
 
 // solvers
 
-CSparseShim::sparsemat_t
-CSparseShim::lu_t::solve(sparsemat_t const& rhs) const {
-    using namespace std;
-    // turn RHS into a dense (zero) matrix
-    vector<value_t> rhs_dense( rhs.rows() * rhs.cols() );
-    fill( rhs_dense.begin(), rhs_dense.end(), value_t{0} );
-
-    // Loop over nonzero values and insert
-    for ( auto it = rhs.nonzero_begin(); it != rhs.nonzero_end(); ++it ) {
-        rhs_dense[it->col * rhs.rows() + it->row] = it->value;
-    }
-
-    // solve one column at a time
-    vector<value_t> workspace(max(rhs.cols(), rhs.rows()));
-    for ( index_t col = 0; col < rhs.cols(); ++col ) {
-        cs_ipvec  ( numeric_->pinv, &rhs_dense[rhs.rows()*col],
-                    workspace.data(), rhs.rows() );
-        cs_lsolve ( numeric_->L, workspace.data() ) ;
-        cs_usolve ( numeric_->U, workspace.data() ) ;
-        cs_ipvec  ( symbolic_->q, workspace.data(),
-                    &rhs_dense[rhs.rows()*col], rhs.rows() );
-    }                
+template<typename Index, typename Value>
+void
+CSparseShimT<Index, Value>::lu_t::factor() {
+    SPARSELIB_TRACE_SCOPE("csparse lu factor");
+    symbolic_ = symbolic_analysis( 3, mat_.wrapped().get(), 0 );
+    numeric_  = cs_unique_ptr<csn_t>( lib::lu ( mat_.wrapped().get(), symbolic_.get(), tolerance() ) );
+    factored( false );
+}
+
+template<typename Index, typename Value>
+std::size_t
+CSparseShimT<Index, Value>::lu_t::estimate_bytes( sparsemat_t const& mat ) {
+    auto S = symbolic_analysis( 3, mat.wrapped().get(), 0 );
+    if ( !S ) {
+        throw std::runtime_error( "csparse symbolic analysis failed" );
+    }
+    return std::size_t( S->lnz + S->unz ) * ( sizeof(value_t) + sizeof(index_t) );
+}
+
+template<typename Index, typename Value>
+void
+CSparseShimT<Index, Value>::lu_t::factored( bool static_pivots ) {
+    diag_.static_pivots = static_pivots;
+    if ( !numeric_ ) {
+        schedule_.reset();
+        diag_.rcond = diag_.min_pivot = diag_.max_pivot = 0;
+        return;
+    }
+    index_t n = mat_.rows();
+    auto P = cs_unique_ptr<index_t>( lib::pinv( numeric_->pinv, n ) );
+    schedule_.reset( new level_schedule::lu_solver<value_t, index_t>( factors( P.get() ) ) );
+
+    // cs_lu leaves each pivot last in its column of U
+    cs_t const * U = numeric_->U;
+    cs_t const * A = mat_.wrapped().get();
+    std::vector<value_t> pivots( n );
+    for ( index_t k = 0; k < n; ++k ) {
+        pivots[k] = U->x[U->p[k+1] - 1];
+    }
+    record_pivots( diag_, pivots.begin(), pivots.end() );
+    auto absmax = [](value_t const * x, index_t nz) {
+        double m = 0;
+        for ( index_t k = 0; k < nz; ++k ) {
+            m = std::max( m, double(std::abs(x[k])) );
+        }
+        return m;
+    };
+    double amax = absmax( A->x, A->p[A->n] );
+    diag_.pivot_growth = (amax > 0) ? absmax( U->x, U->p[n] ) / amax : 0.0;
+}
+
+template<typename Index, typename Value>
+void
+CSparseShimT<Index, Value>::lu_t::refactor( sparsemat_t const& mat ) {
+    SPARSELIB_TRACE_SCOPE("csparse lu refactor");
+    if ( mapped_ ) {
+        throw std::logic_error( "a read-only LU cannot be refactored" );
+    }
+    mat_ = mat;
+    delta_.clear();
+    update_.reset();
+    ++diag_.refactors;
+
+    index_t n = mat_.rows();
+    if ( opts_.static_pivoting && numeric_ ) {
+        // cs_lu takes row q[k] as the diagonal of step k, so the row pivoted at step k goes there
+        index_t const * q = symbolic_->q;
+        std::vector<index_t> place( n );
+        for ( index_t i = 0; i < n; ++i ) {
+            index_t k = numeric_->pinv[i];
+            place[i] = q ? q[k] : k;
+        }
+        auto PA = cs_unique_ptr<cs_t>( lib::permute( mat_.wrapped().get(), place.data(), nullptr, 1 ) );
+        cs_unique_ptr<csn_t> N( PA ? lib::lu( PA.get(), symbolic_.get(), 0.0 ) : nullptr );
+        if ( N ) {
+            // back to rows of mat: row i is row place[i] of PA
+            std::vector<index_t> pinv( n );
+            for ( index_t i = 0; i < n; ++i ) {
+                pinv[i] = N->pinv[place[i]];
+            }
+            std::copy( pinv.begin(), pinv.end(), N->pinv );
+            numeric_ = std::move( N );
+            factored( true );
+            if ( !pivots_too_small( diag_, opts_ ) ) {
+                return;
+            }
+        }
+    }
+
+    // a fresh pivot search; the pattern, and so the symbolic analysis, is the same
+    ++diag_.searches;
+    numeric_ = cs_unique_ptr<csn_t>( lib::lu( mat_.wrapped().get(), symbolic_.get(), tolerance() ) );
+    factored( false );
+}
+
+template<typename Index, typename Value>
+auto
+CSparseShimT<Index, Value>::lu_t::factors( index_t const * P ) const -> lu_file::factor_view<value_t, index_t> {
+    cs_t const * L = numeric_->L;
+    cs_t const * U = numeric_->U;
+    return lu_file::factor_view<value_t, index_t>{
+        mat_.rows(), P, symbolic_->q, nullptr, 1, nullptr,
+        L->p, L->i, L->x, U->p, U->i, U->x, nullptr, nullptr, nullptr };
+}
+
+template<typename Index, typename Value>
+void
+CSparseShimT<Index, Value>::lu_t::solve_factored(value_t * x, index_t ncols, std::vector<value_t> & w) const {
+    if ( mapped_ ) {
+        mapped_->solve( x, ncols, w );
+        return;
+    }
+
+    // all columns at once, level by level, instead of cs_lsolve/cs_usolve per column
+    schedule_->solve( x, ncols, w );
+}
+
+template<typename Index, typename Value>
+auto
+CSparseShimT<Index, Value>::lu_t::solve(sparsemat_t const& rhs) const -> sparsemat_t {
+    SPARSELIB_TRACE_SCOPE("csparse lu solve");
+    std::vector<value_t> x( rhs.rows() * rhs.cols() );
+    workspace_t ws;
+    solve_into( rhs, x.data(), ws );
 
     // produce a sparse matrix from the dense result
-    return dense_to_sparse(rhs_dense, rhs.rows(), rhs.cols());
+    return dense_to_sparse(x, rhs.rows(), rhs.cols());
+}
+
+template<typename Index, typename Value>
+void
+CSparseShimT<Index, Value>::lu_t::solve_into(value_t const * b, index_t ncols, value_t * x,
+                                             workspace_t & ws) const {
+    SPARSELIB_TRACE_SCOPE("csparse lu solve_into");
+    if ( b != x ) {
+        std::copy( b, b + size() * ncols, x );
+    }
+    solve_factored( x, ncols, ws.factor );
+    if ( update_ ) {
+        update_->apply( x, ncols, ws.update );
+    }
+}
+
+template<typename Index, typename Value>
+void
+CSparseShimT<Index, Value>::lu_t::solve_into(sparsemat_t const& rhs, value_t * x, workspace_t & ws) const {
+    // scatter the (compressed column) right hand side into x, then solve in place
+    cs_t const * B = rhs.wrapped().get();
+    std::fill( x, x + B->m * B->n, value_t{0} );
+    for ( index_t j = 0; j < B->n; ++j ) {
+        for ( index_t k = B->p[j]; k < B->p[j+1]; ++k ) {
+            x[j * B->m + B->i[k]] = B->x[k];
+        }
+    }
+    solve_into( x, B->n, x, ws );
+}
+
+template<typename Index, typename Value>
+void
+CSparseShimT<Index, Value>::lu_t::update(std::vector<triplet_t> const& delta) {
+    workspace_t ws;
+    update( delta, ws );
+}
+
+template<typename Index, typename Value>
+void
+CSparseShimT<Index, Value>::lu_t::update(std::vector<triplet_t> const& delta, workspace_t & ws) {
+    SPARSELIB_TRACE_SCOPE("csparse lu update");
+    delta_.insert( delta_.end(), delta.begin(), delta.end() );
+
+    if ( changed_columns( delta_.begin(), delta_.end() ) <= std::size_t(max_update_rank_) ) {
+        update_.reset( new lowrank_update<value_t, index_t>(
+                           size(), delta_.begin(), delta_.end(),
+                           [this, &ws](value_t * x, index_t ncols) {
+                               solve_factored(x, ncols, ws.factor);
+                           }) );
+        if ( !update_->singular() ) {
+            return;
+        }
+    }
 
-}            
+    if ( mapped_ ) {
+        throw std::logic_error( "change is too large to apply to a read-only LU" );
+    }
 
-CSparseShim::sparsemat_t
-CSparseShim::qr_t::Q() const {
+    // too many changes (or a bad correction) - fold them into the matrix and start over
+    sparsemat_t dG( mat_.rows(), mat_.cols(), delta_.begin(), delta_.end() );
+    mat_ = sparsemat_t( make_cs_shared_ptr( lib::add( mat_.wrapped().get(), dG.wrapped().get(),
+                                                    value_t(1), value_t(1) ) ) );
+    factor();
+    delta_.clear();
+    update_.reset();
+}
 
-    // reverse the solve permutation
-    auto P = cs_unique_ptr<index_t>(cs_pinv(symbolic_->pinv, rows_));
+template<typename Index, typename Value>
+void
+CSparseShimT<Index, Value>::lu_t::save(std::string const& path) const {
+    SPARSELIB_TRACE_SCOPE("csparse lu save");
+    if ( mapped_ || update_ ) {
+        throw std::logic_error( "only a freshly computed LU can be saved" );
+    }
 
-    // allocate workspace
-    std::vector<value_t> x(symbolic_->m2, value_t{0});
+    // CSparse stores the inverse row permutation
+    index_t n = mat_.rows();
+    auto P = cs_unique_ptr<index_t>( lib::pinv( numeric_->pinv, n ) );
+    lu_file::write_factor( path, factors( P.get() ) );
+}
 
-    cs* V = numeric_->L;
+template<typename Index, typename Value>
+auto
+CSparseShimT<Index, Value>::lu_t::load(std::string const& path) -> lu_t {
+    SPARSELIB_TRACE_SCOPE("csparse lu load");
+    return lu_t( mapped_t::open( path ) );
+}
 
-    // create a *dense* identity matrix of the right size
-    index_t rank = V->n;
-    std::vector<value_t> Q(rows_ * rank);
-    for ( index_t idx = 0; idx < std::min(rows_, rank); idx++ ) {
-        Q[idx * rows_ + idx] = value_t(1);
+template<typename Index, typename Value>
+CSparseShimT<Index, Value>::qr_t::qr_t( sparsemat_t const & mat, qr_options const & opts )
+    : rows_( mat.wrapped()->m ), cols_( mat.wrapped()->n ) {
+    SPARSELIB_TRACE_SCOPE("csparse qr factor");
+    cs_t const * A = mat.wrapped().get();
+    cs_unique_ptr<cs_t> Ap;
+    index_t order = 3;
+    if ( opts.pivoting ) {
+        std::vector<value_t> norms( cols_, value_t{0} );
+        mat.for_each_nonzero( [&norms](index_t, index_t j, value_t v) { norms[j] += v * v; } );
+        std::vector<index_t> q( cols_ );
+        std::iota( q.begin(), q.end(), index_t(0) );
+        std::stable_sort( q.begin(), q.end(), [&norms](index_t a, index_t b) { return norms[a] > norms[b]; } );
+        Ap = cs_unique_ptr<cs_t>( lib::permute( A, nullptr, q.data(), 1 ) );
+        A = Ap.get();
+        order = 0;
+    }
+    symbolic_ = symbolic_analysis( order, A, 1 );
+    numeric_  = cs_unique_ptr<csn_t>( lib::qr( A, symbolic_.get() ) );
+
+    // reverse the solve permutation, once
+    auto P = cs_unique_ptr<index_t>( lib::pinv( symbolic_->pinv, rows_ ) );
+    P_.assign( P.get(), P.get() + rows_ );
+
+    // Without column pivoting a small R diagonal doesn't make a direction dispensable:
+    // a later column can still lie mostly along it.  So a direction is only dropped
+    // when its whole row of R - its part in every column of A - is within tolerance
+    double tol = ( opts.tolerance >= 0 ) ? opts.tolerance * max_column_norm( mat ) : -1.0;
+    cs_t const * R = numeric_->U;
+    std::vector<double> row_max( R->m, 0.0 );
+    for ( index_t j = 0; j < R->n; ++j ) {
+        for ( index_t p = R->p[j]; p < R->p[j+1]; ++p ) {
+            row_max[R->i[p]] = std::max( row_max[R->i[p]], double( std::abs( R->x[p] ) ) );
+        }
+    }
+    for ( index_t k = 0; k < numeric_->L->n; ++k ) {
+        if ( (tol < 0) || (row_max[k] > tol) ) {
+            kept_.push_back( k );
+        }
     }
+}
+
+template<typename Index, typename Value>
+auto
+CSparseShimT<Index, Value>::qr_t::Q() const -> sparsemat_t {
+    std::vector<value_t> Q( rows_ * rank() );
+    workspace_t ws;
+    Q_into( Q.data(), ws );
+    return dense_to_sparse(Q, rows_, rank());
+}
+
+template<typename Index, typename Value>
+void
+CSparseShimT<Index, Value>::qr_t::Q_into( value_t * q, workspace_t & ws ) const {
+    SPARSELIB_TRACE_SCOPE("csparse qr Q");
+    // allocate workspace (the first time)
+    std::vector<value_t> & x = ws.factor;
+    x.resize( symbolic_->m2 );
+
+    cs_t* V = numeric_->L;
 
     // proceed one column at a time (see cs_qrsol.c)
-    for ( index_t j = 0; j < rank; j++) {
-        double * col = &Q[rows_*j];
-        // make x a copy of the jth column of I
-        std::copy(col, col+rows_, x.data());
+    for ( index_t c = 0; c < rank(); c++) {
+        index_t j = kept_[c];
+        value_t * col = q + rows_*c;
+        // make x the jth column of I
+        std::fill(x.begin(), x.end(), value_t{0});
+        if ( j < rows_ ) {
+            x[j] = value_t(1);
+        }
 
         // apply the Householder vectors that comprise Q
         for (index_t k = j; k >= 0; k--) {
-            cs_happly( V, k, numeric_->B[k], x.data() );
+            lib::happly( V, k, numeric_->B[k], x.data() );
         }
 
         // apply the row permutation
-        cs_ipvec( P.get(), x.data(), col, rows_ );
+        lib::ipvec( P_.data(), x.data(), col, rows_ );
     }
-
-    return dense_to_sparse(Q, rows_, rank);
-
 }
 
 // utility functions
 
-CSparseShim::sparsemat_t
-CSparseShim::dense_to_sparse( std::vector<value_t> const& d, index_t rows, index_t cols ) {
+template<typename Index, typename Value>
+auto
+CSparseShimT<Index, Value>::symbolic_analysis( index_t order, cs_t const * A, index_t qr ) -> cs_unique_ptr<css_t> {
+    if ( !symbolic_cache::enabled() ) {
+        return cs_unique_ptr<css_t>( lib::sqr( order, A, qr ) );
+    }
+
+    std::string kind = std::string( qr ? "cs-qr" : "cs-lu" ) + std::to_string( order );
+    auto hash = symbolic_cache::pattern_hash( A->m, A->n, A->p, A->i );
+    index_t m = A->m, n = A->n;
+
+    // stored arrays, in order: pinv, q, parent, cp, leftmost.  Before any of them is
+    // trusted, the sizes and index ranges are checked against this matrix
+    symbolic_cache::record rec( m, n, A->p[n] );
+    if ( symbolic_cache::load( kind, hash, rec ) &&
+         ( rec.arrays.size() == 5 ) && ( rec.scalars.size() == 3 ) &&
+         ( rec.scalars[0] >= m ) && ( rec.scalars[0] <= m + n ) &&
+         rec.fits( 0, m + n, 0, std::int64_t( rec.scalars[0] ) ) &&
+         rec.fits( 1, n, 0, n ) && rec.fits( 2, n, -1, n ) &&
+         rec.fits( 3, n, 0, std::int64_t( rec.scalars[0] ) + 1 ) && rec.fits( 4, m, -1, n ) ) {
+        auto restore = []( symbolic_cache::record::array const & a ) -> index_t * {
+            if ( !a.present ) {
+                return nullptr;
+            }
+            auto p = static_cast<index_t *>( lib::malloc( std::max<index_t>( a.data.size(), 1 ),
+                                                        sizeof(index_t) ) );
+            std::copy( a.data.begin(), a.data.end(), p );
+            return p;
+        };
+        cs_unique_ptr<css_t> S( static_cast<css_t *>( lib::calloc( 1, sizeof(css_t) ) ) );
+        S->pinv     = restore( rec.arrays[0] );
+        S->q        = restore( rec.arrays[1] );
+        S->parent   = restore( rec.arrays[2] );
+        S->cp       = restore( rec.arrays[3] );
+        S->leftmost = restore( rec.arrays[4] );
+        S->m2       = index_t( rec.scalars[0] );
+        S->lnz      = rec.scalars[1];
+        S->unz      = rec.scalars[2];
+        return S;
+    }
+
+    cs_unique_ptr<css_t> S( lib::sqr( order, A, qr ) );
+    if ( S ) {
+        rec.add_array( S->pinv,     m + n );    // cs_vcount allocates extra for fictitious rows
+        rec.add_array( S->q,        n );
+        rec.add_array( S->parent,   n );
+        rec.add_array( S->cp,       n );        // cs_counts: one count per column
+        rec.add_array( S->leftmost, m );
+        rec.scalars = { double( S->m2 ), S->lnz, S->unz };
+        symbolic_cache::store( kind, hash, rec );
+    }
+    return S;
+}
+
+template<typename Index, typename Value>
+auto
+CSparseShimT<Index, Value>::dense_to_sparse( std::vector<value_t> const& d, index_t rows, index_t cols ) -> sparsemat_t {
+    SPARSELIB_TRACE_SCOPE("csparse dense_to_sparse");
 
     // we need to count the nonzeros to allocate
     index_t result_nz = count_if(d.begin(), d.end(),
                                  [](value_t x) { return x != value_t(0); });
 
-    cs_unique_ptr<cs> result(cs_spalloc(rows, cols, result_nz, 1, 1));
+    cs_unique_ptr<cs_t> result(lib::spalloc(rows, cols, result_nz, 1, 1));
 
     for ( index_t j = 0; j < cols; ++j) {
         for ( index_t i = 0; i < rows; ++i) {
             if ( d[rows*j+i] != value_t(0) ) {
-                assert(cs_entry(result.get(), i, j, d[rows*j+i]));
+                bool added = lib::entry(result.get(), i, j, d[rows*j+i]);
+                assert(added);
+                (void)added;
             }
         }
     }
 
-    return sparsemat_t(make_cs_shared_ptr(cs_compress(result.get())));
+    return sparsemat_t(make_cs_shared_ptr(lib::compress(result.get())));
 
 }
 
-std::ostream& operator<<(std::ostream& os, CSparseShim::sparsemat_t const & m) {
+template<typename Index, typename Value>
+void
+CSparseShimT<Index, Value>::sparsemat_t::print(std::ostream& os) const {
     assert(&os == &std::cout);   // because cs_print only does stdout
-    cs_print( m.wrapped().get(), 0 );
+    (void)os;
+    lib::print( wrapped().get(), 0 );
     fflush(stdout);
-
-    return os;
 }
+
+// the flavors we build
+template struct CSparseShimT<int, double>;
+template struct CSparseShimT<cs_long_t, double>;
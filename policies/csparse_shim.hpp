@@ -1,17 +1,82 @@
+#ifndef CSPARSE_SHIM_HPP
+#define CSPARSE_SHIM_HPP
+
 #include <memory>
 #include <cassert>
 #include <limits>
 #include <algorithm>
 #include <vector>
 #include <iostream>
+#include <string>
+#include <stdexcept>
+#include <new>
+#include <numeric>
+#include <cmath>
 
 #include <boost/iterator/iterator_facade.hpp>
 
 #include <cs.h>
 
-struct CSparseShim {
-    using index_t = CS_INT;     // for options, refer to CS_LONG and CS_COMPLEX in cs.h
-    using value_t = CS_ENTRY;
+#include "lowrank_update.hpp"
+#include "symbolic_cache.hpp"
+#include "lu_file.hpp"
+#include "level_schedule.hpp"
+#include "solve_workspace.hpp"
+#include "qr_options.hpp"
+#include "lu_options.hpp"
+#include "trace.hpp"
+#include "triplet_compress.hpp"
+
+// CSparse (as found in CXSparse) comes in flavors named for their value and index
+// types: cs_di, cs_dl, cs_ci, cs_cl.  cs_traits maps our types onto one of them
+// through inline forwarding functions, so there is no cost over calling it directly.
+// Only the real flavors are defined.
+template<typename Index, typename Value> struct cs_traits;
+
+#define CSPARSE_TRAITS(I, PX, CS, CSS, CSN)                                                     \
+template<> struct cs_traits<I, double> {                                                       \
+    using matrix_t   = CS;                                                                     \
+    using symbolic_t = CSS;                                                                    \
+    using numeric_t  = CSN;                                                                    \
+    static CS * spalloc(I m, I n, I nzmax, I values, I t) { return PX##spalloc(m, n, nzmax, values, t); } \
+    static I entry(CS * T, I i, I j, double x) { return PX##entry(T, i, j, x); }               \
+    static CS * compress(CS const * T) { return PX##compress(T); }                             \
+    static CS * add(CS const * A, CS const * B, double a, double b) { return PX##add(A, B, a, b); } \
+    static CS * multiply(CS const * A, CS const * B) { return PX##multiply(A, B); }            \
+    static CS * permute(CS const * A, I const * pinv, I const * q, I values) { return PX##permute(A, pinv, q, values); } \
+    static void spfree(CS * A) { PX##spfree(A); }                                              \
+    static void sfree(CSS * S) { PX##sfree(S); }                                               \
+    static void nfree(CSN * N) { PX##nfree(N); }                                               \
+    static void free(void * p) { PX##free(p); }                                                \
+    static void * malloc(I n, std::size_t size) { return PX##malloc(n, size); }                \
+    static void * calloc(I n, std::size_t size) { return PX##calloc(n, size); }                \
+    static CSS * sqr(I order, CS const * A, I qr) { return PX##sqr(order, A, qr); }            \
+    static CSN * lu(CS const * A, CSS const * S, double tol) { return PX##lu(A, S, tol); }     \
+    static CSN * qr(CS const * A, CSS const * S) { return PX##qr(A, S); }                      \
+    static I ipvec(I const * p, double const * b, double * x, I n) { return PX##ipvec(p, b, x, n); } \
+    static I lsolve(CS const * L, double * x) { return PX##lsolve(L, x); }                     \
+    static I usolve(CS const * U, double * x) { return PX##usolve(U, x); }                     \
+    static I happly(CS const * V, I i, double beta, double * x) { return PX##happly(V, i, beta, x); } \
+    static I * pinv(I const * p, I n) { return PX##pinv(p, n); }                               \
+    static I print(CS const * A, I brief) { return PX##print(A, brief); }                      \
+}
+
+CSPARSE_TRAITS(int, cs_di_, cs_di, cs_dis, cs_din);
+CSPARSE_TRAITS(cs_long_t, cs_dl_, cs_dl, cs_dls, cs_dln);
+
+#undef CSPARSE_TRAITS
+
+// Index and Value select the CSparse flavor: 32 bit indices for most matrices,
+// 64 bit (cs_long_t) for those with more than 2^31 nonzeros in the matrix or its factors
+template<typename Index = CS_INT, typename Value = CS_ENTRY>
+struct CSparseShimT {
+    using index_t = Index;
+    using value_t = Value;
+
+    using lib   = cs_traits<index_t, value_t>;
+    using cs_t  = typename lib::matrix_t;
+    using css_t = typename lib::symbolic_t;
+    using csn_t = typename lib::numeric_t;
 
     struct triplet_t {
         index_t row;
@@ -21,18 +86,18 @@ struct CSparseShim {
 
     // RAII memory management for C data
     struct cs_deleter {
-        void operator()(cs *p) {
-            cs_spfree(p);
+        void operator()(cs_t *p) {
+            lib::spfree(p);
         }
-        void operator()(csn *p) {
-            cs_nfree(p);
+        void operator()(csn_t *p) {
+            lib::nfree(p);
         }
-        void operator()(css *p) {
-            cs_sfree(p);
+        void operator()(css_t *p) {
+            lib::sfree(p);
         }
         template<typename T>
         void operator()(T *p) {
-            cs_free(p);
+            lib::free(p);
         }
     };
 
@@ -49,7 +114,7 @@ struct CSparseShim {
                                  triplet_t const,
                                  boost::forward_traversal_tag> {
         sparse_entry_iterator() {}
-        sparse_entry_iterator( cs_shared_ptr<cs> mat )
+        sparse_entry_iterator( cs_shared_ptr<cs_t> mat )
             : mat_(std::move(mat)), entry_{index_t(0), index_t(0), value_t(0)} {
             advance_to_valid();
         }
@@ -71,30 +136,40 @@ struct CSparseShim {
         // find the next nonzero entry and set the dereference value
         void advance_to_valid();
 
-        cs_shared_ptr<cs> mat_;
+        cs_shared_ptr<cs_t> mat_;
         triplet_t entry_;     // for supplying references
     };
 
 
     struct sparsemat_t;
 
+    // cs_sqr, but consulting the on-disk symbolic cache (if enabled) first
+    static cs_unique_ptr<css_t>
+    symbolic_analysis( index_t order, cs_t const * A, index_t qr );
+
     static sparsemat_t
     dense_to_sparse( std::vector<value_t> const& d, index_t rows, index_t cols );
 
     struct sparsemat_t {
         template<typename Iter>
         sparsemat_t(index_t rows, index_t cols, Iter start, Iter end) {
-            // create a triplet matrix
-            auto TG = cs_unique_ptr<cs>(cs_spalloc(rows, cols, std::distance(start, end), 1, 1));
-            for ( auto it = start; it < end; ++it ) {
-                assert(cs_entry(TG.get(), it->row, it->col, it->value));
-            }
-                
-            // create a "cs" structure from the triplet matrix
-            mat_ = make_cs_shared_ptr(cs_compress(TG.get()));
+            SPARSELIB_TRACE_SCOPE("csparse compress");
+            // straight into a compressed matrix, duplicates summed; CSparse doesn't need sorted rows
+            cs_unique_ptr<cs_t> A;
+            triplet_compress::compress<index_t, value_t>(
+                rows, cols, start, end,
+                [&A, rows, cols](index_t nnz) {
+                    A.reset(lib::spalloc(rows, cols, nnz, 1, 0));
+                    if ( !A ) {
+                        throw std::bad_alloc();
+                    }
+                    return triplet_compress::csc_arrays<index_t, value_t>{A->p, A->i, A->x};
+                },
+                false);
+            mat_ = make_cs_shared_ptr(A.release());
         }
 
-        sparsemat_t( cs_shared_ptr<cs> mat_cs ) : mat_(std::move(mat_cs)) {}
+        sparsemat_t( cs_shared_ptr<cs_t> mat_cs ) : mat_(std::move(mat_cs)) {}
 
         index_t rows() const { return wrapped()->m; }
         index_t cols() const { return wrapped()->n; }
@@ -106,47 +181,171 @@ struct CSparseShim {
             return sparse_entry_iterator();
         }
 
-        friend sparsemat_t operator*(sparsemat_t const& a, sparsemat_t const& b);
-        friend std::ostream& operator<<(std::ostream& os, sparsemat_t const & m);
+        friend sparsemat_t operator*(sparsemat_t const& a, sparsemat_t const& b) {
+            return sparsemat_t(make_cs_shared_ptr(lib::multiply(a.mat_.get(), b.mat_.get())));
+        }
+        friend std::ostream& operator<<(std::ostream& os, sparsemat_t const & m) {
+            m.print(os);
+            return os;
+        }
 
-        cs_shared_ptr<const cs> wrapped() const {
+        cs_shared_ptr<const cs_t> wrapped() const {
             return mat_;
         }
 
+        // the stored values, in the order for_each_nonzero visits them, for changing
+        // values in place.  Copies of this matrix (including the ones inside lu_t) share them
+        value_t * value_data() { return mat_->x; }
+
+        // visit each stored entry as f(row, col, value)
+        template<typename F>
+        void for_each_nonzero( F && f ) const {
+            for ( index_t j = 0; j < mat_->n; ++j ) {
+                for ( index_t k = mat_->p[j]; k < mat_->p[j+1]; ++k ) {
+                    f(mat_->i[k], j, mat_->x[k]);
+                }
+            }
+        }
+
     private:
-        cs_shared_ptr<cs> mat_;      // we have to share this structure with LU and QR objects
+        void print(std::ostream& os) const;
+
+        cs_shared_ptr<cs_t> mat_;      // we have to share this structure with LU and QR objects
     };
 
     struct lu_t {
-        lu_t( sparsemat_t const & mat )
-            : symbolic_( cs_sqr( 3, mat.wrapped().get(), 0 )),
-              numeric_ ( cs_lu ( mat.wrapped().get(), symbolic_.get(),
-                                 std::numeric_limits<value_t>::epsilon() )) {}
+        // update() refactors instead once the change touches more columns than this
+        static constexpr index_t default_max_update_rank = 32;
+
+        lu_t( sparsemat_t const & mat, index_t max_update_rank = default_max_update_rank )
+            : lu_t(mat, lu_options(), max_update_rank) {}
+
+        // Without a pivot tolerance we use machine epsilon, so the diagonal is nearly always kept
+        lu_t( sparsemat_t const & mat, lu_options const & opts,
+              index_t max_update_rank = default_max_update_rank )
+            : mat_(mat), max_update_rank_(max_update_rank), opts_(opts) {
+            factor();
+        }
+
+        using workspace_t = solve_workspace<value_t>;
 
         sparsemat_t solve(sparsemat_t const& rhs) const;
 
+        // Solve into caller-owned dense column-major storage (size x ncols), taking scratch
+        // space from "ws".  Given the same workspace each time, repeated calls don't allocate.
+        // b and x may be the same
+        void solve_into(value_t const * b, index_t ncols, value_t * x, workspace_t & ws) const;
+        void solve_into(sparsemat_t const& rhs, value_t * x, workspace_t & ws) const;
+
+        // entries in L and U; each costs a multiply and an add per solved column
+        index_t factor_nonzeros() const {
+            return mapped_ ? mapped_->nonzeros() : numeric_->L->p[size()] + numeric_->U->p[size()];
+        }
+
+        // Bytes the factors of mat should take, from the symbolic analysis alone: cs_sqr's
+        // lnz and unz, which cs_lu starts with and grows from if it has to
+        static std::size_t estimate_bytes(sparsemat_t const& mat);
+
+        // Add "delta" (for example the changed stamps of a few elements) to the factored
+        // matrix.  Later solves are against the modified matrix.  Small changes are handled
+        // with a low-rank correction to the existing factors; large ones trigger a refactor
+        void update(std::vector<triplet_t> const& delta);
+        // the same, taking scratch space for the solves that build the correction from "ws"
+        void update(std::vector<triplet_t> const& delta, workspace_t & ws);
+
+        // Factor new values with the pattern already factored (mat may be the same matrix,
+        // its values changed in place).  Any update()s are discarded.  With static pivoting
+        // the rows are first put in the last pivot order, so cs_lu with a tolerance of zero
+        // takes every pivot from the diagonal and the symbolic analysis is reused
+        void refactor(sparsemat_t const& mat);
+
+        lu_diagnostics const & diagnostics() const { return diag_; }
+
+        // Write the factors to a file, for later use by load()
+        void save(std::string const& path) const;
+
+        // Map a saved factorization back in, read-only.  The result solves straight
+        // out of the mapping; it accepts small updates but cannot be refactored
+        static lu_t load(std::string const& path);
+
     private:
-        cs_unique_ptr<css> symbolic_;
-        cs_unique_ptr<csn> numeric_;
+        using mapped_t = lu_file::mapped_factor<value_t, index_t>;
+
+        explicit lu_t( std::shared_ptr<mapped_t const> mapped )
+            : mat_(cs_shared_ptr<cs_t>()), max_update_rank_(default_max_update_rank),
+              mapped_(std::move(mapped)) {}
+
+        void factor();
+
+        // level sets and diagnostics for newly computed numeric_
+        void factored( bool static_pivots );
+
+        double tolerance() const {
+            return (opts_.pivot_tolerance >= 0) ? opts_.pivot_tolerance
+                                                : std::numeric_limits<value_t>::epsilon();
+        }
+
+        // the factors in lu_file's form; P is the row permutation (CSparse keeps its inverse)
+        lu_file::factor_view<value_t, index_t> factors( index_t const * P ) const;
+
+        index_t size() const { return mapped_ ? mapped_->size() : mat_.rows(); }
+
+        // overwrite a dense column-major matrix with the solution, ignoring any update
+        void solve_factored(value_t * x, index_t ncols, std::vector<value_t> & w) const;
+
+        sparsemat_t    mat_;           // what symbolic_ and numeric_ describe
+        index_t        max_update_rank_;
+        lu_options     opts_;
+        lu_diagnostics diag_;
+
+        cs_unique_ptr<css_t> symbolic_;
+        cs_unique_ptr<csn_t> numeric_;
+
+        // level sets of L and U, computed once per factorization for parallel solves
+        std::unique_ptr<level_schedule::lu_solver<value_t, index_t>> schedule_;
+
+        std::shared_ptr<mapped_t const> mapped_;     // instead of the above, when loaded
+
+        std::vector<triplet_t> delta_;   // accumulated changes since the last factor
+        std::unique_ptr<lowrank_update<value_t, index_t>> update_;
 
     };
 
     struct qr_t {
-        qr_t( sparsemat_t const & mat )
-            : symbolic_( cs_sqr( 3, mat.wrapped().get(), 1 ) ),
-              numeric_ ( cs_qr ( mat.wrapped().get(), symbolic_.get() ) ),
-              rows_    ( mat.wrapped()->m ),
-              cols_    ( mat.wrapped()->n ) {}
+        // cs_qr doesn't pivot, so with a tolerance a direction is left out of Q only when
+        // its entire row of R is within it (a small diagonal alone isn't enough: a later
+        // column may still need that direction).  "pivoting" orders the columns by
+        // decreasing norm in place of the fill-reducing order, which tends to push the
+        // negligible directions to the end but is not rank revealing by itself
+        qr_t( sparsemat_t const & mat, qr_options const & opts = qr_options() );
+
+        using workspace_t = solve_workspace<value_t>;
 
         sparsemat_t Q() const;
 
+        index_t rows() const { return rows_; }
+        index_t rank() const { return index_t(kept_.size()); }     // the columns of Q
+
+        // Q as a dense column-major rows() x rank() matrix in caller-owned storage
+        void Q_into(value_t * q, workspace_t & ws) const;
+
     private:
 
-        cs_unique_ptr<css> symbolic_;
-        cs_unique_ptr<csn> numeric_;
+        cs_unique_ptr<css_t> symbolic_;
+        cs_unique_ptr<csn_t> numeric_;
 
         index_t rows_, cols_;
+        std::vector<index_t> P_;
+        std::vector<index_t> kept_;     // the directions that go into Q
 
     };
 
 };
+
+extern template struct CSparseShimT<int, double>;
+extern template struct CSparseShimT<cs_long_t, double>;
+
+using CSparseShim   = CSparseShimT<>;
+using CSparseShim64 = CSparseShimT<cs_long_t, double>;
+
+#endif // CSPARSE_SHIM_HPP
@@ -0,0 +1,107 @@
+// Benchmark data for the dispatching policy's cost model
+//
+// Times a factor and solve with every backend (Dispatch::benchmark) over a sweep of
+// circuit-like matrices: resistive grids, ladders, and several independent grids in
+// one matrix (for the components term), each with one and with eight right hand
+// sides.  The samples are written as CSV for SPARSELIB_COST_MODEL (or the build's
+// default, see dispatch_shim.hpp), and the coefficients fitted to them are printed
+// in the layout of the cost_model constructor.
+//
+// usage: dispatch_calibrate [csv file] [largest grid side]
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "dispatch_shim.hpp"
+
+using namespace Dispatch;
+using index_t   = Shim::index_t;
+using triplet_t = Shim::triplet_t;
+
+// "copies" independent k x k grids, each with a little leakage to ground
+static std::vector<triplet_t>
+grids( index_t k, index_t copies ) {
+    std::vector<triplet_t> t;
+    for ( index_t g = 0; g < copies; ++g ) {
+        index_t base = g * k * k;
+        for ( index_t r = 0; r < k; ++r ) {
+            for ( index_t c = 0; c < k; ++c ) {
+                index_t v = base + r * k + c;
+                double d = 1e-3;
+                auto stamp = [&t, &d, v]( index_t w ) {
+                    t.push_back(triplet_t{v, w, -1.0});
+                    d += 1.0;
+                };
+                if ( r > 0 )     stamp(v - k);
+                if ( c > 0 )     stamp(v - 1);
+                if ( c + 1 < k ) stamp(v + 1);
+                if ( r + 1 < k ) stamp(v + k);
+                t.push_back(triplet_t{v, v, d});
+            }
+        }
+    }
+    return t;
+}
+
+// a two-rail ladder of n nodes, unsymmetric through its rails
+static std::vector<triplet_t>
+ladder( index_t n ) {
+    std::vector<triplet_t> t;
+    for ( index_t v = 0; v < n; ++v ) {
+        t.push_back(triplet_t{v, v, 3.0 + 1e-3});
+        if ( v + 2 < n ) {
+            t.push_back(triplet_t{v, v + 2, -1.0});
+            t.push_back(triplet_t{v + 2, v, -0.9});
+        }
+        if ( (v % 2 == 0) && (v + 1 < n) ) {
+            t.push_back(triplet_t{v, v + 1, -0.5});
+            t.push_back(triplet_t{v + 1, v, -0.5});
+        }
+    }
+    return t;
+}
+
+static Shim::sparsemat_t
+rhs( index_t n, index_t cols ) {
+    std::vector<triplet_t> t;
+    for ( index_t c = 0; c < cols; ++c ) {
+        t.push_back(triplet_t{(c * 7919) % n, c, 1.0});
+    }
+    return Shim::sparsemat_t(n, cols, t.begin(), t.end());
+}
+
+int main( int argc, char ** argv ) {
+    std::string path = (argc > 1) ? argv[1] : "dispatch_cost_model.csv";
+    index_t largest  = (argc > 2) ? index_t(std::atoi(argv[2])) : 120;
+
+    std::vector<sample> samples;
+    auto run = [&samples]( index_t n, std::vector<triplet_t> const & t ) {
+        Shim::sparsemat_t A(n, n, t.begin(), t.end());
+        for ( index_t cols : {1, 8} ) {
+            auto s = benchmark(A, rhs(n, cols));
+            samples.insert(samples.end(), s.begin(), s.end());
+        }
+    };
+    for ( index_t k = 10; k <= largest; k = index_t(k * 1.6) ) {
+        run(k * k, grids(k, 1));
+        run(k * k, ladder(k * k));
+        run(4 * (k / 2) * (k / 2), grids(k / 2, 4));
+    }
+    save_samples(path, samples);
+    std::cerr << samples.size() << " samples written to " << path << "\n";
+
+    cost_model m;
+    m.calibrate(samples);
+    std::printf("    //           1        log n   log nnz/n  log comp.  log rhs\n");
+    for ( int b = 0; b < nbackends; ++b ) {
+        std::printf("    coef[int(backend_id::%s)] = {{", name(backend_id(b)));
+        for ( int i = 0; i < cost_model::nterms; ++i ) {
+            std::printf(" %7.3f%s", m.coef[b][i], (i + 1 < cost_model::nterms) ? "," : "");
+        }
+        std::printf(" }};\n");
+    }
+}
@@ -0,0 +1,27 @@
+// The CSparse policy as a run time dispatch backend
+
+#include "dispatch_shim.hpp"
+#include "csparse_shim.hpp"
+
+namespace Dispatch {
+namespace detail {
+
+template<>
+Shim::sparsemat_t
+from_native<CSparseShim>( CSparseShim::sparsemat_t const & m ) {
+    auto A = m.wrapped();
+    assert( A->nz == -1 );     // compressed column, not triplet
+    std::vector<Shim::index_t> p(A->p, A->p + A->n + 1);
+    std::vector<Shim::index_t> i(A->i, A->i + A->p[A->n]);
+    std::vector<Shim::value_t> x(A->x, A->x + A->p[A->n]);
+    return Shim::sparsemat_t(A->m, A->n, std::move(p), std::move(i), std::move(x));
+}
+
+backend const &
+csparse_backend() {
+    static policy_backend<CSparseShim> b;
+    return b;
+}
+
+}
+}
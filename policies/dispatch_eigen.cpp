@@ -0,0 +1,55 @@
+// The Eigen based policies (direct and iterative) as run time dispatch backends
+
+#include "dispatch_shim.hpp"
+#include "iterative_shim.hpp"      // also brings in the Eigen policy
+
+namespace Dispatch {
+namespace detail {
+
+namespace {
+
+Shim::sparsemat_t
+from_eigen( Eigen::SparseMatrix<double> const & w ) {
+    std::vector<Shim::index_t> p(1, 0), i;
+    std::vector<Shim::value_t> x;
+    p.reserve(w.outerSize() + 1);
+    i.reserve(w.nonZeros());
+    x.reserve(w.nonZeros());
+    for ( Eigen::Index k = 0; k < w.outerSize(); ++k ) {
+        for ( Eigen::SparseMatrix<double>::InnerIterator it(w, k); it; ++it ) {
+            i.push_back(it.row());
+            x.push_back(it.value());
+        }
+        p.push_back(Shim::index_t(i.size()));
+    }
+    return Shim::sparsemat_t(w.rows(), w.cols(), std::move(p), std::move(i), std::move(x));
+}
+
+}
+
+template<>
+Shim::sparsemat_t
+from_native<EigenShim>( EigenShim::sparsemat_t const & m ) {
+    return from_eigen(m.wrapped());
+}
+
+template<>
+Shim::sparsemat_t
+from_native<IterativeShim>( IterativeShim::sparsemat_t const & m ) {
+    return from_eigen(m.wrapped());
+}
+
+backend const &
+eigen_backend() {
+    static policy_backend<EigenShim> b;
+    return b;
+}
+
+backend const &
+iterative_backend() {
+    static policy_backend<IterativeShim> b;
+    return b;
+}
+
+}
+}
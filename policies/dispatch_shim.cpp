@@ -0,0 +1,362 @@
+// Backend selection and our own sparse matrix for the run time dispatching policy
+
+#include "dispatch_shim.hpp"
+
+#include <cmath>
+#include <chrono>
+#include <limits>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+
+#include "lowrank_update.hpp"     // for dense_lu
+#include "trace.hpp"
+
+namespace Dispatch {
+
+namespace {
+
+char const * const names[nbackends] = { "eigen", "csparse", "suitesparse", "iterative" };
+
+std::array<double, cost_model::nterms>
+terms( features const & f ) {
+    return { 1.0,
+             std::log(std::max(f.n, 1.0)),
+             std::log(std::max(f.nnz / std::max(f.n, 1.0), 1.0)),
+             std::log(std::max(f.components, 1.0)),
+             std::log(std::max(f.rhs, 1.0)) };
+}
+
+// the cheapest backend that isn't "exclude"
+backend_id
+cheapest( cost_model const & m, features const & f, int exclude = -1 ) {
+    int best = -1;
+    for ( int b = 0; b < nbackends; ++b ) {
+        if ( (b != exclude) &&
+             ((best < 0) || (m.predict(backend_id(b), f) < m.predict(backend_id(best), f))) ) {
+            best = b;
+        }
+    }
+    return backend_id(best);
+}
+
+}
+
+char const * name( backend_id which ) {
+    return names[int(which)];
+}
+
+cost_model::cost_model() {
+    // The prior, following the usual folklore: CSparse for small problems, KLU for
+    // mid sized circuits (more so with block structure), supernodal LU above that, and
+    // iterative methods only for the very largest.  Measurements replace it (see model())
+    //           1        log n   log nnz/n  log comp.  log rhs
+    coef[int(backend_id::eigen)]       = {{ -15.76, 1.2,  1.0,   0.0,  0.3 }};
+    coef[int(backend_id::csparse)]     = {{ -17.6,  1.4,  1.0,   0.0,  0.3 }};
+    coef[int(backend_id::suitesparse)] = {{ -16.91, 1.3,  1.0,  -0.05, 0.3 }};
+    coef[int(backend_id::iterative)]   = {{ -13.0,  1.0,  1.0,   0.0,  0.9 }};
+}
+
+void
+cost_model::calibrate( std::vector<sample> const & samples ) {
+    constexpr double lambda = 1e-2;     // weight of the current coefficients
+    for ( int b = 0; b < nbackends; ++b ) {
+        // normal equations (X^T X + lambda I) c = X^T y + lambda c_old
+        std::vector<double> A(nterms * nterms, 0.0);
+        std::vector<double> rhs(nterms, 0.0);
+        std::size_t count = 0;
+        for ( auto const & s : samples ) {
+            if ( (int(s.backend) != b) || !(s.seconds > 0) ) {
+                continue;
+            }
+            auto x = terms(s.f);
+            double y = std::log(s.seconds);
+            for ( int j = 0; j < nterms; ++j ) {
+                for ( int i = 0; i < nterms; ++i ) {
+                    A[j * nterms + i] += x[i] * x[j];
+                }
+                rhs[j] += x[j] * y;
+            }
+            ++count;
+        }
+        if ( count == 0 ) {
+            continue;
+        }
+        for ( int i = 0; i < nterms; ++i ) {
+            A[i * nterms + i] += lambda;
+            rhs[i] += lambda * coef[b][i];
+        }
+        dense_lu<double, int> lu(std::move(A), nterms);
+        if ( lu.singular() ) {
+            continue;
+        }
+        lu.solve(rhs.data());
+        std::copy(rhs.begin(), rhs.end(), coef[b].begin());
+    }
+}
+
+double
+cost_model::predict( backend_id which, features const & f ) const {
+    auto x = terms(f);
+    return std::inner_product(x.begin(), x.end(), coef[int(which)].begin(), 0.0);
+}
+
+backend_id
+cost_model::choose( features const & f ) const {
+    return cheapest(*this, f);
+}
+
+cost_model &
+model() {
+    static cost_model m = [] {
+        cost_model cm;
+        char const * path = std::getenv("SPARSELIB_COST_MODEL");
+        if ( path ) {
+            cm.calibrate(load_samples(path));
+        }
+#ifdef SPARSELIB_DEFAULT_COST_MODEL
+        // what dispatch_calibrate measured when we were built, if it is still there
+        else if ( std::ifstream(SPARSELIB_DEFAULT_COST_MODEL) ) {
+            cm.calibrate(load_samples(SPARSELIB_DEFAULT_COST_MODEL));
+        }
+#endif
+        return cm;
+    }();
+    return m;
+}
+
+std::vector<sample>
+load_samples( std::string const & path ) {
+    std::ifstream is(path);
+    if ( !is ) {
+        throw std::runtime_error("cannot open benchmark data " + path);
+    }
+    std::vector<sample> samples;
+    std::string line;
+    while ( std::getline(is, line) ) {
+        std::istringstream ls(line);
+        std::string backend;
+        if ( !std::getline(ls, backend, ',') ) {
+            continue;
+        }
+        auto it = std::find(std::begin(names), std::end(names), backend);
+        if ( it == std::end(names) ) {
+            continue;       // header, or a backend we don't have
+        }
+        sample s;
+        s.backend = backend_id(it - std::begin(names));
+        char c1, c2, c3, c4;
+        if ( ls >> s.f.n >> c1 >> s.f.nnz >> c2 >> s.f.components >> c3 >> s.f.rhs >> c4 >> s.seconds ) {
+            s.f.density = s.f.nnz / std::max(s.f.n * s.f.n, 1.0);
+            samples.push_back(s);
+        }
+    }
+    return samples;
+}
+
+void
+save_samples( std::string const & path, std::vector<sample> const & samples ) {
+    std::ofstream os(path);
+    os << "backend,n,nnz,components,rhs,seconds\n";
+    os << std::setprecision(std::numeric_limits<double>::digits10);
+    for ( auto const & s : samples ) {
+        os << name(s.backend) << "," << s.f.n << "," << s.f.nnz << "," << s.f.components << ","
+           << s.f.rhs << "," << s.seconds << "\n";
+    }
+    if ( !os ) {
+        throw std::runtime_error("error writing benchmark data " + path);
+    }
+}
+
+features
+measure( Shim::sparsemat_t const & A, double rhs ) {
+    SPARSELIB_TRACE_SCOPE("dispatch measure");
+    using index_t = Shim::index_t;
+    index_t n = std::max(A.rows(), A.cols());    // QR sees rectangular matrices
+
+    // count connected components with union-find
+    std::vector<index_t> parent(n);
+    std::iota(parent.begin(), parent.end(), index_t(0));
+    auto find = [&parent](index_t v) {
+        while ( parent[v] != v ) {
+            parent[v] = parent[parent[v]];
+            v = parent[v];
+        }
+        return v;
+    };
+    index_t components = n;
+    for ( index_t j = 0; j < A.cols(); ++j ) {
+        for ( index_t k = A.colptr()[j]; k < A.colptr()[j+1]; ++k ) {
+            index_t a = find(A.rowind()[k]), b = find(j);
+            if ( a != b ) {
+                parent[a] = b;
+                --components;
+            }
+        }
+    }
+
+    features f;
+    f.n          = double(n);
+    f.nnz        = double(A.nonzeros());
+    f.density    = f.nnz / std::max(f.n * f.n, 1.0);
+    f.components = double(components);
+    f.rhs        = rhs;
+    return f;
+}
+
+std::vector<sample>
+benchmark( Shim::sparsemat_t const & A, Shim::sparsemat_t const & rhs, int repeats ) {
+    using clock = std::chrono::steady_clock;
+    features f = measure(A, double(rhs.cols()));
+    std::vector<sample> samples;
+    for ( int b = 0; b < nbackends; ++b ) {
+        double best = std::numeric_limits<double>::infinity();
+        try {
+            for ( int r = 0; r < repeats; ++r ) {
+                auto start = clock::now();
+                auto lu = detail::get(backend_id(b)).factor(A);
+                lu->solve(rhs);
+                best = std::min(best, std::chrono::duration<double>(clock::now() - start).count());
+            }
+        } catch ( std::runtime_error const & ) {
+            continue;
+        }
+        samples.push_back(sample{backend_id(b), f, best});
+    }
+    return samples;
+}
+
+void
+Shim::sparsemat_t::compress( index_t rows, index_t cols, std::vector<triplet_t> t ) {
+    rows_ = rows;
+    cols_ = cols;
+    std::sort(t.begin(), t.end(), [](triplet_t const & a, triplet_t const & b) {
+            return (a.col < b.col) || ((a.col == b.col) && (a.row < b.row));
+        });
+    p_.assign(cols + 1, 0);
+    i_.clear();
+    x_.clear();
+    for ( std::size_t k = 0; k < t.size(); ++k ) {
+        if ( (k > 0) && (t[k].col == t[k-1].col) && (t[k].row == t[k-1].row) ) {
+            x_.back() += t[k].value;      // duplicate
+            continue;
+        }
+        i_.push_back(t[k].row);
+        x_.push_back(t[k].value);
+        ++p_[t[k].col + 1];
+    }
+    std::partial_sum(p_.begin(), p_.end(), p_.begin());
+}
+
+Shim::sparsemat_t
+operator*( Shim::sparsemat_t const & a, Shim::sparsemat_t const & b ) {
+    using index_t = Shim::index_t;
+    using value_t = Shim::value_t;
+    // Gustavson's method: each column of the result is a combination of columns of a
+    std::vector<index_t> p(1, 0), i;
+    std::vector<value_t> x;
+    std::vector<value_t> acc(a.rows(), value_t(0));
+    std::vector<index_t> mark(a.rows(), -1);
+    for ( index_t j = 0; j < b.cols(); ++j ) {
+        index_t start = index_t(i.size());
+        for ( index_t kb = b.colptr()[j]; kb < b.colptr()[j+1]; ++kb ) {
+            index_t k = b.rowind()[kb];
+            for ( index_t ka = a.colptr()[k]; ka < a.colptr()[k+1]; ++ka ) {
+                index_t r = a.rowind()[ka];
+                if ( mark[r] != j ) {
+                    mark[r] = j;
+                    i.push_back(r);
+                }
+                acc[r] += a.values()[ka] * b.values()[kb];
+            }
+        }
+        std::sort(i.begin() + start, i.end());
+        for ( index_t k = start; k < index_t(i.size()); ++k ) {
+            x.push_back(acc[i[k]]);
+            acc[i[k]] = value_t(0);
+        }
+        p.push_back(index_t(i.size()));
+    }
+    return Shim::sparsemat_t(a.rows(), b.cols(), std::move(p), std::move(i), std::move(x));
+}
+
+std::ostream &
+operator<<( std::ostream & os, Shim::sparsemat_t const & m ) {
+    // Octave format, like the other policies
+    std::vector<Shim::value_t> dense(m.rows() * m.cols(), 0.0);
+    for ( Shim::index_t j = 0; j < m.cols(); ++j ) {
+        for ( Shim::index_t k = m.colptr()[j]; k < m.colptr()[j+1]; ++k ) {
+            dense[j * m.rows() + m.rowind()[k]] = m.values()[k];
+        }
+    }
+    auto flags = os.flags();
+    auto prec = os.precision(std::numeric_limits<Shim::value_t>::digits10);
+    os << "[";
+    for ( Shim::index_t i = 0; i < m.rows(); ++i ) {
+        for ( Shim::index_t j = 0; j < m.cols(); ++j ) {
+            os << dense[j * m.rows() + i] << ((j + 1 < m.cols()) ? ", " : "");
+        }
+        os << ((i + 1 < m.rows()) ? ";\n" : "");
+    }
+    os << "]";
+    os.flags(flags);
+    os.precision(prec);
+    return os;
+}
+
+Shim::lu_t::lu_t( sparsemat_t const & mat, index_t rhs_hint )
+    : lu_t(mat, model().choose(measure(mat, double(rhs_hint)))) {}
+
+Shim::lu_t::lu_t( sparsemat_t const & mat, backend_id which )
+    : mat_(mat), which_(which), lu_(detail::get(which).factor(mat)) {}
+
+Shim::sparsemat_t
+Shim::lu_t::solve( sparsemat_t const & rhs ) const {
+    SPARSELIB_TRACE_SCOPE("dispatch lu solve");
+    try {
+        return lu_->solve(rhs);
+    } catch ( std::runtime_error const & ) {
+        if ( which_ != backend_id::iterative ) {
+            throw;
+        }
+    }
+    // the iterative solver didn't converge; use the best direct method from now on
+    which_ = cheapest(model(), measure(mat_, double(rhs.cols())), int(backend_id::iterative));
+    lu_ = detail::get(which_).factor(mat_);
+    return lu_->solve(rhs);
+}
+
+void
+Shim::set_threads( thread_counts const & c ) {
+    for ( int b = 0; b < nbackends; ++b ) {
+        detail::get(backend_id(b)).set_threads(c);
+    }
+}
+
+// QR is rarely the expensive step for us, so it uses the LU model
+Shim::qr_t::qr_t( sparsemat_t const & mat, qr_options const & opts )
+    : qr_t(mat, model().choose(measure(mat, double(mat.cols()))), opts) {}
+
+Shim::qr_t::qr_t( sparsemat_t const & mat, backend_id which, qr_options const & opts )
+    : which_(which), Q_(detail::get(which).Q(mat, opts)) {}
+
+namespace detail {
+
+backend const &
+get( backend_id which ) {
+    switch ( which ) {
+    case backend_id::eigen:       return eigen_backend();
+    case backend_id::csparse:     return csparse_backend();
+    case backend_id::suitesparse: return suitesparse_backend();
+    case backend_id::iterative:   return iterative_backend();
+    }
+    throw std::logic_error("unknown sparse library backend");
+}
+
+}
+
+}
@@ -0,0 +1,255 @@
+// Implement SparseLibrary requirements by choosing among the other policies at run time
+// Every policy is compiled into one library behind a common (type erased) interface.
+// Each matrix is described by a few cheap structural features, and a cost model
+// calibrated from benchmark runs predicts which library will be fastest for it.
+
+#ifndef DISPATCH_SHIM_HPP
+#define DISPATCH_SHIM_HPP
+
+#include <array>
+#include <vector>
+#include <memory>
+#include <string>
+#include <iostream>
+
+#include "triplet_access.hpp"
+#include "qr_options.hpp"
+#include "thread_budget.hpp"
+
+namespace Dispatch {
+
+enum class backend_id { eigen, csparse, suitesparse, iterative };
+constexpr int nbackends = 4;
+
+char const * name( backend_id which );
+
+// What we know about a matrix (and its use) before choosing a library
+struct features {
+    double n;            // rows (and columns)
+    double nnz;
+    double density;      // nnz / n^2
+    double components;   // connected pieces of the graph of A + A^T; a cheap hint of block structure
+    double rhs;          // right hand side columns per solve
+};
+
+// One timed factor-and-solve run
+struct sample {
+    backend_id backend;
+    features   f;
+    double     seconds;
+};
+
+// Predicts log(seconds) for each backend as a linear function of
+//     1, log n, log(nnz/n), log components, log rhs
+// (density is nnz/n^2, so it's already covered by the first two)
+//
+// The built-in coefficients are only a prior, from the usual folklore about which
+// library suits which size.  The real figures come from timings on the machine at
+// hand: dispatch_calibrate runs every backend over a sweep of grids and ladders and
+// writes the samples, and the build runs it once so that its output is the default
+// calibration (SPARSELIB_DEFAULT_COST_MODEL).  Timings don't carry over between
+// machines, so run it again where the library is deployed and point
+// SPARSELIB_COST_MODEL at the result.
+struct cost_model {
+    static constexpr int nterms = 5;
+
+    cost_model();      // the prior; calibrate() with measurements
+
+    // Least squares fit to the samples for each backend, pulled towards the current
+    // coefficients so that a backend with only a few samples isn't wildly extrapolated
+    void calibrate( std::vector<sample> const & samples );
+
+    double predict( backend_id which, features const & f ) const;
+
+    backend_id choose( features const & f ) const;
+
+    std::array<std::array<double, nterms>, nbackends> coef;
+};
+
+// The model the policy consults.  Starts from the prior, calibrated with the samples in
+// the file named by the environment variable SPARSELIB_COST_MODEL if it is set, or
+// else by those the build measured, if it did
+cost_model & model();
+
+// Benchmark data as CSV: backend,n,nnz,components,rhs,seconds
+std::vector<sample> load_samples( std::string const & path );
+void save_samples( std::string const & path, std::vector<sample> const & samples );
+
+namespace detail {
+struct lu_base;
+}
+
+struct Shim {
+    using index_t = long;
+    using value_t = double;
+
+    // the SuiteSparse backend isn't
+    static constexpr bool thread_safe = false;
+
+    // passed on to every backend, since any of them may be chosen
+    static void set_threads( thread_counts const & c );
+
+    struct triplet_t {
+        index_t row;
+        index_t col;
+        value_t value;
+    };
+
+    // Our own compressed column storage, converted to and from each library's
+    struct sparsemat_t {
+        template<typename Iter>
+        sparsemat_t( index_t rows, index_t cols, Iter first, Iter last ) {
+            std::vector<triplet_t> t;
+            for ( auto it = first; it != last; ++it ) {
+                t.push_back(triplet_t{index_t(triplet_access::row(*it)),
+                                      index_t(triplet_access::col(*it)),
+                                      value_t(triplet_access::value(*it))});
+            }
+            compress(rows, cols, std::move(t));
+        }
+
+        sparsemat_t( index_t rows, index_t cols,
+                     std::vector<index_t> p, std::vector<index_t> i, std::vector<value_t> x )
+            : rows_(rows), cols_(cols), p_(std::move(p)), i_(std::move(i)), x_(std::move(x)) {}
+
+        index_t rows() const { return rows_; }
+        index_t cols() const { return cols_; }
+        index_t nonzeros() const { return p_[cols_]; }
+
+        std::vector<index_t> const & colptr() const { return p_; }
+        std::vector<index_t> const & rowind() const { return i_; }
+        std::vector<value_t> const & values() const { return x_; }
+        value_t * value_data() { return x_.data(); }     // for changing values in place
+
+        // visit each stored entry as f(row, col, value)
+        template<typename F>
+        void for_each_nonzero( F && f ) const {
+            for ( index_t j = 0; j < cols_; ++j ) {
+                for ( index_t k = p_[j]; k < p_[j+1]; ++k ) {
+                    f(i_[k], j, x_[k]);
+                }
+            }
+        }
+
+        friend sparsemat_t operator*(sparsemat_t const& a, sparsemat_t const& b);
+        friend std::ostream& operator<<(std::ostream& os, sparsemat_t const& m);
+
+    private:
+        // sort by column and row, summing duplicates
+        void compress( index_t rows, index_t cols, std::vector<triplet_t> t );
+
+        index_t              rows_, cols_;
+        std::vector<index_t> p_, i_;
+        std::vector<value_t> x_;
+    };
+
+    struct lu_t {
+        // "rhs_hint" is the number of right hand side columns we expect per solve
+        lu_t( sparsemat_t const & mat, index_t rhs_hint = 1 );
+        lu_t( sparsemat_t const & mat, backend_id which );
+
+        sparsemat_t solve( sparsemat_t const & rhs ) const;
+
+        backend_id backend() const { return which_; }
+
+    private:
+        sparsemat_t                                  mat_;
+        mutable backend_id                           which_;
+        mutable std::shared_ptr<detail::lu_base>     lu_;
+    };
+
+    struct qr_t {
+        qr_t( sparsemat_t const & mat, qr_options const & opts = qr_options() );
+        qr_t( sparsemat_t const & mat, backend_id which, qr_options const & opts = qr_options() );
+
+        sparsemat_t Q() const { return Q_; }
+
+        backend_id backend() const { return which_; }
+
+    private:
+        backend_id  which_;
+        sparsemat_t Q_;
+    };
+};
+
+features measure( Shim::sparsemat_t const & A, double rhs );
+
+// Time a factor and solve with each backend, best of "repeats" runs, for calibration.
+// Backends that fail (e.g. the iterative solver not converging) are left out
+std::vector<sample>
+benchmark( Shim::sparsemat_t const & A, Shim::sparsemat_t const & rhs, int repeats = 3 );
+
+namespace detail {
+
+struct lu_base {
+    virtual ~lu_base() {}
+    virtual Shim::sparsemat_t solve( Shim::sparsemat_t const & rhs ) const = 0;
+};
+
+struct backend {
+    virtual ~backend() {}
+    virtual std::shared_ptr<lu_base> factor( Shim::sparsemat_t const & A ) const = 0;
+    virtual Shim::sparsemat_t Q( Shim::sparsemat_t const & A, qr_options const & opts ) const = 0;
+    virtual void set_threads( thread_counts const & c ) const = 0;
+};
+
+backend const & get( backend_id which );
+
+// one per library, each defined in its own translation unit
+backend const & eigen_backend();
+backend const & csparse_backend();
+backend const & suitesparse_backend();
+backend const & iterative_backend();
+
+// Each library's translation unit specializes this to convert its matrices to ours
+template<typename L>
+Shim::sparsemat_t from_native( typename L::sparsemat_t const & m );
+
+template<typename L>
+typename L::sparsemat_t
+to_native( Shim::sparsemat_t const & m ) {
+    using index_t = typename L::index_t;
+    std::vector<typename L::triplet_t> t;
+    t.reserve(m.nonzeros());
+    for ( Shim::index_t j = 0; j < m.cols(); ++j ) {
+        for ( Shim::index_t k = m.colptr()[j]; k < m.colptr()[j+1]; ++k ) {
+            t.push_back(typename L::triplet_t{index_t(m.rowind()[k]), index_t(j), m.values()[k]});
+        }
+    }
+    return typename L::sparsemat_t(index_t(m.rows()), index_t(m.cols()), t.begin(), t.end());
+}
+
+// A library policy behind the common interface
+template<typename L>
+struct policy_backend : backend {
+    struct lu : lu_base {
+        lu( typename L::sparsemat_t const & A ) : lu_(A) {}
+
+        Shim::sparsemat_t solve( Shim::sparsemat_t const & rhs ) const override {
+            typename L::sparsemat_t x = lu_.solve(to_native<L>(rhs));
+            return from_native<L>(x);
+        }
+
+        typename L::lu_t lu_;
+    };
+
+    std::shared_ptr<lu_base> factor( Shim::sparsemat_t const & A ) const override {
+        return std::make_shared<lu>(to_native<L>(A));
+    }
+
+    Shim::sparsemat_t Q( Shim::sparsemat_t const & A, qr_options const & opts ) const override {
+        typename L::qr_t qr(to_native<L>(A), opts);
+        typename L::sparsemat_t q = qr.Q();
+        return from_native<L>(q);
+    }
+
+    void set_threads( thread_counts const & c ) const override {
+        library_threads<L>::set(c);
+    }
+};
+
+}
+
+}
+
+#endif // DISPATCH_SHIM_HPP
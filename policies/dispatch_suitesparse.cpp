@@ -0,0 +1,36 @@
+// The SuiteSparse (KLU and SPQR) policy as a run time dispatch backend
+
+#include "dispatch_shim.hpp"
+#include "suitesparse_shim.hpp"
+
+namespace Dispatch {
+namespace detail {
+
+template<>
+Shim::sparsemat_t
+from_native<SuiteSparse::Shim>( SuiteSparse::Shim::sparsemat_t const & m ) {
+    using index_t = SuiteSparse::Shim::index_t;
+    auto A = m.wrapped();
+    index_t const * Ap = static_cast<index_t const *>(A->p);
+    index_t const * Ai = static_cast<index_t const *>(A->i);
+    index_t const * Anz = static_cast<index_t const *>(A->nz);
+    double const * Ax = static_cast<double const *>(A->x);
+    std::vector<Shim::index_t> p(1, 0), i;
+    std::vector<Shim::value_t> x;
+    for ( std::size_t j = 0; j < A->ncol; ++j ) {
+        index_t end = A->packed ? Ap[j+1] : Ap[j] + Anz[j];
+        i.insert(i.end(), Ai + Ap[j], Ai + end);
+        x.insert(x.end(), Ax + Ap[j], Ax + end);
+        p.push_back(Shim::index_t(i.size()));
+    }
+    return Shim::sparsemat_t(A->nrow, A->ncol, std::move(p), std::move(i), std::move(x));
+}
+
+backend const &
+suitesparse_backend() {
+    static policy_backend<SuiteSparse::Shim> b;
+    return b;
+}
+
+}
+}
@@ -1,32 +1,72 @@
 // Implement SparseLibrary requirements using Eigen
+
+#ifndef EIGEN_SHIM_HPP
+#define EIGEN_SHIM_HPP
+
 #include <Eigen/Sparse>
 #include <Eigen/SparseQR>
 #include <Eigen/SparseLU>
 
-struct EigenShim {
-    using value_t = double;
-    using triplet_t = Eigen::Triplet<value_t>;
+#include <cmath>
+#include <limits>
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <type_traits>
+#include <algorithm>
+
+#include "lowrank_update.hpp"
+#include "symbolic_cache.hpp"
+#include "iterative_refinement.hpp"
+#include "qr_options.hpp"
+#include "lu_options.hpp"
+#include "trace.hpp"
+#include "triplet_compress.hpp"
+#include "thread_budget.hpp"
+
+// ValueT and IndexT become the scalar and StorageIndex of every Eigen sparse matrix we use;
+// 64 bit indices are for matrices with more than 2^31 nonzeros (in the matrix or its factors)
+template<typename ValueT = double, typename IndexT = int>
+struct EigenShimT {
+    using value_t = ValueT;
+    using index_t = IndexT;
+    using triplet_t = Eigen::Triplet<value_t, index_t>;
 
-    template<typename Value>
+    // Eigen's products follow each thread's OpenMP setting unless given a count of their own
+    static void set_threads( thread_counts const & c ) {
+        if ( c.eigen > 0 ) {
+            Eigen::setNbThreads(c.eigen);
+        }
+    }
+
+    template<typename V>
     struct sparse_wrapper_t {
-        using wrapped_t = Eigen::SparseMatrix<Value>;
-        using index_t = typename wrapped_t::StorageIndex;
+        using wrapped_t = Eigen::SparseMatrix<V, Eigen::ColMajor, IndexT>;
+        using index_t = IndexT;
         template<typename Iter>     // or use ForwardIterator concept
         sparse_wrapper_t(index_t rows, index_t cols, Iter a, Iter b) : mat_(rows, cols) {
-            mat_.setFromTriplets(a, b);
+            SPARSELIB_TRACE_SCOPE("eigen compress");
+            // setFromTriplets, but on all threads
+            triplet_compress::compress<index_t, V>(
+                rows, cols, a, b,
+                [this](index_t nnz) {
+                    mat_.resizeNonZeros(nnz);
+                    return triplet_compress::csc_arrays<index_t, V>{
+                        mat_.outerIndexPtr(), mat_.innerIndexPtr(), mat_.valuePtr()};
+                });
         }
         sparse_wrapper_t(wrapped_t mat) : mat_(std::move(mat)) {}
 
         // define the product of two sparse wrappers
         friend sparse_wrapper_t operator*(sparse_wrapper_t const& a, sparse_wrapper_t const& b) {
-            return Eigen::SparseMatrix<value_t>(a.wrapped() * b.wrapped());
+            return wrapped_t(a.wrapped() * b.wrapped());
         }
 
         friend std::ostream & operator<<(std::ostream& os, sparse_wrapper_t const& m) {
             using namespace Eigen;
             IOFormat OctaveFmt(FullPrecision, 0, ", ", ";\n", "", "", "[", "]");
 
-            Matrix<value_t, Dynamic, Dynamic> dense = m.wrapped();   // convert to dense
+            Matrix<V, Dynamic, Dynamic> dense = m.wrapped();   // convert to dense
 
             os << dense.format(OctaveFmt);
             return os;
@@ -34,37 +74,304 @@ struct EigenShim {
 
         wrapped_t const & wrapped() const { return mat_; }
 
+        index_t rows() const { return index_t(mat_.rows()); }
+        index_t cols() const { return index_t(mat_.cols()); }
+
+        // the stored values, in the order for_each_nonzero visits them, for changing
+        // values in place (the pattern stays the same)
+        V * value_data() { return mat_.valuePtr(); }
+
+        // visit each stored entry as f(row, col, value)
+        template<typename F>
+        void for_each_nonzero( F && f ) const {
+            for ( index_t j = 0; j < mat_.outerSize(); ++j ) {
+                for ( typename wrapped_t::InnerIterator it(mat_, j); it; ++it ) {
+                    f(index_t(it.row()), index_t(it.col()), it.value());
+                }
+            }
+        }
+
     private:
 
         wrapped_t mat_;
     };
 
     using sparsemat_t = sparse_wrapper_t<value_t>;
-    using index_t = sparsemat_t::index_t;
 
-    template<typename Value, typename Index>
+    // COLAMD ordering functor that consults the on-disk symbolic cache (if enabled) first
+    template<typename StorageIndex>
+    struct cached_colamd_ordering {
+        using PermutationType = Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic, StorageIndex>;
+
+        template<typename MatrixType>
+        void operator()(MatrixType const & mat, PermutationType & perm) {
+            if ( !symbolic_cache::enabled() ) {
+                Eigen::COLAMDOrdering<StorageIndex>()(mat, perm);
+                return;
+            }
+
+            auto hash = symbolic_cache::pattern_hash<StorageIndex>(
+                mat.rows(), mat.cols(), mat.outerIndexPtr(), mat.innerIndexPtr());
+            symbolic_cache::record rec(mat.rows(), mat.cols(), mat.nonZeros());
+            if ( symbolic_cache::load("eigen-colamd", hash, rec) && (rec.arrays.size() == 1) &&
+                 rec.arrays[0].present && rec.fits(0, mat.cols(), 0, mat.cols()) ) {
+                perm.resize(mat.cols());
+                std::copy(rec.arrays[0].data.begin(), rec.arrays[0].data.end(), perm.indices().data());
+                return;
+            }
+
+            Eigen::COLAMDOrdering<StorageIndex>()(mat, perm);
+            rec.add_array(perm.indices().data(), perm.size());
+            symbolic_cache::store("eigen-colamd", hash, rec);
+        }
+    };
+
+    // FactorValue selects the precision of the factorization.  When it is narrower
+    // than Value (e.g. float factors for double data) solves are brought back to
+    // full accuracy by iterative refinement against the original matrix, and if
+    // that stalls we switch permanently to a factorization in Value.
+    template<typename Value, typename Index, typename FactorValue = Value>
     struct lu_wrapper_t {
-        using wrapped_t = Eigen::SparseLU<Eigen::SparseMatrix<Value>, Eigen::COLAMDOrdering<Index>>;
+        using wrapped_t = Eigen::SparseLU<Eigen::SparseMatrix<FactorValue, Eigen::ColMajor, Index>,
+                                          cached_colamd_ordering<Index>>;
+        using full_t = Eigen::SparseLU<Eigen::SparseMatrix<Value, Eigen::ColMajor, Index>,
+                                       cached_colamd_ordering<Index>>;
+        using dense_t = Eigen::Matrix<Value, Eigen::Dynamic, Eigen::Dynamic>;
+
+        static constexpr bool mixed = !std::is_same<Value, FactorValue>::value;
 
-        lu_wrapper_t( sparsemat_t const & mat ) : lu_(mat.wrapped()) {
+        // update() refactors instead once the change touches more columns than this
+        static constexpr Index default_max_update_rank = 32;
+
+        lu_wrapper_t( sparsemat_t const & mat, Index max_update_rank = default_max_update_rank )
+            : lu_wrapper_t(mat, lu_options(), max_update_rank) {}
+
+        // Without a pivot tolerance, Eigen's default of 1 (partial pivoting) applies.
+        // SparseLU can't reuse an earlier pivot order, so static pivoting here is the
+        // nearest thing: a threshold of zero, taking the diagonal whenever it is nonzero
+        lu_wrapper_t( sparsemat_t const & mat, lu_options const & opts,
+                      Index max_update_rank = default_max_update_rank )
+            : mat_(mat), max_update_rank_(max_update_rank), opts_(opts) {
+            SPARSELIB_TRACE_SCOPE("eigen lu factor");
+            lu_.setPivotThreshold(threshold(opts_.static_pivoting));
+            lu_.compute(mat.wrapped().template cast<FactorValue>());
             assert(lu_.info() == Eigen::Success);
+            diagnose(lu_, opts_.static_pivoting);
         }
 
         sparse_wrapper_t<Value> solve( sparsemat_t const & rhs ) const {
-            return sparse_wrapper_t<Value>(lu_.solve(rhs.wrapped()));
+            SPARSELIB_TRACE_SCOPE("eigen lu solve");
+            return solve(rhs, std::integral_constant<bool, mixed>());
+        }
+
+        // Add "delta" (e.g. the changed stamps of a few elements) to the factored matrix.
+        // Small changes become a low-rank correction applied during solves; large ones
+        // are folded into the matrix, which is then refactored
+        void update( std::vector<triplet_t> const & delta ) {
+            SPARSELIB_TRACE_SCOPE("eigen lu update");
+            delta_.insert(delta_.end(), delta.begin(), delta.end());
+
+            Index n = mat_.wrapped().rows();
+            if ( changed_columns(delta_.begin(), delta_.end()) <= std::size_t(max_update_rank_) ) {
+                update_.reset( new lowrank_update<Value, Index>(
+                                   n, delta_.begin(), delta_.end(),
+                                   [this, n](Value * x, Index ncols) {
+                                       Eigen::Map<dense_t> xm(x, n, ncols);
+                                       dense_t result = xm;
+                                       solve_factored(result);
+                                       xm = result;
+                                   }) );
+                if ( !update_->singular() ) {
+                    return;
+                }
+            }
+
+            // too many changes (or a bad correction) - fold them into the matrix and start over
+            sparsemat_t dG(n, n, delta_.begin(), delta_.end());
+            mat_ = sparsemat_t(mat_.wrapped() + dG.wrapped());
+            if ( full_ ) {
+                full_->compute(mat_.wrapped());
+                assert(full_->info() == Eigen::Success);
+                diagnose(*full_, false);
+            } else {
+                lu_.compute(mat_.wrapped().template cast<FactorValue>());
+                assert(lu_.info() == Eigen::Success);
+                diagnose(lu_, opts_.static_pivoting);
+            }
+            delta_.clear();
+            update_.reset();
+        }
+
+        // Factor new values with the pattern already factored, reusing the column ordering
+        // and symbolic analysis.  Any update()s are discarded.  With static pivoting, if a
+        // test solve shows the diagonal pivots lost too much we factor again with the usual threshold
+        void refactor( sparsemat_t const & mat ) {
+            SPARSELIB_TRACE_SCOPE("eigen lu refactor");
+            mat_ = mat;
+            delta_.clear();
+            update_.reset();
+            ++diag_.refactors;
+            if ( full_ ) {
+                ++diag_.searches;
+                full_->factorize(mat_.wrapped());
+                assert(full_->info() == Eigen::Success);
+                diagnose(*full_, false);
+                return;
+            }
+            lu_.setPivotThreshold(threshold(opts_.static_pivoting));
+            lu_.factorize(mat_.wrapped().template cast<FactorValue>());
+            if ( opts_.static_pivoting && (lu_.info() == Eigen::Success) ) {
+                diagnose(lu_, true);
+                if ( static_pivots_accurate() ) {
+                    return;
+                }
+            }
+            ++diag_.searches;
+            lu_.setPivotThreshold(threshold(false));
+            lu_.factorize(mat_.wrapped().template cast<FactorValue>());
+            assert(lu_.info() == Eigen::Success);
+            diagnose(lu_, false);
         }
 
+        lu_diagnostics const & diagnostics() const { return diag_; }
+
+        // entries in L and U; each costs a multiply and an add per solved column
+        Index factor_nonzeros() const {
+            return full_ ? Index(full_->nnzL() + full_->nnzU()) : Index(lu_.nnzL() + lu_.nnzU());
+        }
+
+        // control and report on refinement, when FactorValue is narrower than Value
+        void set_refinement( refinement_options const & opts ) { refine_opts_ = opts; }
+        refinement_stats const & last_refinement() const { return stats_; }
+
     private:
-        wrapped_t lu_;
+        using factor_dense_t = Eigen::Matrix<FactorValue, Eigen::Dynamic, Eigen::Dynamic>;
+
+        double threshold( bool static_pivots ) const {
+            return static_pivots ? 0.0 : ((opts_.pivot_tolerance >= 0) ? opts_.pivot_tolerance : 1.0);
+        }
+
+        // Eigen only lets its supernodal factors be applied (matrixL() and matrixU() offer
+        // solveInPlace and nothing more), so pivots and growth are reported as unavailable
+        template<typename LU>
+        void diagnose( LU const &, bool static_pivots ) {
+            diag_.static_pivots = static_pivots;
+            diag_.available     = false;
+        }
+
+        // Lacking the pivots, whether statically pivoted factors are still good enough is
+        // judged by a solve: x = A^-1 (A 1) must keep half the digits of the all ones vector
+        bool static_pivots_accurate() const {
+            using factor_vector_t = Eigen::Matrix<FactorValue, Eigen::Dynamic, 1>;
+            factor_vector_t ones = factor_vector_t::Ones(mat_.wrapped().cols());
+            factor_vector_t b    = mat_.wrapped().template cast<FactorValue>() * ones;
+            factor_vector_t x    = lu_.solve(b);
+            double err = double((x - ones).template lpNorm<Eigen::Infinity>());
+            return err < std::sqrt(double(std::numeric_limits<FactorValue>::epsilon()));
+        }
+
+        // same precision: Eigen can solve the sparse right hand side directly
+        sparse_wrapper_t<Value> solve( sparsemat_t const & rhs, std::false_type ) const {
+            if ( !update_ ) {
+                return sparse_wrapper_t<Value>(lu_.solve(rhs.wrapped()));
+            }
+            return solve_dense(rhs);
+        }
+
+        sparse_wrapper_t<Value> solve( sparsemat_t const & rhs, std::true_type ) const {
+            return solve_dense(rhs);
+        }
+
+        sparse_wrapper_t<Value> solve_dense( sparsemat_t const & rhs ) const {
+            dense_t x = rhs.wrapped();
+            solve_factored(x);
+            if ( update_ ) {
+                update_->apply(x.data(), x.cols());
+            }
+            return sparse_wrapper_t<Value>(x.sparseView());
+        }
+
+        // overwrite x with the solution for the factored matrix, ignoring any update
+        void solve_factored( dense_t & x ) const {
+            if ( !mixed ) {
+                factor_dense_t y = lu_.solve(x.template cast<FactorValue>());
+                x = y.template cast<Value>();
+                return;
+            }
+            if ( full_ ) {
+                dense_t y = full_->solve(x);
+                x = y;
+                return;
+            }
+
+            dense_t b = x;
+            factor_dense_t y = lu_.solve(b.template cast<FactorValue>());
+            x = y.template cast<Value>();
+
+            Index n = x.rows();
+            auto const & A = mat_.wrapped();
+            stats_ = refinement_stats();
+            for ( Index c = 0; c < x.cols(); ++c ) {
+                Value const * bc = &b(0, c);
+                auto s = refine(
+                    n, bc, &x(0, c),
+                    [&A, bc, n](Value const * xv, Value * r) {
+                        Eigen::Map<Eigen::Matrix<Value, Eigen::Dynamic, 1>> rm(r, n);
+                        rm = Eigen::Map<Eigen::Matrix<Value, Eigen::Dynamic, 1> const>(bc, n) -
+                            A * Eigen::Map<Eigen::Matrix<Value, Eigen::Dynamic, 1> const>(xv, n);
+                    },
+                    [this, n](Value * r) {
+                        Eigen::Map<Eigen::Matrix<Value, Eigen::Dynamic, 1>> rm(r, n);
+                        Eigen::Matrix<FactorValue, Eigen::Dynamic, 1> d =
+                            lu_.solve(rm.template cast<FactorValue>());
+                        rm = d.template cast<Value>();
+                    },
+                    refine_opts_);
+                stats_.iterations = std::max(stats_.iterations, s.iterations);
+                stats_.residual   = std::max(stats_.residual, s.residual);
+                stats_.converged  = stats_.converged && s.converged;
+            }
+
+            if ( !stats_.converged ) {
+                // the low precision factors aren't good enough for this matrix
+                full_.reset(new full_t(A));
+                assert(full_->info() == Eigen::Success);
+                x = full_->solve(b);
+                stats_.fell_back = true;
+            }
+        }
+
+        sparsemat_t    mat_;          // what lu_ describes
+        Index          max_update_rank_;
+        lu_options     opts_;
+        lu_diagnostics diag_;
+        wrapped_t      lu_;
+
+        std::vector<triplet_t> delta_;   // accumulated changes since the last factor
+        std::unique_ptr<lowrank_update<Value, Index>> update_;
+
+        refinement_options               refine_opts_;
+        mutable refinement_stats         stats_;
+        mutable std::unique_ptr<full_t>  full_;    // replaces lu_ if refinement stalls
     };
 
     template<typename Value, typename Index>
     struct qr_wrapper_t {
-        using wrapped_t = Eigen::SparseQR<Eigen::SparseMatrix<Value>, Eigen::COLAMDOrdering<Index>>;
+        using wrapped_t = Eigen::SparseQR<Eigen::SparseMatrix<Value, Eigen::ColMajor, Index>,
+                                          cached_colamd_ordering<Index>>;
 
-        qr_wrapper_t( sparsemat_t const & mat ) : qr_(mat.wrapped()) {}
+        // SparseQR always moves columns it finds dependent to the end, and leaves them out
+        // of rank(); a tolerance replaces its default threshold for that
+        qr_wrapper_t( sparsemat_t const & mat, qr_options const & opts = qr_options() ) {
+            SPARSELIB_TRACE_SCOPE("eigen qr factor");
+            if ( opts.tolerance >= 0 ) {
+                qr_.setPivotThreshold( Value(opts.tolerance * max_column_norm(mat)) );
+            }
+            qr_.compute(mat.wrapped());
+        }
 
         sparsemat_t Q() const {
+            SPARSELIB_TRACE_SCOPE("eigen qr Q");
             using namespace Eigen;
             // Sadly Eigen cannot directly return the Q as a sparse matrix
             // What it *can* do is multiply times a dense matrix
@@ -74,7 +381,7 @@ struct EigenShim {
             Matrix<value_t, Dynamic, Dynamic> result = qr_.matrixQ() * identity;
 
             // finally, convert to sparse
-            return SparseMatrix<value_t>(result.sparseView());
+            return typename sparsemat_t::wrapped_t(result.sparseView());
         }
 
     private:
@@ -82,8 +389,15 @@ struct EigenShim {
     };
 
     using lu_t = lu_wrapper_t<value_t, index_t>;
+    // single precision factors, refined to double precision results
+    using mixed_lu_t = lu_wrapper_t<value_t, index_t, float>;
     using qr_t = qr_wrapper_t<value_t, index_t>;
 
 
 };
 
+using EigenShim   = EigenShimT<>;
+using EigenShim64 = EigenShimT<double, std::int64_t>;
+
+#endif // EIGEN_SHIM_HPP
+
@@ -0,0 +1,179 @@
+// Splitting the graph of a sparse matrix into pieces
+// Uses METIS when we were built with it (SPARSELIB_HAVE_METIS), otherwise a
+// simple breadth-first bisection that keeps neighbouring nodes together
+
+#ifndef GRAPH_PARTITION_HPP
+#define GRAPH_PARTITION_HPP
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#ifdef SPARSELIB_HAVE_METIS
+#include <metis.h>
+#endif
+
+#include "triplet_access.hpp"
+
+namespace graph_partition {
+
+// The structure of A + A^T, without the diagonal, in compressed form
+template<typename Index>
+struct adjacency {
+    std::vector<Index> xadj;   // size n+1
+    std::vector<Index> adj;
+
+    Index size() const { return Index(xadj.size()) - 1; }
+};
+
+template<typename Index, typename Iter>
+adjacency<Index>
+symmetric_adjacency( Index n, Iter first, Iter last ) {
+    // collect both directions of each off-diagonal entry, then sort out duplicates
+    std::vector<std::vector<Index>> nbrs(n);
+    for ( auto it = first; it != last; ++it ) {
+        Index r = triplet_access::row(*it);
+        Index c = triplet_access::col(*it);
+        if ( r != c ) {
+            nbrs[r].push_back(c);
+            nbrs[c].push_back(r);
+        }
+    }
+    adjacency<Index> g;
+    g.xadj.reserve(n + 1);
+    g.xadj.push_back(0);
+    for ( auto & nb : nbrs ) {
+        std::sort(nb.begin(), nb.end());
+        nb.erase(std::unique(nb.begin(), nb.end()), nb.end());
+        g.adj.insert(g.adj.end(), nb.begin(), nb.end());
+        g.xadj.push_back(Index(g.adj.size()));
+        std::vector<Index>().swap(nb);
+    }
+    return g;
+}
+
+// Breadth-first ordering of all nodes, restarting in each connected component
+// from a node of minimum degree (a cheap stand-in for a peripheral node)
+template<typename Index>
+std::vector<Index>
+bfs_order( adjacency<Index> const & g ) {
+    Index n = g.size();
+    std::vector<Index> by_degree(n);
+    for ( Index v = 0; v < n; ++v ) {
+        by_degree[v] = v;
+    }
+    std::stable_sort(by_degree.begin(), by_degree.end(), [&g](Index a, Index b) {
+            return (g.xadj[a+1] - g.xadj[a]) < (g.xadj[b+1] - g.xadj[b]);
+        });
+
+    std::vector<Index> order;
+    order.reserve(n);
+    std::vector<bool> seen(n, false);
+    std::deque<Index> q;
+    for ( Index root : by_degree ) {
+        if ( seen[root] ) {
+            continue;
+        }
+        seen[root] = true;
+        q.push_back(root);
+        while ( !q.empty() ) {
+            Index v = q.front();
+            q.pop_front();
+            order.push_back(v);
+            for ( Index k = g.xadj[v]; k < g.xadj[v+1]; ++k ) {
+                if ( !seen[g.adj[k]] ) {
+                    seen[g.adj[k]] = true;
+                    q.push_back(g.adj[k]);
+                }
+            }
+        }
+    }
+    return order;
+}
+
+// Assign each node a part number in [0, nparts)
+template<typename Index>
+std::vector<Index>
+partition( adjacency<Index> const & g, Index nparts ) {
+    Index n = g.size();
+    std::vector<Index> part(n, 0);
+    if ( nparts <= 1 || n == 0 ) {
+        return part;
+    }
+
+#ifdef SPARSELIB_HAVE_METIS
+    std::vector<idx_t> xadj(g.xadj.begin(), g.xadj.end());
+    std::vector<idx_t> adj(g.adj.begin(), g.adj.end());
+    std::vector<idx_t> mpart(n);
+    idx_t nv = n, ncon = 1, np = nparts, cut = 0;
+    if ( METIS_PartGraphKway( &nv, &ncon, xadj.data(), adj.data(),
+                              nullptr, nullptr, nullptr, &np,
+                              nullptr, nullptr, nullptr, &cut, mpart.data() ) == METIS_OK ) {
+        std::copy(mpart.begin(), mpart.end(), part.begin());
+        return part;
+    }
+    // otherwise fall through to the simple method
+#endif
+
+    // consecutive runs of a breadth-first order
+    auto order = bfs_order(g);
+    for ( Index k = 0; k < n; ++k ) {
+        part[order[k]] = Index((static_cast<long long>(k) * nparts) / n);
+    }
+    return part;
+}
+
+// Choose nodes to remove so that no edge joins two different parts
+// Returns true for separator nodes.  For each cut edge we take the endpoint in the
+// higher numbered part, unless the edge is already covered.
+template<typename Index>
+std::vector<bool>
+vertex_separator( adjacency<Index> const & g, std::vector<Index> const & part ) {
+    Index n = g.size();
+    std::vector<bool> sep(n, false);
+    for ( Index v = 0; v < n; ++v ) {
+        for ( Index k = g.xadj[v]; k < g.xadj[v+1]; ++k ) {
+            Index u = g.adj[k];
+            if ( (part[u] != part[v]) && !sep[u] && !sep[v] ) {
+                sep[part[u] > part[v] ? u : v] = true;
+            }
+        }
+    }
+    return sep;
+}
+
+// vertex_separator() for splitting the matrix in [first, last) into a block bordered form.
+// An unknown with a zero diagonal (a voltage source current, say) whose neighbours all
+// went to the separator would leave an empty row and column in its block, making it
+// singular, so it goes into the separator too
+template<typename Index, typename Iter>
+std::vector<bool>
+bordered_separator( adjacency<Index> const & g, std::vector<Index> const & part,
+                    Iter first, Iter last ) {
+    using namespace triplet_access;
+    Index n = g.size();
+    auto sep = vertex_separator(g, part);
+
+    std::vector<bool> has_diag(n, false);
+    for ( auto it = first; it != last; ++it ) {
+        if ( (row(*it) == col(*it)) && (value(*it) != 0) ) {
+            has_diag[row(*it)] = true;
+        }
+    }
+    for ( Index v = 0; v < n; ++v ) {
+        if ( sep[v] || has_diag[v] ) {
+            continue;
+        }
+        bool connected = false;
+        for ( Index k = g.xadj[v]; k < g.xadj[v+1]; ++k ) {
+            Index u = g.adj[k];
+            connected = connected || (!sep[u] && (part[u] == part[v]));
+        }
+        sep[v] = !connected;
+    }
+    return sep;
+}
+
+}
+
+#endif // GRAPH_PARTITION_HPP
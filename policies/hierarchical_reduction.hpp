@@ -0,0 +1,383 @@
+// Reduction of a large net as a set of smaller ones
+//
+// The graph of G is split into parts and a separator of boundary nodes, giving
+//     G = [ G_II  G_IS ]     B = [ B_I ]     with G_II block diagonal
+//         [ G_SI  G_SS ]         [ B_S ]
+// The response of part i to its ports and to the boundary voltages lies in the
+// span of G_ii^-1 [ B_i  G_iS ], so an orthonormal basis Q_i for that space (the
+// first steps of Prima, with the policy's lu_t and qr_t) reduces the part on its
+// own.  The parts are reduced concurrently and assembled into the macromodel
+//     G_r = [ Q_1^T G_11 Q_1                  Q_1^T G_1S ]     B_r = [ Q_1^T B_1 ]
+//           [                  ...               ...     ]           [    ...    ]
+//           [ G_S1 Q_1          ...           G_SS       ]           [    B_S    ]
+// which can optionally be reduced again as a whole.  Each Q_i contains the exact
+// DC solution restricted to its part, so the macromodel keeps the DC port response.
+// Library calls get the threads of opts.budget, shared among the parts still unfinished.
+
+#ifndef HIERARCHICAL_REDUCTION_HPP
+#define HIERARCHICAL_REDUCTION_HPP
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+
+#include "triplet_access.hpp"
+#include "graph_partition.hpp"
+#include "prima_pipeline.hpp"     // for work_stealing_pool, library_thread_safe
+#include "qr_options.hpp"
+#include "thread_budget.hpp"
+
+struct hierarchical_options {
+    int      parts = 0;             // 0 for one per thread
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    bool     rereduce = false;      // reduce the assembled macromodel again
+    qr_options qr;                  // a tolerance here drops nearly dependent directions
+    thread_budget budget;           // for the threads inside each library call
+};
+
+template<typename L>
+struct hierarchical_reduction {
+    using index_t     = typename L::index_t;
+    using value_t     = typename L::value_t;
+    using triplet_t   = typename L::triplet_t;
+    using sparsemat_t = typename L::sparsemat_t;
+
+    // G is n x n and B is n x ports
+    template<typename GIter, typename BIter>
+    hierarchical_reduction( index_t n, index_t ports,
+                            GIter gfirst, GIter glast, BIter bfirst, BIter blast,
+                            hierarchical_options const & opts = hierarchical_options() )
+        : ports_(ports), qr_opts_(opts.qr), budget_(opts.budget), threads_(opts.threads) {
+        using namespace triplet_access;
+        using clock = std::chrono::steady_clock;
+        auto start = clock::now();
+
+        index_t nparts = (opts.parts > 0) ? index_t(opts.parts) : index_t(opts.threads);
+        auto g    = graph_partition::symmetric_adjacency(n, gfirst, glast);
+        auto part = graph_partition::partition(g, nparts);
+        auto sep  = graph_partition::bordered_separator(g, part, gfirst, glast);
+
+        // number the parts (skipping any that ended up empty), their members, and the separator
+        std::vector<index_t> part_id(nparts, -1), where(n), local(n);
+        std::vector<piece> pieces;
+        index_t nsep = 0;
+        for ( index_t v = 0; v < n; ++v ) {
+            if ( sep[v] ) {
+                where[v] = -1;
+                local[v] = nsep++;
+                continue;
+            }
+            if ( part_id[part[v]] < 0 ) {
+                part_id[part[v]] = index_t(pieces.size());
+                pieces.emplace_back();
+            }
+            where[v] = part_id[part[v]];
+            local[v] = pieces[where[v]].n++;
+        }
+
+        // distribute the entries
+        std::vector<entry> GSS, BS;
+        for ( auto it = gfirst; it != glast; ++it ) {
+            index_t r = row(*it), c = col(*it);
+            entry e{local[r], local[c], value_t(value(*it))};
+            if ( (where[r] >= 0) && (where[r] == where[c]) ) {
+                pieces[where[r]].G.push_back(e);
+            } else if ( (where[r] < 0) && (where[c] < 0) ) {
+                GSS.push_back(e);
+            } else if ( where[c] < 0 ) {
+                pieces[where[r]].GIS.push_back(e);      // part row, separator column
+            } else if ( where[r] < 0 ) {
+                pieces[where[c]].GSI.push_back(e);      // separator row, part column
+            } else {
+                throw std::logic_error("hierarchical reduction: entry joins two parts");
+            }
+        }
+        for ( auto it = bfirst; it != blast; ++it ) {
+            index_t r = row(*it);
+            entry e{local[r], index_t(col(*it)), value_t(value(*it))};
+            if ( where[r] < 0 ) {
+                BS.push_back(e);
+            } else {
+                pieces[where[r]].B.push_back(e);
+            }
+        }
+
+        // reduce the parts concurrently
+        {
+            // the mutex must outlive the pool, whose destructor waits for the tasks using it
+            std::mutex library_m;
+            work_stealing_pool pool(opts.threads);
+            std::vector<std::future<void>> done;
+            unfinished_ = pieces.size();
+            for ( auto & p : pieces ) {
+                auto task = std::make_shared<std::packaged_task<void()>>([this, &p, &library_m, ports] {
+                        auto t0 = clock::now();
+                        reduce_piece(p, ports, library_m);
+                        --unfinished_;
+                        p.seconds = std::chrono::duration<double>(clock::now() - t0).count();
+                    });
+                done.push_back(task->get_future());
+                pool.post([task] { (*task)(); });
+            }
+            for ( auto & f : done ) {
+                f.get();    // rethrows anything that went wrong
+            }
+        }
+
+        // assemble: the reduced parts in order, then the separator
+        index_t offset = 0;
+        for ( auto & p : pieces ) {
+            p.offset = offset;
+            offset += p.k;
+        }
+        size_ = offset + nsep;
+        for ( auto const & p : pieces ) {
+            part_seconds_.push_back(p.seconds);
+            for ( auto const & e : p.Gr ) {
+                G_.push_back(triplet_t{p.offset + e.row, p.offset + e.col, e.value});
+            }
+            for ( auto const & e : p.GrS ) {
+                G_.push_back(triplet_t{p.offset + e.row, offset + e.col, e.value});
+            }
+            for ( auto const & e : p.GSr ) {
+                G_.push_back(triplet_t{offset + e.row, p.offset + e.col, e.value});
+            }
+            for ( auto const & e : p.Br ) {
+                B_.push_back(triplet_t{p.offset + e.row, e.col, e.value});
+            }
+        }
+        for ( auto const & e : GSS ) {
+            G_.push_back(triplet_t{offset + e.row, offset + e.col, e.value});
+        }
+        for ( auto const & e : BS ) {
+            B_.push_back(triplet_t{offset + e.row, e.col, e.value});
+        }
+
+        if ( opts.rereduce ) {
+            rereduce();
+        }
+        seconds_ = std::chrono::duration<double>(clock::now() - start).count();
+    }
+
+    // order of the macromodel
+    index_t size() const { return size_; }
+    index_t ports() const { return ports_; }
+
+    // the macromodel, size() x size() and size() x ports()
+    sparsemat_t G() const { return sparsemat_t(size_, size_, G_.begin(), G_.end()); }
+    sparsemat_t B() const { return sparsemat_t(size_, ports_, B_.begin(), B_.end()); }
+
+    // time spent reducing each part, and on the whole reduction
+    std::vector<double> const & part_seconds() const { return part_seconds_; }
+    double seconds() const { return seconds_; }
+
+private:
+    struct entry {
+        index_t row;
+        index_t col;
+        value_t value;
+    };
+
+    // one part, in its local numbering
+    struct piece {
+        index_t            n = 0;
+        std::vector<entry> G, GIS, GSI, B;    // as given
+        index_t            k = 0;             // columns in its basis
+        std::vector<entry> Gr, GrS, GSr, Br;  // reduced
+        index_t            offset = 0;        // position in the macromodel
+        double             seconds = 0;
+    };
+
+    // An orthonormal basis for the span of G^-1 W, as a dense n x k matrix
+    // (k is at most the columns of W)
+    std::vector<value_t>
+    basis( index_t n, std::vector<triplet_t> const & G, index_t w, std::vector<triplet_t> const & W,
+           index_t & k, std::mutex & library_m ) const {
+        std::unique_lock<std::mutex> lib(library_m, std::defer_lock);
+        std::size_t jobs = 1;
+        if ( library_thread_safe<L>::value ) {
+            jobs = std::min(std::max(std::size_t(1), unfinished_.load()), std::size_t(threads_));
+        } else {
+            lib.lock();
+        }
+        apply_threads<L>(budget_.share(jobs));
+        sparsemat_t Gm(n, n, G.begin(), G.end());
+        sparsemat_t Wm(n, w, W.begin(), W.end());
+        typename L::lu_t LU(Gm);
+        auto X = LU.solve(Wm);
+        typename L::qr_t QR(X, qr_opts_);
+        auto Q = QR.Q();
+
+        k = 0;
+        std::vector<value_t> Qd;
+        Q.for_each_nonzero([&](index_t r, index_t c, value_t v) {
+                if ( c >= w ) {
+                    return;     // beyond the span of W
+                }
+                if ( c >= k ) {
+                    k = c + 1;
+                    Qd.resize(n * k, value_t(0));
+                }
+                Qd[c * n + r] = v;
+            });
+        return Qd;
+    }
+
+    // Q^T M for a matrix given by entries, with m columns
+    static std::vector<entry>
+    project_rows( index_t n, index_t k, std::vector<value_t> const & Q,
+                  std::vector<entry> const & M, index_t m ) {
+        std::vector<value_t> R(k * m, value_t(0));
+        for ( auto const & e : M ) {
+            for ( index_t a = 0; a < k; ++a ) {
+                R[e.col * k + a] += Q[a * n + e.row] * e.value;
+            }
+        }
+        return dense_entries(R, k, m);
+    }
+
+    // M Q for a matrix given by entries, with m rows
+    static std::vector<entry>
+    project_cols( index_t n, index_t k, std::vector<value_t> const & Q,
+                  std::vector<entry> const & M, index_t m ) {
+        std::vector<value_t> R(m * k, value_t(0));
+        for ( auto const & e : M ) {
+            for ( index_t b = 0; b < k; ++b ) {
+                R[b * m + e.row] += e.value * Q[b * n + e.col];
+            }
+        }
+        return dense_entries(R, m, k);
+    }
+
+    // Q^T M Q
+    static std::vector<entry>
+    project( index_t n, index_t k, std::vector<value_t> const & Q, std::vector<entry> const & M ) {
+        // T = M Q, then Q^T T
+        std::vector<value_t> T(n * k, value_t(0));
+        for ( auto const & e : M ) {
+            for ( index_t b = 0; b < k; ++b ) {
+                T[b * n + e.row] += e.value * Q[b * n + e.col];
+            }
+        }
+        std::vector<value_t> R(k * k, value_t(0));
+        for ( index_t b = 0; b < k; ++b ) {
+            for ( index_t a = 0; a < k; ++a ) {
+                value_t s = 0;
+                for ( index_t i = 0; i < n; ++i ) {
+                    s += Q[a * n + i] * T[b * n + i];
+                }
+                R[b * k + a] = s;
+            }
+        }
+        return dense_entries(R, k, k);
+    }
+
+    static std::vector<entry>
+    dense_entries( std::vector<value_t> const & D, index_t rows, index_t cols ) {
+        std::vector<entry> result;
+        for ( index_t j = 0; j < cols; ++j ) {
+            for ( index_t i = 0; i < rows; ++i ) {
+                if ( D[j * rows + i] != value_t(0) ) {
+                    result.push_back(entry{i, j, D[j * rows + i]});
+                }
+            }
+        }
+        return result;
+    }
+
+    static std::vector<triplet_t>
+    triplets( std::vector<entry> const & M ) {
+        std::vector<triplet_t> t;
+        t.reserve(M.size());
+        for ( auto const & e : M ) {
+            t.push_back(triplet_t{e.row, e.col, e.value});
+        }
+        return t;
+    }
+
+    void reduce_piece( piece & p, index_t ports, std::mutex & library_m ) {
+        // the separator nodes this part touches, numbered locally
+        std::vector<index_t> boundary;
+        for ( auto const & e : p.GIS ) {
+            boundary.push_back(e.col);
+        }
+        for ( auto const & e : p.GSI ) {
+            boundary.push_back(e.row);
+        }
+        std::sort(boundary.begin(), boundary.end());
+        boundary.erase(std::unique(boundary.begin(), boundary.end()), boundary.end());
+        auto bindex = [&boundary](index_t s) {
+            return index_t(std::lower_bound(boundary.begin(), boundary.end(), s) - boundary.begin());
+        };
+        index_t nb = index_t(boundary.size());
+        for ( auto & e : p.GIS ) {
+            e.col = bindex(e.col);
+        }
+        for ( auto & e : p.GSI ) {
+            e.row = bindex(e.row);
+        }
+
+        // right hand sides: the ports, then the boundary nodes
+        std::vector<triplet_t> W = triplets(p.B);
+        for ( auto const & e : p.GIS ) {
+            W.push_back(triplet_t{e.row, ports + e.col, e.value});
+        }
+        auto Q = basis(p.n, triplets(p.G), ports + nb, W, p.k, library_m);
+
+        p.Gr  = project(p.n, p.k, Q, p.G);
+        p.GrS = project_rows(p.n, p.k, Q, p.GIS, nb);
+        p.GSr = project_cols(p.n, p.k, Q, p.GSI, nb);
+        p.Br  = project_rows(p.n, p.k, Q, p.B, ports);
+
+        // back to separator numbering
+        for ( auto & e : p.GrS ) {
+            e.col = boundary[e.col];
+        }
+        for ( auto & e : p.GSr ) {
+            e.row = boundary[e.row];
+        }
+
+        // done with the originals
+        std::vector<entry>().swap(p.G);
+        std::vector<entry>().swap(p.GIS);
+        std::vector<entry>().swap(p.GSI);
+        std::vector<entry>().swap(p.B);
+    }
+
+    // Prima's first steps again, on the whole macromodel
+    void rereduce() {
+        using namespace triplet_access;
+        std::vector<entry> G, B;
+        for ( auto const & t : G_ ) {
+            G.push_back(entry{index_t(row(t)), index_t(col(t)), value_t(value(t))});
+        }
+        for ( auto const & t : B_ ) {
+            B.push_back(entry{index_t(row(t)), index_t(col(t)), value_t(value(t))});
+        }
+        std::mutex library_m;
+        index_t k = 0;
+        auto Q = basis(size_, G_, ports_, B_, k, library_m);
+        G_ = triplets(project(size_, k, Q, G));
+        B_ = triplets(project_rows(size_, k, Q, B, ports_));
+        size_ = k;
+    }
+
+    index_t                size_ = 0;
+    index_t                ports_;
+    qr_options             qr_opts_;
+    thread_budget          budget_;
+    unsigned               threads_;
+    std::atomic<std::size_t> unfinished_{0};   // parts not yet reduced
+    std::vector<triplet_t> G_, B_;
+    std::vector<double>    part_seconds_;
+    double                 seconds_ = 0;
+};
+
+#endif // HIERARCHICAL_REDUCTION_HPP
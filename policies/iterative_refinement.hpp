@@ -0,0 +1,72 @@
+// Iterative refinement: recovering full accuracy from an approximate solver
+// (e.g. a factorization in lower precision) using residuals in full precision
+
+#ifndef ITERATIVE_REFINEMENT_HPP
+#define ITERATIVE_REFINEMENT_HPP
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+struct refinement_options {
+    double tolerance      = 1e-10;   // target for |b - Ax|_inf / |b|_inf
+    int    max_iterations = 10;
+    double stall_ratio    = 0.5;     // give up unless each step shrinks the residual this much
+};
+
+struct refinement_stats {
+    int    iterations = 0;       // most corrections used by any column
+    double residual   = 0;       // worst final relative residual
+    bool   converged  = true;
+    bool   fell_back  = false;   // set by callers that switch to another solver
+};
+
+// Refine one column: x holds an initial solution of A x = b and is improved in place
+// "residual(x, r)" must set r = b - A x in full precision;
+// "correct(r)" must overwrite r with the approximate solution of A d = r
+template<typename Value, typename Index, typename Residual, typename Correct>
+refinement_stats
+refine( Index n, Value const * b, Value * x,
+        Residual && residual, Correct && correct,
+        refinement_options const & opts = refinement_options() ) {
+    auto inf_norm = [n](Value const * v) {
+        Value m(0);
+        for ( Index i = 0; i < n; ++i ) {
+            m = std::max(m, Value(std::abs(v[i])));
+        }
+        return m;
+    };
+
+    refinement_stats stats;
+    Value bnorm = inf_norm(b);
+    if ( bnorm == Value(0) ) {
+        std::fill(x, x + n, Value(0));
+        return stats;
+    }
+
+    std::vector<Value> r(n);
+    residual(x, r.data());
+    stats.residual = inf_norm(r.data()) / bnorm;
+    while ( stats.residual > opts.tolerance ) {
+        if ( stats.iterations == opts.max_iterations ) {
+            stats.converged = false;
+            break;
+        }
+        correct(r.data());
+        for ( Index i = 0; i < n; ++i ) {
+            x[i] += r[i];
+        }
+        ++stats.iterations;
+
+        residual(x, r.data());
+        double previous = stats.residual;
+        stats.residual = inf_norm(r.data()) / bnorm;
+        if ( stats.residual > opts.stall_ratio * previous && stats.residual > opts.tolerance ) {
+            stats.converged = false;
+            break;
+        }
+    }
+    return stats;
+}
+
+#endif // ITERATIVE_REFINEMENT_HPP
@@ -0,0 +1,222 @@
+// Implement SparseLibrary requirements with an iterative solver in place of LU
+// For very large G (power grids, say) the fill in a direct factorization is too
+// much; instead we build an incomplete LU once and use it to precondition BiCGSTAB
+// for every right hand side.  Matrices, triplets, and QR come from the Eigen policy.
+//
+// G is kept in row major form so that Eigen runs our sparse * dense products
+// on multiple threads when built with OpenMP (see Eigen::setNbThreads)
+
+#ifndef ITERATIVE_SHIM_HPP
+#define ITERATIVE_SHIM_HPP
+
+#include <Eigen/Sparse>
+#include <Eigen/IterativeLinearSolvers>
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+
+#include "eigen_shim.hpp"
+#include "trace.hpp"
+
+struct krylov_options {
+    double tolerance      = 1e-12;   // for |b - Ax|_2 / |b|_2, in each column
+    int    max_iterations = 1000;
+    // incomplete LU parameters (Eigen::IncompleteLUT)
+    double drop_tolerance = 1e-6;
+    int    fill_factor    = 20;
+    // iterate on all right hand side columns together, so each pass over G
+    // and the preconditioner serves every column instead of just one
+    bool   block          = true;
+};
+
+struct krylov_stats {
+    int    iterations = 0;   // most used by any column
+    double residual   = 0;   // worst final relative residual
+    bool   converged  = true;
+};
+
+template<typename Value = double, typename Index = int>
+struct IterativeShimT {
+    using base_t      = EigenShimT<Value, Index>;
+    using value_t     = typename base_t::value_t;
+    using triplet_t   = typename base_t::triplet_t;
+    using sparsemat_t = typename base_t::sparsemat_t;
+    using index_t     = typename base_t::index_t;
+    using qr_t        = typename base_t::qr_t;
+
+    static void set_threads( thread_counts const & c ) { base_t::set_threads(c); }
+
+    struct lu_t {
+        using rowmat_t = Eigen::SparseMatrix<value_t, Eigen::RowMajor, index_t>;
+        using dense_t  = Eigen::Matrix<value_t, Eigen::Dynamic, Eigen::Dynamic>;
+
+        lu_t( sparsemat_t const & mat, krylov_options const & opts = krylov_options() )
+            : A_(mat.wrapped()), opts_(opts) {
+            SPARSELIB_TRACE_SCOPE("iterative ilu factor");
+            ilu_.setDroptol(opts_.drop_tolerance);
+            ilu_.setFillfactor(opts_.fill_factor);
+            ilu_.compute(A_);
+            assert(ilu_.info() == Eigen::Success);
+        }
+
+        sparsemat_t solve( sparsemat_t const & rhs ) const {
+            dense_t x = solve_dense(rhs.wrapped());
+            return sparsemat_t(x.sparseView());
+        }
+
+        dense_t solve_dense( dense_t const & b ) const {
+            SPARSELIB_TRACE_SCOPE("iterative krylov solve");
+            dense_t x = dense_t::Zero(b.rows(), b.cols());
+            stats_ = krylov_stats();
+            if ( opts_.block ) {
+                bicgstab(b, x);
+            } else {
+                for ( index_t c = 0; c < b.cols(); ++c ) {
+                    dense_t xc = dense_t::Zero(b.rows(), 1);
+                    bicgstab(b.col(c), xc);
+                    x.col(c) = xc;
+                }
+            }
+            if ( !stats_.converged ) {
+                throw std::runtime_error("iterative solver: no convergence");
+            }
+            return x;
+        }
+
+        krylov_stats const & last_solve() const { return stats_; }
+
+    private:
+        using vector_t = Eigen::Matrix<value_t, Eigen::Dynamic, 1>;
+
+        // Right preconditioned BiCGSTAB, run on all columns of b at once.  Each column
+        // has its own scalars, but shares the products with A and the preconditioner.
+        // Converged columns are dropped from the working set as we go.
+        void bicgstab( dense_t const & b, dense_t & x ) const {
+            index_t n = index_t(b.rows());
+            std::vector<index_t> active;      // original column of each working column
+            vector_t bnorm(b.cols());
+            for ( index_t c = 0; c < b.cols(); ++c ) {
+                bnorm(c) = b.col(c).norm();
+                if ( bnorm(c) != value_t(0) ) {
+                    active.push_back(c);
+                }
+            }
+            index_t k = index_t(active.size());
+            if ( k == 0 ) {
+                return;
+            }
+
+            dense_t X(n, k), R(n, k);
+            vector_t tol(k);
+            for ( index_t j = 0; j < k; ++j ) {
+                X.col(j) = x.col(active[j]);
+                tol(j)   = opts_.tolerance * bnorm(active[j]);
+            }
+            R = A_ * X;
+            for ( index_t j = 0; j < k; ++j ) {
+                R.col(j) = b.col(active[j]) - R.col(j);
+            }
+            dense_t R0 = R;
+            dense_t P  = dense_t::Zero(n, k);
+            dense_t V  = dense_t::Zero(n, k);
+            vector_t rho   = vector_t::Ones(k);
+            vector_t alpha = vector_t::Ones(k);
+            vector_t omega = vector_t::Ones(k);
+
+            value_t const eps2 = std::numeric_limits<value_t>::epsilon() *
+                                 std::numeric_limits<value_t>::epsilon();
+            int iter = 0;
+            for ( ; ; ++iter ) {
+                // retire converged columns
+                vector_t rnorm = R.colwise().norm().transpose();
+                std::vector<index_t> keep;
+                for ( index_t j = 0; j < k; ++j ) {
+                    if ( rnorm(j) <= tol(j) ) {
+                        x.col(active[j]) = X.col(j);
+                        stats_.residual = std::max(stats_.residual, double(rnorm(j) / bnorm(active[j])));
+                    } else {
+                        keep.push_back(j);
+                    }
+                }
+                if ( index_t(keep.size()) != k ) {
+                    for ( auto M : {&X, &R, &R0, &P, &V} ) {
+                        *M = dense_t((*M)(Eigen::all, keep));
+                    }
+                    for ( auto v : {&tol, &rho, &alpha, &omega} ) {
+                        *v = vector_t((*v)(keep));
+                    }
+                    std::vector<index_t> still;
+                    for ( index_t j : keep ) {
+                        still.push_back(active[j]);
+                    }
+                    active.swap(still);
+                    k = index_t(active.size());
+                }
+                if ( k == 0 ) {
+                    break;
+                }
+                if ( iter == opts_.max_iterations ) {
+                    for ( index_t j = 0; j < k; ++j ) {
+                        x.col(active[j]) = X.col(j);
+                        stats_.residual = std::max(stats_.residual,
+                                                   double(R.col(j).norm() / bnorm(active[j])));
+                    }
+                    stats_.converged = false;
+                    break;
+                }
+
+                vector_t rho_new = R0.cwiseProduct(R).colwise().sum().transpose();
+                vector_t beta(k);
+                for ( index_t j = 0; j < k; ++j ) {
+                    // restart a column whose shadow residual has become orthogonal to it
+                    // (or that stagnated last time) as Eigen's own BiCGSTAB does
+                    if ( (std::abs(rho_new(j)) < eps2 * R0.col(j).squaredNorm()) ||
+                         (omega(j) == value_t(0)) ) {
+                        R0.col(j)  = R.col(j);
+                        rho_new(j) = R.col(j).squaredNorm();
+                        P.col(j).setZero();
+                        V.col(j).setZero();
+                        beta(j)    = value_t(0);
+                        omega(j)   = value_t(1);
+                    } else {
+                        beta(j) = (rho_new(j) / rho(j)) * (alpha(j) / omega(j));
+                    }
+                }
+                rho = rho_new;
+
+                P = R + (P - V * omega.asDiagonal()) * beta.asDiagonal();
+                dense_t Y = ilu_.solve(P);
+                V = A_ * Y;
+                vector_t r0v = R0.cwiseProduct(V).colwise().sum().transpose();
+                for ( index_t j = 0; j < k; ++j ) {
+                    alpha(j) = (r0v(j) != value_t(0)) ? rho(j) / r0v(j) : value_t(0);
+                }
+                dense_t S = R - V * alpha.asDiagonal();
+                dense_t Z = ilu_.solve(S);
+                dense_t T = A_ * Z;
+                vector_t tt = T.colwise().squaredNorm().transpose();
+                vector_t ts = T.cwiseProduct(S).colwise().sum().transpose();
+                for ( index_t j = 0; j < k; ++j ) {
+                    omega(j) = (tt(j) != value_t(0)) ? ts(j) / tt(j) : value_t(0);
+                }
+                X += Y * alpha.asDiagonal() + Z * omega.asDiagonal();
+                R = S - T * omega.asDiagonal();
+            }
+            stats_.iterations = std::max(stats_.iterations, iter);
+        }
+
+        rowmat_t                                  A_;
+        krylov_options                            opts_;
+        Eigen::IncompleteLUT<value_t, index_t>    ilu_;
+        mutable krylov_stats                      stats_;
+    };
+};
+
+using IterativeShim   = IterativeShimT<>;
+using IterativeShim64 = IterativeShimT<double, std::int64_t>;
+
+#endif // ITERATIVE_SHIM_HPP
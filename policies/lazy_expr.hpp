@@ -0,0 +1,316 @@
+// Unevaluated solves and products with Q, run a few columns at a time
+//
+// A Krylov step like Q^T (G^-1 (C X)) normally makes every intermediate in full:
+// C X, then G^-1 of that (dense-ish, since G^-1 fills in), and only then the product
+// that shrinks it again.  The types here record such a chain instead and evaluate it
+// in column panels: each panel of X goes through C, the LU solve and Q^T before the
+// next one starts, so the temporaries are never more than a panel wide.  Only the
+// operations every policy has are used (products, lu_t::solve, qr_t::Q, triplets);
+// a Q is formed once, on first use.
+//
+//     sparsemat_t Y = lazy::Q<L>(qr).transpose() * lazy::solve<L>(lu, C * lazy::ref<L>(X));
+//
+// Expressions convert to sparsemat_t (which is when the work happens), so they can
+// go wherever a matrix can.  Like Eigen's, they refer to their operands rather than
+// copying them, so they should be evaluated before those go away.
+
+#ifndef LAZY_EXPR_HPP
+#define LAZY_EXPR_HPP
+
+#include <memory>
+#include <vector>
+#include <ostream>
+#include <algorithm>
+#include <type_traits>
+
+namespace lazy {
+
+// columns evaluated together, unless eval() is told otherwise
+static constexpr long default_panel = 32;
+
+template<typename L, typename Derived>
+struct expr {
+    using library_t   = L;
+    using index_t     = typename L::index_t;
+    using value_t     = typename L::value_t;
+    using triplet_t   = typename L::triplet_t;
+    using sparsemat_t = typename L::sparsemat_t;
+
+    Derived const & derived() const { return static_cast<Derived const &>(*this); }
+
+    // the whole result, panel by panel
+    sparsemat_t eval( index_t panel = index_t(default_panel) ) const {
+        Derived const & d = derived();
+        index_t cols = d.cols();
+        panel = std::max(index_t(1), panel);
+        if ( cols <= panel ) {
+            return d.panel(0, cols);
+        }
+        std::vector<triplet_t> t;
+        for ( index_t first = 0; first < cols; first += panel ) {
+            sparsemat_t p = d.panel(first, std::min(panel, cols - first));
+            p.for_each_nonzero([&t, first](index_t i, index_t j, value_t v) {
+                    t.push_back(triplet_t{i, index_t(first + j), v});
+                });
+        }
+        return sparsemat_t(d.rows(), cols, t.begin(), t.end());
+    }
+
+    operator sparsemat_t() const { return eval(); }
+
+    friend std::ostream & operator<<( std::ostream & os, expr const & e ) {
+        return os << e.eval();
+    }
+};
+
+template<typename T>
+struct is_expr {
+    template<typename L, typename D>
+    static std::true_type check( expr<L, D> const * );
+    static std::false_type check( ... );
+    static constexpr bool value = decltype(check(static_cast<T const *>(nullptr)))::value;
+};
+
+namespace detail {
+
+// the entries of a matrix, possibly transposed, grouped by column for cutting into panels
+template<typename L>
+struct by_column {
+    using index_t     = typename L::index_t;
+    using value_t     = typename L::value_t;
+    using triplet_t   = typename L::triplet_t;
+    using sparsemat_t = typename L::sparsemat_t;
+
+    by_column( sparsemat_t const & m, bool transposed )
+        : start(std::size_t(transposed ? m.rows() : m.cols()) + 1, 0) {
+        m.for_each_nonzero([this, transposed](index_t i, index_t j, value_t) {
+                ++start[std::size_t(transposed ? i : j) + 1];
+            });
+        for ( std::size_t c = 1; c < start.size(); ++c ) {
+            start[c] += start[c - 1];
+        }
+        rows.resize(start.back());
+        values.resize(start.back());
+        std::vector<std::size_t> next(start.begin(), start.end() - 1);
+        m.for_each_nonzero([&](index_t i, index_t j, value_t v) {
+                std::size_t at = next[transposed ? i : j]++;
+                rows[at] = transposed ? j : i;
+                values[at] = v;
+            });
+    }
+
+    sparsemat_t panel( index_t nrows, index_t first, index_t count ) const {
+        std::vector<triplet_t> t;
+        t.reserve(start[first + count] - start[first]);
+        for ( index_t c = 0; c < count; ++c ) {
+            for ( std::size_t k = start[first + c]; k < start[first + c + 1]; ++k ) {
+                t.push_back(triplet_t{rows[k], c, values[k]});
+            }
+        }
+        return sparsemat_t(nrows, count, t.begin(), t.end());
+    }
+
+    std::vector<std::size_t> start;
+    std::vector<index_t>     rows;
+    std::vector<value_t>     values;
+};
+
+template<typename L>
+typename L::sparsemat_t
+transposed( typename L::sparsemat_t const & m ) {
+    using index_t = typename L::index_t;
+    std::vector<typename L::triplet_t> t;
+    m.for_each_nonzero([&t](index_t i, index_t j, typename L::value_t v) {
+            t.push_back(typename L::triplet_t{j, i, v});
+        });
+    return typename L::sparsemat_t(m.cols(), m.rows(), t.begin(), t.end());
+}
+
+}
+
+// A matrix as the start of a chain
+template<typename L>
+class matrix : public expr<L, matrix<L>> {
+public:
+    using base = expr<L, matrix<L>>;
+    using typename base::index_t;
+    using typename base::sparsemat_t;
+
+    // the matrix is referred to, not copied
+    matrix( sparsemat_t const & m, bool transposed = false )
+        : m_(&m, [](sparsemat_t const *) {}), transposed_(transposed) {}
+
+    // this one is kept alive by the expression
+    matrix( std::shared_ptr<sparsemat_t const> m, bool transposed = false )
+        : m_(std::move(m)), transposed_(transposed) {}
+
+    index_t rows() const { return transposed_ ? m_->cols() : m_->rows(); }
+    index_t cols() const { return transposed_ ? m_->rows() : m_->cols(); }
+
+    matrix transpose() const { return matrix(m_, !transposed_); }
+
+    sparsemat_t panel( index_t first, index_t count ) const {
+        if ( !transposed_ && (first == 0) && (count == cols()) ) {
+            return *m_;
+        }
+        if ( !split_ ) {
+            split_ = std::make_shared<detail::by_column<L>>(*m_, transposed_);
+        }
+        return split_->panel(rows(), first, count);
+    }
+
+    // as the left side of a product, where it is used whole
+    std::shared_ptr<sparsemat_t const> whole() const {
+        if ( !transposed_ ) {
+            return m_;
+        }
+        if ( !whole_ ) {
+            whole_ = std::make_shared<sparsemat_t const>(detail::transposed<L>(*m_));
+        }
+        return whole_;
+    }
+
+private:
+    std::shared_ptr<sparsemat_t const>                   m_;
+    bool                                                 transposed_;
+    mutable std::shared_ptr<detail::by_column<L>>        split_;   // made on first use
+    mutable std::shared_ptr<sparsemat_t const>           whole_;
+};
+
+// A times the chain E
+template<typename L, typename E>
+class product : public expr<L, product<L, E>> {
+public:
+    using base = expr<L, product<L, E>>;
+    using typename base::index_t;
+    using typename base::sparsemat_t;
+
+    product( std::shared_ptr<sparsemat_t const> a, index_t rows, E e )
+        : a_(std::move(a)), rows_(rows), e_(std::move(e)) {}
+
+    index_t rows() const { return rows_; }
+    index_t cols() const { return e_.cols(); }
+
+    sparsemat_t panel( index_t first, index_t count ) const {
+        return *a_ * e_.panel(first, count);
+    }
+
+private:
+    std::shared_ptr<sparsemat_t const> a_;
+    index_t                            rows_;
+    E                                  e_;
+};
+
+// G^-1 times the chain E, with G's LU
+template<typename L, typename E>
+class solve_expr : public expr<L, solve_expr<L, E>> {
+public:
+    using base = expr<L, solve_expr<L, E>>;
+    using typename base::index_t;
+    using typename base::sparsemat_t;
+
+    solve_expr( typename L::lu_t const & lu, E e ) : lu_(&lu), e_(std::move(e)) {}
+
+    index_t rows() const { return e_.rows(); }
+    index_t cols() const { return e_.cols(); }
+
+    sparsemat_t panel( index_t first, index_t count ) const {
+        return lu_->solve(e_.panel(first, count));
+    }
+
+private:
+    typename L::lu_t const * lu_;
+    E                        e_;
+};
+
+// The Q of a QR, formed when first needed and shared by copies of the expression
+template<typename L>
+class q_expr : public expr<L, q_expr<L>> {
+public:
+    using base = expr<L, q_expr<L>>;
+    using typename base::index_t;
+    using typename base::sparsemat_t;
+
+    explicit q_expr( typename L::qr_t const & qr, bool transposed = false )
+        : qr_(&qr), q_(std::make_shared<std::shared_ptr<matrix<L>>>()), transposed_(transposed) {}
+
+    index_t rows() const { return get().rows(); }
+    index_t cols() const { return get().cols(); }
+
+    q_expr transpose() const {
+        q_expr t(*this);
+        t.transposed_ = !transposed_;
+        return t;
+    }
+
+    sparsemat_t panel( index_t first, index_t count ) const { return get().panel(first, count); }
+
+    std::shared_ptr<sparsemat_t const> whole() const { return get().whole(); }
+
+private:
+    matrix<L> get() const {
+        if ( !*q_ ) {
+            *q_ = std::make_shared<matrix<L>>(std::make_shared<sparsemat_t const>(qr_->Q()));
+        }
+        return transposed_ ? (*q_)->transpose() : **q_;
+    }
+
+    typename L::qr_t const *                  qr_;
+    std::shared_ptr<std::shared_ptr<matrix<L>>> q_;
+    bool                                      transposed_;
+};
+
+// Ways in
+
+template<typename L>
+matrix<L> ref( typename L::sparsemat_t const & m ) {
+    return matrix<L>(m);
+}
+
+template<typename L>
+q_expr<L> Q( typename L::qr_t const & qr ) {
+    return q_expr<L>(qr);
+}
+
+template<typename L, typename E>
+typename std::enable_if<is_expr<E>::value, solve_expr<L, E>>::type
+solve( typename L::lu_t const & lu, E e ) {
+    return solve_expr<L, E>(lu, std::move(e));
+}
+
+template<typename L>
+solve_expr<L, matrix<L>>
+solve( typename L::lu_t const & lu, typename L::sparsemat_t const & b ) {
+    return solve_expr<L, matrix<L>>(lu, matrix<L>(b));
+}
+
+// Products: a plain matrix, a leaf or a Q on the left, a chain or a plain matrix on the right
+
+template<typename E>
+typename std::enable_if<is_expr<E>::value, product<typename E::library_t, E>>::type
+operator*( typename E::sparsemat_t const & a, E const & e ) {
+    using L = typename E::library_t;
+    return product<L, E>(matrix<L>(a).whole(), a.rows(), e);
+}
+
+template<typename L, typename E>
+typename std::enable_if<is_expr<E>::value, product<L, E>>::type
+operator*( matrix<L> const & a, E const & e ) {
+    return product<L, E>(a.whole(), a.rows(), e);
+}
+
+template<typename L, typename E>
+typename std::enable_if<is_expr<E>::value, product<L, E>>::type
+operator*( q_expr<L> const & q, E const & e ) {
+    return product<L, E>(q.whole(), q.rows(), e);
+}
+
+template<typename L>
+product<L, matrix<L>>
+operator*( q_expr<L> const & q, typename L::sparsemat_t const & b ) {
+    return product<L, matrix<L>>(q.whole(), q.rows(), matrix<L>(b));
+}
+
+}
+
+#endif // LAZY_EXPR_HPP
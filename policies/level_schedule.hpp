@@ -0,0 +1,254 @@
+// Level scheduled sparse triangular solves
+//
+// Each unknown v of a triangular (more generally, acyclic) sparse system is found as
+//     x[v] = (b[v] - sum_k a_k x[src_k]) / d[v]
+// once all of its sources are known.  When the schedule is built we group the
+// unknowns into levels, each depending only on earlier ones; a solve then runs
+// the members of each level in parallel (with OpenMP, if we were built with it).
+// All the analysis is done once, so repeated solves pay only for the arithmetic.
+
+#ifndef LEVEL_SCHEDULE_HPP
+#define LEVEL_SCHEDULE_HPP
+
+#include <vector>
+#include <deque>
+#include <stdexcept>
+#include <algorithm>
+
+#include "lu_file.hpp"     // for factor_view
+
+namespace level_schedule {
+
+// A system given as one row per unknown: the (source, coefficient) pairs of row v
+// are ptr[v] to ptr[v+1] of src and coef, and d[v] is its diagonal
+template<typename Value, typename Index>
+struct dag_solver {
+    // below this much work per level (rows times right hand sides) we stay on one thread
+    static constexpr Index min_parallel_work = 1024;
+
+    dag_solver() : n_(0) {}
+
+    dag_solver( Index n, std::vector<Index> ptr, std::vector<Index> src,
+                std::vector<Value> coef, std::vector<Value> diag )
+        : n_(n), ptr_(std::move(ptr)), src_(std::move(src)),
+          coef_(std::move(coef)), diag_(std::move(diag)) {
+        // who depends on each unknown
+        std::vector<Index> dptr(n + 1, 0), dep(src_.size());
+        for ( Index s : src_ ) {
+            ++dptr[s + 1];
+        }
+        for ( Index v = 0; v < n; ++v ) {
+            dptr[v + 1] += dptr[v];
+        }
+        std::vector<Index> next(dptr.begin(), dptr.end() - 1);
+        for ( Index v = 0; v < n; ++v ) {
+            for ( Index k = ptr_[v]; k < ptr_[v+1]; ++k ) {
+                dep[next[src_[k]]++] = v;
+            }
+        }
+
+        // level of each unknown: one more than the deepest of its sources
+        std::vector<Index> level(n, 0), waiting(n);
+        std::deque<Index> ready;
+        for ( Index v = 0; v < n; ++v ) {
+            waiting[v] = ptr_[v+1] - ptr_[v];
+            if ( waiting[v] == 0 ) {
+                ready.push_back(v);
+            }
+        }
+        Index done = 0, nlevels = 0;
+        while ( !ready.empty() ) {
+            Index v = ready.front();
+            ready.pop_front();
+            ++done;
+            nlevels = std::max(nlevels, level[v] + 1);
+            for ( Index k = dptr[v]; k < dptr[v+1]; ++k ) {
+                Index w = dep[k];
+                level[w] = std::max(level[w], level[v] + 1);
+                if ( --waiting[w] == 0 ) {
+                    ready.push_back(w);
+                }
+            }
+        }
+        if ( done != n ) {
+            throw std::logic_error("level schedule: system is not triangular");
+        }
+
+        // unknowns grouped by level
+        level_ptr_.assign(nlevels + 1, 0);
+        for ( Index v = 0; v < n; ++v ) {
+            ++level_ptr_[level[v] + 1];
+        }
+        for ( Index l = 0; l < nlevels; ++l ) {
+            level_ptr_[l + 1] += level_ptr_[l];
+        }
+        order_.resize(n);
+        std::vector<Index> slot(level_ptr_.begin(), level_ptr_.end() - 1);
+        for ( Index v = 0; v < n; ++v ) {
+            order_[slot[level[v]]++] = v;
+        }
+    }
+
+    Index size() const { return n_; }
+    Index levels() const { return Index(level_ptr_.size()) - 1; }
+
+    // x is column-major, size() x ncols; it holds b on entry and the solution on exit
+    void solve( Value * x, Index ncols ) const {
+        auto row = [this, x, ncols](Index v) {
+            for ( Index c = 0; c < ncols; ++c ) {
+                Value * xc = x + c * n_;
+                Value s = xc[v];
+                for ( Index k = ptr_[v]; k < ptr_[v+1]; ++k ) {
+                    s -= coef_[k] * xc[src_[k]];
+                }
+                xc[v] = s / diag_[v];
+            }
+        };
+
+        Index nlevels = levels();
+        if ( n_ * ncols < min_parallel_work * nlevels ) {
+            // levels too narrow to be worth the synchronization; any order by level will do
+            for ( Index v : order_ ) {
+                row(v);
+            }
+            return;
+        }
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+        for ( Index l = 0; l < nlevels; ++l ) {
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+            for ( Index k = level_ptr_[l]; k < level_ptr_[l+1]; ++k ) {
+                row(order_[k]);
+            }
+        }
+    }
+
+private:
+    Index               n_;
+    std::vector<Index>  ptr_, src_;
+    std::vector<Value>  coef_, diag_;
+    std::vector<Index>  level_ptr_;   // start of each level in order_
+    std::vector<Index>  order_;       // unknowns, by level
+};
+
+// Solves with a complete factorization (R \ A)(P, Q) = L * U + F, in the form
+// described in lu_file.hpp.  L and U are solved together as one system in 2n
+// unknowns (z = U x, then x), so parts of U can start before L is finished,
+// and F (from a block triangular form) just adds more dependencies:
+//     [  L  F ] [z]   [y]
+//     [ -I  U ] [x] = [0]
+// A missing diagonal in L is taken to be 1
+template<typename Value, typename Index>
+struct lu_solver {
+    explicit lu_solver( lu_file::factor_view<Value, Index> const & f ) : n_(f.n) {
+        Index n = f.n;
+        if ( f.P ) {
+            P_.assign(f.P, f.P + n);
+        }
+        if ( f.Q ) {
+            Q_.assign(f.Q, f.Q + n);
+        }
+        if ( f.Rs ) {
+            Rs_.assign(f.Rs, f.Rs + n);
+        }
+
+        // count the entries in each row of the combined system
+        std::vector<Index> ptr(2 * n + 1, 0);
+        auto count = [&ptr, n](Index const * p, Index const * i, Index row_offset, Index src_offset) {
+            for ( Index j = 0; j < n; ++j ) {
+                for ( Index k = p[j]; k < p[j+1]; ++k ) {
+                    if ( (i[k] + row_offset) != (j + src_offset) ) {
+                        ++ptr[i[k] + row_offset + 1];
+                    }
+                }
+            }
+        };
+        count(f.Lp, f.Li, 0, 0);
+        count(f.Up, f.Ui, n, n);
+        if ( f.Fp ) {
+            count(f.Fp, f.Fi, 0, n);
+        }
+        for ( Index v = n; v < 2 * n; ++v ) {
+            ++ptr[v + 1];       // x_i depends on z_i
+        }
+        for ( Index v = 0; v < 2 * n; ++v ) {
+            ptr[v + 1] += ptr[v];
+        }
+
+        // and fill them in
+        std::vector<Index> src(ptr[2 * n]);
+        std::vector<Value> coef(ptr[2 * n]);
+        std::vector<Value> diag(2 * n, Value(1));
+        std::vector<Index> next(ptr.begin(), ptr.end() - 1);
+        auto fill = [&](Index const * p, Index const * i, Value const * x,
+                        Index row_offset, Index src_offset) {
+            for ( Index j = 0; j < n; ++j ) {
+                for ( Index k = p[j]; k < p[j+1]; ++k ) {
+                    Index r = i[k] + row_offset;
+                    if ( r == j + src_offset ) {
+                        diag[r] = x[k];
+                    } else {
+                        src[next[r]]    = j + src_offset;
+                        coef[next[r]++] = x[k];
+                    }
+                }
+            }
+        };
+        fill(f.Lp, f.Li, f.Lx, 0, 0);
+        fill(f.Up, f.Ui, f.Ux, n, n);
+        if ( f.Fp ) {
+            fill(f.Fp, f.Fi, f.Fx, 0, n);
+        }
+        for ( Index i = 0; i < n; ++i ) {
+            src[next[n + i]]    = i;
+            coef[next[n + i]++] = Value(-1);
+        }
+
+        dag_ = dag_solver<Value, Index>(2 * n, std::move(ptr), std::move(src),
+                                        std::move(coef), std::move(diag));
+    }
+
+    Index size() const { return n_; }
+    Index levels() const { return dag_.levels(); }
+
+    // overwrite a column-major n x ncols matrix with the solution
+    void solve( Value * b, Index ncols ) const {
+        std::vector<Value> w;
+        solve(b, ncols, w);
+    }
+
+    // the same, with scratch space w supplied by the caller
+    void solve( Value * b, Index ncols, std::vector<Value> & w ) const {
+        Index n = n_;
+        w.assign(2 * n * ncols, Value(0));
+        for ( Index c = 0; c < ncols; ++c ) {
+            Value const * bc = b + c * n;
+            Value * wc = w.data() + c * 2 * n;
+            for ( Index k = 0; k < n; ++k ) {
+                Index i = P_.empty() ? k : P_[k];
+                wc[k] = Rs_.empty() ? bc[i] : bc[i] / Rs_[k];    // Rs is in pivotal order
+            }
+        }
+        dag_.solve(w.data(), ncols);
+        for ( Index c = 0; c < ncols; ++c ) {
+            Value * bc = b + c * n;
+            Value const * xc = w.data() + c * 2 * n + n;
+            for ( Index k = 0; k < n; ++k ) {
+                bc[Q_.empty() ? k : Q_[k]] = xc[k];
+            }
+        }
+    }
+
+private:
+    Index                     n_;
+    std::vector<Index>        P_, Q_;
+    std::vector<Value>        Rs_;
+    dag_solver<Value, Index>  dag_;
+};
+
+}
+
+#endif // LEVEL_SCHEDULE_HPP
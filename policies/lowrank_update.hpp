@@ -0,0 +1,177 @@
+// Sherman-Morrison-Woodbury correction for a factored matrix
+// Library independent: the policies supply a dense solve with their existing factors
+
+#ifndef LOWRANK_UPDATE_HPP
+#define LOWRANK_UPDATE_HPP
+
+#include <vector>
+#include <map>
+#include <cmath>
+#include <algorithm>
+#include <utility>
+#include <iterator>
+#include <type_traits>
+
+#include "triplet_access.hpp"
+
+// Dense LU with partial pivoting, for the small k x k systems we generate
+// Column-major storage, like everything else we hand to the C libraries
+template<typename Value, typename Index>
+struct dense_lu {
+    dense_lu() : n_(0), singular_(false) {}
+
+    dense_lu(std::vector<Value> a, Index n)
+        : a_(std::move(a)), piv_(n), n_(n), singular_(false) {
+        for ( Index k = 0; k < n_; ++k ) {
+            // find pivot row
+            Index p = k;
+            for ( Index i = k+1; i < n_; ++i ) {
+                if ( std::abs(at(i, k)) > std::abs(at(p, k)) ) {
+                    p = i;
+                }
+            }
+            piv_[k] = p;
+            if ( at(p, k) == Value(0) ) {
+                singular_ = true;
+                return;
+            }
+            if ( p != k ) {
+                for ( Index j = 0; j < n_; ++j ) {
+                    std::swap(at(p, j), at(k, j));
+                }
+            }
+            // eliminate below the pivot
+            for ( Index i = k+1; i < n_; ++i ) {
+                at(i, k) /= at(k, k);
+            }
+            for ( Index j = k+1; j < n_; ++j ) {
+                for ( Index i = k+1; i < n_; ++i ) {
+                    at(i, j) -= at(i, k) * at(k, j);
+                }
+            }
+        }
+    }
+
+    bool singular() const { return singular_; }
+
+    // overwrite b with the solution of A x = b
+    void solve(Value * b) const {
+        for ( Index k = 0; k < n_; ++k ) {
+            std::swap(b[k], b[piv_[k]]);
+            for ( Index i = k+1; i < n_; ++i ) {
+                b[i] -= at(i, k) * b[k];
+            }
+        }
+        for ( Index k = n_; k-- > 0; ) {
+            b[k] /= at(k, k);
+            for ( Index i = 0; i < k; ++i ) {
+                b[i] -= at(i, k) * b[k];
+            }
+        }
+    }
+
+private:
+    Value & at(Index i, Index j) { return a_[j * n_ + i]; }
+    Value const & at(Index i, Index j) const { return a_[j * n_ + i]; }
+
+    std::vector<Value> a_;
+    std::vector<Index> piv_;
+    Index              n_;
+    bool               singular_;
+};
+
+// The number of distinct columns touched by a list of changes, i.e. the rank of the
+// update we would build from them
+template<typename Iter>
+std::size_t
+changed_columns( Iter first, Iter last ) {
+    using index_t = typename std::decay<decltype(triplet_access::col(*first))>::type;
+    std::vector<index_t> cols;
+    for ( auto it = first; it != last; ++it ) {
+        cols.push_back(triplet_access::col(*it));
+    }
+    std::sort(cols.begin(), cols.end());
+    return std::distance(cols.begin(), std::unique(cols.begin(), cols.end()));
+}
+
+// Represents (G + dG)^-1 in terms of an existing factorization of G
+// If dG has nonzeros in the k columns J, then dG = U * E_J^T with U = dG(:, J), and
+//   (G + dG)^-1 b = x - Z * S^-1 * x(J)
+// where x = G^-1 b, Z = G^-1 U, and S = I + Z(J, :)
+// Building it costs k solves with the original factor; each later solve costs O(nk)
+template<typename Value, typename Index>
+struct lowrank_update {
+    // "solve" overwrites a column-major dense n x ncols matrix with G^-1 times it
+    template<typename Iter, typename Solver>
+    lowrank_update( Index n, Iter first, Iter last, Solver && solve ) : n_(n) {
+        // gather changes by column, summing duplicates
+        std::map<Index, std::map<Index, Value>> by_col;
+        for ( auto it = first; it != last; ++it ) {
+            by_col[triplet_access::col(*it)][triplet_access::row(*it)] += triplet_access::value(*it);
+        }
+
+        cols_.reserve(by_col.size());
+        for ( auto const& c : by_col ) {
+            cols_.push_back(c.first);
+        }
+        Index k = rank();
+
+        // Z = G^-1 U
+        Z_.assign(n_ * k, Value(0));
+        for ( Index j = 0; j < k; ++j ) {
+            for ( auto const& r : by_col[cols_[j]] ) {
+                Z_[j * n_ + r.first] = r.second;
+            }
+        }
+        solve(Z_.data(), k);
+
+        // S = I + Z(J, :)
+        std::vector<Value> S(k * k, Value(0));
+        for ( Index j = 0; j < k; ++j ) {
+            for ( Index i = 0; i < k; ++i ) {
+                S[j * k + i] = Z_[j * n_ + cols_[i]];
+            }
+            S[j * k + j] += Value(1);
+        }
+        S_ = dense_lu<Value, Index>(std::move(S), k);
+    }
+
+    // number of columns touched by the change
+    Index rank() const { return static_cast<Index>(cols_.size()); }
+
+    // true if the updated matrix is (numerically) singular
+    bool singular() const { return S_.singular(); }
+
+    // x holds G^-1 b for ncols right hand sides; correct them to (G + dG)^-1 b
+    void apply(Value * x, Index ncols) const {
+        std::vector<Value> y;
+        apply(x, ncols, y);
+    }
+
+    // the same, with scratch space y supplied by the caller
+    void apply(Value * x, Index ncols, std::vector<Value> & y) const {
+        Index k = rank();
+        y.resize(k);
+        for ( Index c = 0; c < ncols; ++c ) {
+            Value * xc = x + c * n_;
+            for ( Index i = 0; i < k; ++i ) {
+                y[i] = xc[cols_[i]];
+            }
+            S_.solve(y.data());
+            for ( Index j = 0; j < k; ++j ) {
+                Value const * zj = &Z_[j * n_];
+                for ( Index i = 0; i < n_; ++i ) {
+                    xc[i] -= zj[i] * y[j];
+                }
+            }
+        }
+    }
+
+private:
+    Index                  n_;
+    std::vector<Index>     cols_;   // J
+    std::vector<Value>     Z_;      // G^-1 U, n x k
+    dense_lu<Value, Index> S_;
+};
+
+#endif // LOWRANK_UPDATE_HPP
@@ -0,0 +1,286 @@
+// Binary files holding a completed LU factorization, and a read-only
+// factor that solves directly out of a memory mapping of one
+//
+// A stored factorization describes
+//     (R \ A)(P, Q) = L * U + F
+// where R is an optional row scaling, P and Q are permutations (row k of the
+// factored matrix is row P[k] of A; column k is column Q[k]),
+// L and U are block diagonal, and F holds the entries above the diagonal blocks
+// of a block triangular form (empty unless the library found one, as KLU does).
+// Each column of L stores its diagonal first and each column of U stores its
+// diagonal last, as in CSparse, so no searching is needed during solves.
+// Rs is in pivotal order, as KLU keeps it: row P[k] of A is divided by Rs[k].
+// Libraries that index their scale factors by original row (UMFPACK) permute
+// them before handing them over.
+
+#ifndef LU_FILE_HPP
+#define LU_FILE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace lu_file {
+
+// What a policy hands us to save.  Null P, Q, Rs, R, or F mean identity,
+// no scaling, one block, and no off-diagonal part respectively
+template<typename Value, typename Index>
+struct factor_view {
+    Index         n;
+    Index const * P;
+    Index const * Q;
+    Value const * Rs;
+    Index         nblocks;
+    Index const * R;
+    Index const * Lp; Index const * Li; Value const * Lx;
+    Index const * Up; Index const * Ui; Value const * Ux;
+    Index const * Fp; Index const * Fi; Value const * Fx;
+};
+
+namespace detail {
+
+constexpr std::uint64_t magic   = 0x31554c42494c5053ull;   // "SPLIBLU1"
+constexpr std::uint32_t version = 1;
+
+// the arrays in a file, in order
+enum section { P, Q, Rs, R, Lp, Li, Lx, Up, Ui, Ux, Fp, Fi, Fx, nsections };
+
+struct header {
+    std::uint64_t magic;
+    std::uint32_t version;
+    std::uint32_t index_bytes;
+    std::uint32_t value_bytes;
+    std::uint32_t reserved;
+    std::int64_t  n;
+    std::int64_t  nblocks;
+    std::int64_t  offset[nsections];   // from start of file; 0 if absent
+    std::int64_t  length[nsections];   // in elements
+};
+
+inline std::int64_t align8( std::int64_t off ) { return (off + 7) & ~std::int64_t(7); }
+
+// Copy a triangular factor, moving each column's diagonal entry to the front (lower)
+// or back (upper) so the solves can find it without a search
+template<typename Value, typename Index>
+void
+normalize( Index n, Index const * p, Index const * i, Value const * x, bool lower,
+           std::vector<Index> & ni, std::vector<Value> & nx ) {
+    ni.assign(i, i + p[n]);
+    nx.assign(x, x + p[n]);
+    for ( Index j = 0; j < n; ++j ) {
+        Index want = lower ? p[j] : p[j+1] - 1;
+        for ( Index k = p[j]; k < p[j+1]; ++k ) {
+            if ( ni[k] == j ) {
+                std::swap(ni[k], ni[want]);
+                std::swap(nx[k], nx[want]);
+                break;
+            }
+        }
+    }
+}
+
+}
+
+// Write a factorization to "path"
+template<typename Value, typename Index>
+void
+write_factor( std::string const & path, factor_view<Value, Index> const & f ) {
+    using namespace detail;
+
+    std::vector<Index> Li, Ui;
+    std::vector<Value> Lx, Ux;
+    normalize(f.n, f.Lp, f.Li, f.Lx, true,  Li, Lx);
+    normalize(f.n, f.Up, f.Ui, f.Ux, false, Ui, Ux);
+
+    struct piece { void const * data; std::int64_t length; std::int64_t bytes; };
+    auto ix = [](Index const * p, std::int64_t len) { return piece{p, p ? len : 0, std::int64_t(sizeof(Index))}; };
+    auto vx = [](Value const * p, std::int64_t len) { return piece{p, p ? len : 0, std::int64_t(sizeof(Value))}; };
+    Index n = f.n;
+    piece pieces[nsections] = {
+        ix(f.P, n), ix(f.Q, n), vx(f.Rs, n), ix(f.R, f.nblocks + 1),
+        ix(f.Lp, n + 1), ix(Li.data(), Li.size()), vx(Lx.data(), Lx.size()),
+        ix(f.Up, n + 1), ix(Ui.data(), Ui.size()), vx(Ux.data(), Ux.size()),
+        ix(f.Fp, n + 1), ix(f.Fi, f.Fp ? f.Fp[n] : 0), vx(f.Fx, f.Fp ? f.Fp[n] : 0)
+    };
+
+    header h;
+    std::memset(&h, 0, sizeof(h));
+    h.magic       = magic;
+    h.version     = version;
+    h.index_bytes = sizeof(Index);
+    h.value_bytes = sizeof(Value);
+    h.n           = n;
+    h.nblocks     = f.R ? f.nblocks : 1;
+    std::int64_t off = align8(sizeof(header));
+    for ( int s = 0; s < nsections; ++s ) {
+        if ( pieces[s].data ) {
+            h.offset[s] = off;
+            h.length[s] = pieces[s].length;
+            off = align8(off + pieces[s].length * pieces[s].bytes);
+        }
+    }
+
+    std::ofstream os(path, std::ios::binary | std::ios::trunc);
+    if ( !os ) {
+        throw std::runtime_error("cannot create LU factor file " + path);
+    }
+    os.write(reinterpret_cast<char const *>(&h), sizeof(h));
+    for ( int s = 0; s < nsections; ++s ) {
+        if ( pieces[s].data ) {
+            os.seekp(h.offset[s]);
+            os.write(static_cast<char const *>(pieces[s].data), pieces[s].length * pieces[s].bytes);
+        }
+    }
+    // pad the file out to a whole number of words
+    static char const zeros[8] = {};
+    os.seekp(0, std::ios::end);
+    os.write(zeros, off - std::int64_t(os.tellp()));
+    if ( !os ) {
+        throw std::runtime_error("error writing LU factor file " + path);
+    }
+}
+
+// A factorization solving directly out of a read-only shared mapping of a file
+// Nothing is copied to the heap, and processes mapping the same file share pages
+template<typename Value, typename Index>
+struct mapped_factor {
+    static std::shared_ptr<mapped_factor const>
+    open( std::string const & path ) {
+        return std::shared_ptr<mapped_factor const>(new mapped_factor(path));
+    }
+
+    ~mapped_factor() {
+        munmap(base_, size_);
+    }
+
+    mapped_factor(mapped_factor const&) = delete;
+    mapped_factor & operator=(mapped_factor const&) = delete;
+
+    Index size() const { return n_; }
+
+    // entries in L, U and F together
+    Index nonzeros() const { return Lp_[n_] + Up_[n_] + (Fp_ ? Fp_[n_] : 0); }
+
+    // overwrite a column-major n x ncols matrix with the solution
+    void solve( Value * b, Index ncols ) const {
+        std::vector<Value> y;
+        solve(b, ncols, y);
+    }
+
+    // the same, with scratch space y supplied by the caller
+    void solve( Value * b, Index ncols, std::vector<Value> & y ) const {
+        y.resize(n_);
+        for ( Index c = 0; c < ncols; ++c ) {
+            Value * bc = b + c * n_;
+            for ( Index k = 0; k < n_; ++k ) {
+                Index i = P_ ? P_[k] : k;
+                y[k] = Rs_ ? bc[i] / Rs_[k] : bc[i];
+            }
+            // block back substitution; blocks are independent apart from F
+            for ( Index blk = nblocks_; blk-- > 0; ) {
+                Index k1 = R_ ? R_[blk] : 0;
+                Index k2 = R_ ? R_[blk+1] : n_;
+                for ( Index j = k1; j < k2; ++j ) {
+                    y[j] /= Lx_[Lp_[j]];
+                    for ( Index p = Lp_[j] + 1; p < Lp_[j+1]; ++p ) {
+                        y[Li_[p]] -= Lx_[p] * y[j];
+                    }
+                }
+                for ( Index j = k2; j-- > k1; ) {
+                    y[j] /= Ux_[Up_[j+1] - 1];
+                    for ( Index p = Up_[j]; p < Up_[j+1] - 1; ++p ) {
+                        y[Ui_[p]] -= Ux_[p] * y[j];
+                    }
+                }
+                if ( Fp_ ) {
+                    for ( Index j = k1; j < k2; ++j ) {
+                        for ( Index p = Fp_[j]; p < Fp_[j+1]; ++p ) {
+                            y[Fi_[p]] -= Fx_[p] * y[j];
+                        }
+                    }
+                }
+            }
+            for ( Index k = 0; k < n_; ++k ) {
+                bc[Q_ ? Q_[k] : k] = y[k];
+            }
+        }
+    }
+
+    // hint to the kernel that we are about to solve with this factor
+    void prefetch() const {
+        madvise(base_, size_, MADV_WILLNEED);
+    }
+
+    // drop our resident pages; they are read back from the file if needed again
+    void release() const {
+        madvise(base_, size_, MADV_DONTNEED);
+    }
+
+private:
+    explicit mapped_factor( std::string const & path ) {
+        using namespace detail;
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if ( fd < 0 ) {
+            throw std::runtime_error("cannot open LU factor file " + path);
+        }
+        struct stat st;
+        if ( (fstat(fd, &st) != 0) || (std::size_t(st.st_size) < sizeof(header)) ) {
+            ::close(fd);
+            throw std::runtime_error("bad LU factor file " + path);
+        }
+        size_ = st.st_size;
+        base_ = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);     // the mapping keeps the file alive
+        if ( base_ == MAP_FAILED ) {
+            throw std::runtime_error("cannot map LU factor file " + path);
+        }
+
+        header const & h = *static_cast<header const *>(base_);
+        if ( (h.magic != magic) || (h.version != version) ||
+             (h.index_bytes != sizeof(Index)) || (h.value_bytes != sizeof(Value)) ) {
+            munmap(base_, size_);
+            throw std::runtime_error("LU factor file " + path + " does not match this policy");
+        }
+        n_       = Index(h.n);
+        nblocks_ = Index(h.nblocks);
+        auto at = [this, &h](section s) -> void const * {
+            return h.offset[s] ? static_cast<char const *>(base_) + h.offset[s] : nullptr;
+        };
+        P_  = static_cast<Index const *>(at(P));
+        Q_  = static_cast<Index const *>(at(Q));
+        Rs_ = static_cast<Value const *>(at(Rs));
+        R_  = static_cast<Index const *>(at(R));
+        Lp_ = static_cast<Index const *>(at(Lp));
+        Li_ = static_cast<Index const *>(at(Li));
+        Lx_ = static_cast<Value const *>(at(Lx));
+        Up_ = static_cast<Index const *>(at(Up));
+        Ui_ = static_cast<Index const *>(at(Ui));
+        Ux_ = static_cast<Value const *>(at(Ux));
+        Fp_ = static_cast<Index const *>(at(Fp));
+        Fi_ = static_cast<Index const *>(at(Fi));
+        Fx_ = static_cast<Value const *>(at(Fx));
+    }
+
+    void *      base_;
+    std::size_t size_;
+
+    Index         n_, nblocks_;
+    Index const * P_;  Index const * Q_;  Value const * Rs_; Index const * R_;
+    Index const * Lp_; Index const * Li_; Value const * Lx_;
+    Index const * Up_; Index const * Ui_; Value const * Ux_;
+    Index const * Fp_; Index const * Fi_; Value const * Fx_;
+};
+
+}
+
+#endif // LU_FILE_HPP
@@ -0,0 +1,74 @@
+// Pivoting for the lu_t of each policy, and what the factors say about it
+//
+// All the libraries do threshold partial pivoting: each column's diagonal (after the
+// fill-reducing ordering) is kept as its pivot if it is at least pivot_tolerance times
+// the largest candidate below it.  Small tolerances keep the ordering and the fill it
+// predicted; 1 is plain partial pivoting.  MNA matrices of well-behaved circuits rarely
+// need much.
+//
+// With static pivoting, refactor() (new values, same pattern) reuses the pivot order of
+// the last factorization instead of searching again.  That is only safe while the
+// pivots stay large, so if the smallest falls below small_pivot times the largest we
+// factor again with a fresh search.  Eigen doesn't expose its pivots; there a test
+// solve that loses more than half the digits triggers the fresh search instead.
+//
+// Where a policy has more than one sparse LU (SuiteSparse: KLU, and UMFPACK's
+// multifrontal one), method chooses.  Left-looking KLU is best for the very sparse
+// matrices of most nets; when the elimination is dense (substrate meshes, power grids)
+// most of the work falls on a few large fronts, which UMFPACK factors with dense BLAS-3
+// kernels.  automatic decides by flops per entry of L + U, from the symbolic analysis.
+
+#ifndef LU_OPTIONS_HPP
+#define LU_OPTIONS_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <algorithm>
+
+enum class lu_method { automatic, sparse, supernodal };
+
+struct lu_options {
+    double    pivot_tolerance      = -1;      // negative for the library's default
+    bool      static_pivoting      = false;
+    double    small_pivot          = 1e-12;   // relative to the largest pivot
+    lu_method method               = lu_method::automatic;
+    double    supernodal_intensity = 50;      // flops per factor entry from which automatic goes supernodal
+};
+
+struct lu_diagnostics {
+    double      rcond         = 0;     // smallest |U_jj| over the largest: cheap and rough
+    double      pivot_growth  = 0;     // largest |U_ij| over largest |A_ij|; big means lost accuracy
+    double      min_pivot     = 0;     // smallest and largest |U_jj|
+    double      max_pivot     = 0;
+    bool        static_pivots = false; // whether the factors reused an earlier pivot order
+    bool        supernodal    = false; // whether they came from the supernodal method
+    bool        available     = true;  // false when the library keeps its factors hidden (Eigen),
+                                       // leaving the pivot and growth entries above at 0
+    std::size_t refactors     = 0;     // calls to refactor() so far
+    std::size_t searches      = 0;     // of those, how many fell back to a fresh pivot search
+};
+
+// Fill in the pivot entries of d from the |U_jj|, given as a range
+template<typename Iter>
+void
+record_pivots( lu_diagnostics & d, Iter first, Iter last ) {
+    if ( first == last ) {
+        d.min_pivot = d.max_pivot = d.rcond = 0;
+        return;
+    }
+    d.min_pivot = d.max_pivot = std::abs(double(*first));
+    for ( ; first != last; ++first ) {
+        double p = std::abs(double(*first));
+        d.min_pivot = std::min(d.min_pivot, p);
+        d.max_pivot = std::max(d.max_pivot, p);
+    }
+    d.rcond = (d.max_pivot > 0) ? d.min_pivot / d.max_pivot : 0.0;
+}
+
+// Whether static pivots have become too small to trust
+inline bool
+pivots_too_small( lu_diagnostics const & d, lu_options const & opts ) {
+    return !(d.min_pivot > opts.small_pivot * d.max_pivot);
+}
+
+#endif // LU_OPTIONS_HPP
@@ -0,0 +1,246 @@
+// Admitting jobs only while their memory fits a budget
+//
+// When many nets are reduced at once, the factors dominate memory, and a few large
+// nets factoring at the same time can exhaust the node.  Each job's peak is estimated
+// before its numeric factorization from the symbolic analysis: policies whose lu_t
+// declares
+//     static std::size_t estimate_bytes( sparsemat_t const & );
+// use their own (cs_sqr's lnz and unz for CSparse, klu_analyze's for KLU), the others
+// a guess at the fill.  The estimates are corrected as factorizations finish, by the
+// ratio of what the factors actually took to what was predicted.
+//
+// A job that doesn't fit waits, without holding a thread, while smaller ones behind
+// it go ahead; so that it isn't passed over forever, once max_bypass jobs have gone
+// ahead of the oldest waiting job nothing else starts until it does.  A job larger
+// than the whole budget runs once nothing else is admitted.
+
+#ifndef MEMORY_ADMISSION_HPP
+#define MEMORY_ADMISSION_HPP
+
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+
+class memory_admission {
+public:
+    // a budget of zero admits everything at once
+    explicit memory_admission( std::size_t budget = 0, std::size_t max_bypass = 8 )
+        : budget_(budget), max_bypass_(max_bypass) {}
+
+    memory_admission( memory_admission const & ) = delete;
+    memory_admission & operator=( memory_admission const & ) = delete;
+
+    std::size_t budget() const { return budget_; }
+
+    // Reserve "bytes" for a job; "start" runs once they are available, either now or
+    // from a later release(), on the thread that made room
+    void submit( std::size_t bytes, std::function<void()> start ) {
+        std::vector<std::function<void()>> ready;
+        {
+            std::lock_guard<std::mutex> lk(m_);
+            waiting_.push_back(pending{bytes, std::move(start), 0, false});
+            admit(ready);
+        }
+        for ( auto & f : ready ) {
+            f();
+        }
+    }
+
+    // the job that reserved "bytes" is done with them
+    void release( std::size_t bytes ) {
+        std::vector<std::function<void()>> ready;
+        {
+            std::lock_guard<std::mutex> lk(m_);
+            in_use_ -= std::min(bytes, in_use_);
+            --running_;
+            admit(ready);
+        }
+        for ( auto & f : ready ) {
+            f();
+        }
+    }
+
+    std::size_t in_use() const {
+        std::lock_guard<std::mutex> lk(m_);
+        return in_use_;
+    }
+
+    // the most reserved at once
+    std::size_t peak() const {
+        std::lock_guard<std::mutex> lk(m_);
+        return peak_;
+    }
+
+    // how many jobs could not start as soon as they were submitted
+    std::size_t delayed() const {
+        std::lock_guard<std::mutex> lk(m_);
+        return delayed_;
+    }
+
+private:
+    struct pending {
+        std::size_t           bytes;
+        std::function<void()> start;
+        std::size_t           bypassed;    // jobs admitted ahead of this one
+        bool                  delayed;
+    };
+
+    // with m_ held: start whatever fits, oldest first
+    void admit( std::vector<std::function<void()>> & ready ) {
+        for ( auto it = waiting_.begin(); it != waiting_.end(); ) {
+            bool fits = (budget_ == 0) || (running_ == 0) || (in_use_ + it->bytes <= budget_);
+            bool blocked = (it != waiting_.begin()) && (waiting_.front().bypassed >= max_bypass_);
+            if ( !fits || blocked ) {
+                if ( !it->delayed ) {
+                    it->delayed = true;
+                    ++delayed_;
+                }
+                ++it;
+                continue;
+            }
+            in_use_ += it->bytes;
+            peak_ = std::max(peak_, in_use_);
+            ++running_;
+            for ( auto older = waiting_.begin(); older != it; ++older ) {
+                ++older->bypassed;
+            }
+            ready.push_back(std::move(it->start));
+            it = waiting_.erase(it);
+        }
+    }
+
+    std::size_t              budget_;
+    std::size_t              max_bypass_;
+    mutable std::mutex       m_;
+    std::deque<pending>      waiting_;
+    std::size_t              in_use_ = 0;
+    std::size_t              peak_ = 0;
+    std::size_t              running_ = 0;
+    std::size_t              delayed_ = 0;
+};
+
+namespace memory_estimate {
+
+template<typename... T> struct void_t { using type = void; };
+
+// whether L's lu_t can estimate its own size from a symbolic analysis
+template<typename L, typename = void>
+struct has_lu_estimate : std::false_type {};
+
+template<typename L>
+struct has_lu_estimate<L, typename void_t<decltype(L::lu_t::estimate_bytes(
+                                                       std::declval<typename L::sparsemat_t const &>()))>::type>
+    : std::true_type {};
+
+// whether its lu_t reports how many entries the factors have
+template<typename L, typename = void>
+struct has_factor_nonzeros : std::false_type {};
+
+template<typename L>
+struct has_factor_nonzeros<L, typename void_t<decltype(std::declval<typename L::lu_t const &>().factor_nonzeros())>::type>
+    : std::true_type {};
+
+template<typename L>
+std::size_t entry_bytes() {
+    return sizeof(typename L::value_t) + sizeof(typename L::index_t);
+}
+
+template<typename L>
+std::size_t nonzeros( typename L::sparsemat_t const & A ) {
+    std::size_t nnz = 0;
+    A.for_each_nonzero([&nnz](typename L::index_t, typename L::index_t, typename L::value_t) { ++nnz; });
+    return nnz;
+}
+
+template<typename L>
+std::size_t lu_bytes( typename L::sparsemat_t const & A, double, std::true_type ) {
+    return L::lu_t::estimate_bytes(A);
+}
+
+template<typename L>
+std::size_t lu_bytes( typename L::sparsemat_t const & A, double fill, std::false_type ) {
+    return std::size_t(fill * double(nonzeros<L>(A)) * double(entry_bytes<L>()));
+}
+
+// Bytes the factors of A should take; "fill" (nnz(L+U) / nnz(A)) is the guess for
+// policies with no estimate of their own
+template<typename L>
+std::size_t lu_bytes( typename L::sparsemat_t const & A, double fill = 10.0 ) {
+    return lu_bytes<L>(A, fill, has_lu_estimate<L>());
+}
+
+// What the factors took, or zero if the policy can't say
+template<typename L>
+std::size_t factored_bytes( typename L::lu_t const & lu, std::true_type ) {
+    return std::size_t(lu.factor_nonzeros()) * entry_bytes<L>();
+}
+
+template<typename L>
+std::size_t factored_bytes( typename L::lu_t const &, std::false_type ) {
+    return 0;
+}
+
+template<typename L>
+std::size_t factored_bytes( typename L::lu_t const & lu ) {
+    return factored_bytes<L>(lu, has_factor_nonzeros<L>());
+}
+
+// whether L keeps count of what its libraries allocate
+template<typename L, typename = void>
+struct has_memory_peak : std::false_type {};
+
+template<typename L>
+struct has_memory_peak<L, typename void_t<decltype(L::memory_peak())>::type> : std::true_type {};
+
+template<typename L>
+std::size_t library_peak( std::true_type ) {
+    return L::memory_peak();
+}
+
+template<typename L>
+std::size_t library_peak( std::false_type ) {
+    return 0;
+}
+
+// The libraries' own high water mark, or zero if L has none
+template<typename L>
+std::size_t library_peak() {
+    return library_peak<L>(has_memory_peak<L>());
+}
+
+// Corrects estimates by how far off recent ones were, never below what was predicted
+class calibration {
+public:
+    std::size_t corrected( std::size_t estimate ) const {
+        std::lock_guard<std::mutex> lk(m_);
+        return std::size_t(double(estimate) * std::max(1.0, ratio_));
+    }
+
+    void observe( std::size_t estimate, std::size_t actual ) {
+        if ( (estimate == 0) || (actual == 0) ) {
+            return;
+        }
+        std::lock_guard<std::mutex> lk(m_);
+        double r = double(actual) / double(estimate);
+        ratio_ = (samples_++ == 0) ? r : 0.75 * ratio_ + 0.25 * r;
+    }
+
+    double ratio() const {
+        std::lock_guard<std::mutex> lk(m_);
+        return ratio_;
+    }
+
+private:
+    mutable std::mutex m_;
+    double             ratio_ = 1.0;
+    std::size_t        samples_ = 0;
+};
+
+}
+
+#endif // MEMORY_ADMISSION_HPP
@@ -0,0 +1,492 @@
+// Microbenchmarks for the kernels underneath each shim, with hardware counters
+//
+// Like policy_experiment, this is built once per library (USE_EIGEN, USE_CSPARSE or
+// USE_SUITESPARSE).  Each kernel is timed in isolation on a grid Laplacian, with
+// cycles, instructions, LLC and branch misses read around it (see perf_counters.hpp).
+// Achieved bandwidth is compared with a STREAM triad run on the same machine.
+//
+// usage: Xbench [grid size] [csv file]      (CSV goes to stdout without a file)
+//
+// The SELL kernels are also checked against the plain loops; a mismatch exits nonzero.
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <algorithm>
+
+#include "perf_counters.hpp"
+#include "solve_workspace.hpp"
+#include "sell_spmm.hpp"
+#include "lazy_expr.hpp"
+#include "pole_residue.hpp"
+
+#if defined(USE_EIGEN)
+#include "eigen_shim.hpp"
+using sparse_lib_t = EigenShim;
+static char const * const library_name = "eigen";
+#elif defined(USE_CSPARSE)
+#include "csparse_shim.hpp"
+using sparse_lib_t = CSparseShim;
+static char const * const library_name = "csparse";
+#elif defined(USE_SUITESPARSE)
+#include "suitesparse_shim.hpp"
+using sparse_lib_t = SuiteSparse::Shim;
+static char const * const library_name = "suitesparse";
+#endif
+
+using L         = sparse_lib_t;
+using index_t   = L::index_t;
+using value_t   = L::value_t;
+using triplet_t = L::triplet_t;
+using sparsemat_t = L::sparsemat_t;
+using workspace_t = solve_workspace<value_t>;
+
+// results are summed into this so the compiler can't discard the work
+static volatile double sink;
+
+struct result {
+    std::string kernel;
+    index_t     n;
+    std::size_t nnz;
+    long        repeats;
+    double      seconds;       // per call, from here down
+    perf_counts counts;
+    double      bytes;         // a lower bound on the memory traffic
+    double      flops;
+};
+
+// Run "kernel" enough times to take at least min_seconds, after one untimed warmup call.
+// The counters cover exactly the timed calls
+template<typename F>
+result measure( perf_counters & pc, std::string kernel, F && f, double min_seconds = 0.2 ) {
+    using clock = std::chrono::steady_clock;
+    f();
+    for ( long repeats = 1; ; repeats *= 2 ) {
+        pc.start();
+        auto start = clock::now();
+        for ( long r = 0; r < repeats; ++r ) {
+            f();
+        }
+        double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+        perf_counts c = pc.stop();
+        if ( elapsed >= min_seconds ) {
+            result res{ std::move(kernel), 0, 0, repeats, elapsed / repeats, c, 0, 0 };
+            res.counts.cycles        /= repeats;
+            res.counts.instructions  /= repeats;
+            res.counts.llc_misses    /= repeats;
+            res.counts.branch_misses /= repeats;
+            return res;
+        }
+    }
+}
+
+// a[i] = b[i] + s * c[i] over arrays well beyond the last level cache; best of ten
+// As in STREAM, a triad moves 24 bytes per element (write allocate traffic isn't counted)
+result stream_triad( perf_counters & pc ) {
+    std::size_t const n = std::size_t(1) << 23;
+    std::vector<double> a(n, 0.0), b(n, 1.0), c(n, 2.0);
+    double const s = 3.0;
+    result best;
+    best.seconds = -1;
+    for ( int trial = 0; trial < 10; ++trial ) {
+        result r = measure(pc, "stream_triad", [&]() {
+                for ( std::size_t i = 0; i < n; ++i ) {
+                    a[i] = b[i] + s * c[i];
+                }
+                sink = a[n / 2];
+            }, 0.0);
+        if ( (best.seconds < 0) || (r.seconds < best.seconds) ) {
+            best = r;
+        }
+    }
+    best.n     = index_t(n);
+    best.nnz   = n;
+    best.bytes = 24.0 * n;
+    best.flops = 2.0 * n;
+    return best;
+}
+
+template<typename M>
+std::size_t nonzeros( M const & m ) {
+    std::size_t nnz = 0;
+    m.for_each_nonzero([&nnz](index_t, index_t, value_t) { ++nnz; });
+    return nnz;
+}
+
+// The per-library parts: the same kernel under each library's own interface
+
+#if defined(USE_EIGEN)
+
+sparsemat_t dense_to_sparse( std::vector<value_t> const & d, index_t rows, index_t cols ) {
+    return sparsemat_t::wrapped_t(
+        Eigen::Map<Eigen::Matrix<value_t, Eigen::Dynamic, Eigen::Dynamic> const>(d.data(), rows, cols).sparseView());
+}
+
+// no dense interface, so this includes converting B to dense and the result back
+void triangular_solve( L::lu_t const & lu, sparsemat_t const & B, std::vector<value_t> &, workspace_t & ) {
+    auto X = lu.solve(B);
+    sink = X.wrapped().coeff(0, 0);
+}
+
+// Householder reflections applied to the identity (Eigen's Q is implicit)
+void form_Q( L::qr_t const & qr, std::vector<value_t> &, workspace_t & ) {
+    auto Q = qr.Q();
+    sink = Q.wrapped().coeff(0, 0);
+}
+
+#elif defined(USE_CSPARSE)
+
+sparsemat_t dense_to_sparse( std::vector<value_t> const & d, index_t rows, index_t cols ) {
+    return L::dense_to_sparse(d, rows, cols);
+}
+
+void triangular_solve( L::lu_t const & lu, sparsemat_t const & B, std::vector<value_t> & x, workspace_t & ws ) {
+    lu.solve_into(B, x.data(), ws);
+    sink = x[0];
+}
+
+// cs_happly down each column of the identity
+void form_Q( L::qr_t const & qr, std::vector<value_t> & q, workspace_t & ws ) {
+    q.resize(std::size_t(qr.rows()) * qr.rank());
+    qr.Q_into(q.data(), ws);
+    sink = q[0];
+}
+
+#elif defined(USE_SUITESPARSE)
+
+// wrap our storage as a cholmod_dense instead of copying it into one
+sparsemat_t dense_to_sparse( std::vector<value_t> const & d, index_t rows, index_t cols ) {
+    using namespace SuiteSparse;
+    cholmod_dense X{};
+    X.nrow  = rows;
+    X.ncol  = cols;
+    X.nzmax = d.size();
+    X.d     = rows;
+    X.x     = const_cast<value_t *>(d.data());
+    X.xtype = CHOLMOD_REAL;
+    X.dtype = CHOLMOD_DOUBLE;
+    return make_ss_unique_ptr(ss_traits<index_t>::dense_to_sparse(&X, 1, spqr_common<index_t>.get()),
+                              spqr_common<index_t>);
+}
+
+void triangular_solve( L::lu_t const & lu, sparsemat_t const & B, std::vector<value_t> & x, workspace_t & ws ) {
+    lu.solve_into(B, x.data(), ws);
+    sink = x[0];
+}
+
+// SPQR keeps Q as Householder vectors too; Q() applies them to the identity
+void form_Q( L::qr_t const & qr, std::vector<value_t> &, workspace_t & ) {
+    auto Q = qr.Q();
+    sink = double(Q.wrapped()->nrow);
+}
+
+#endif
+
+// A k x k grid of unit conductances, each node with a small conductance to ground,
+// and "ports" current sources spread along the diagonal
+void grid( index_t k, index_t ports, std::vector<triplet_t> & G, std::vector<triplet_t> & B ) {
+    G.clear();
+    B.clear();
+    for ( index_t r = 0; r < k; ++r ) {
+        for ( index_t c = 0; c < k; ++c ) {
+            index_t v = r * k + c;
+            value_t d = 1e-3;
+            auto stamp = [&](index_t w) {
+                G.push_back(triplet_t{v, w, -1.0});
+                d += 1.0;
+            };
+            if ( r > 0 )     stamp(v - k);
+            if ( c > 0 )     stamp(v - 1);
+            if ( c + 1 < k ) stamp(v + 1);
+            if ( r + 1 < k ) stamp(v + k);
+            G.push_back(triplet_t{v, v, d});
+        }
+    }
+    for ( index_t p = 0; p < ports; ++p ) {
+        index_t at = (p + 1) * (k / (ports + 1));
+        B.push_back(triplet_t{at * k + at, p, 1.0});
+    }
+}
+
+int main( int argc, char ** argv ) {
+    index_t k = (argc > 1) ? index_t(std::atoi(argv[1])) : 200;
+    index_t const ports = 8;
+    std::ofstream file;
+    if ( argc > 2 ) {
+        file.open(argv[2]);
+    }
+    std::ostream & csv = (argc > 2) ? file : std::cout;
+
+    perf_counters pc;
+    if ( !pc.valid() ) {
+        std::cerr << "hardware counters unavailable (check perf_event_paranoid); timing only\n";
+    }
+
+    std::vector<triplet_t> Gt, Bt;
+    grid(k, ports, Gt, Bt);
+    index_t n = k * k;
+    std::size_t const vsize = sizeof(value_t), isize = sizeof(index_t);
+
+    std::vector<result> results;
+    bool wrong = false;         // a kernel whose output doesn't match its reference
+    result stream = stream_triad(pc);
+
+    // triplets to compressed columns
+    {
+        result r = measure(pc, "compress", [&]() {
+                sparsemat_t G(n, n, Gt.begin(), Gt.end());
+                sink = double(nonzeros(G) > 0);
+            });
+        r.n     = n;
+        r.nnz   = Gt.size();
+        r.bytes = double(Gt.size()) * sizeof(triplet_t) + double(Gt.size()) * (vsize + isize) + (n + 1.0) * isize;
+        results.push_back(r);
+    }
+
+    sparsemat_t G(n, n, Gt.begin(), Gt.end());
+    sparsemat_t B(n, ports, Bt.begin(), Bt.end());
+    std::size_t nnz = nonzeros(G);
+
+    // visiting every stored entry, as the generic code does
+    {
+        result r = measure(pc, "traverse", [&]() {
+                double s = 0;
+                G.for_each_nonzero([&s](index_t, index_t, value_t v) { s += v; });
+                sink = s;
+            });
+        r.n     = n;
+        r.nnz   = nnz;
+        r.bytes = double(nnz) * (vsize + isize) + (n + 1.0) * isize;
+        r.flops = double(nnz);
+        results.push_back(r);
+    }
+
+#if defined(USE_CSPARSE)
+    // the same through the Boost iterator_facade
+    {
+        result r = measure(pc, "entry_iterator", [&]() {
+                double s = 0;
+                for ( auto it = G.nonzero_begin(); it != G.nonzero_end(); ++it ) {
+                    s += it->value;
+                }
+                sink = s;
+            });
+        r.n     = n;
+        r.nnz   = nnz;
+        r.bytes = double(nnz) * (vsize + isize) + (n + 1.0) * isize;
+        r.flops = double(nnz);
+        results.push_back(r);
+    }
+#endif
+
+    // G times a dense panel of "ports" columns: plain loops over compressed columns
+    // against the SELL-C-sigma kernels at each instruction set this machine has
+    {
+        std::vector<index_t> p(n + 1, 0), ri;
+        std::vector<value_t> x;
+        G.for_each_nonzero([&](index_t i, index_t j, value_t v) {
+                ++p[j + 1];
+                ri.push_back(i);
+                x.push_back(v);
+            });
+        std::partial_sum(p.begin(), p.end(), p.begin());
+        std::vector<value_t> X(std::size_t(n) * ports), Y(std::size_t(n) * ports);
+        for ( std::size_t k = 0; k < X.size(); ++k ) {
+            X[k] = value_t(1) / value_t(1 + k % 17);
+        }
+        double const bytes = double(nnz) * (vsize + isize) + (n + 1.0) * isize + 2.0 * n * ports * vsize;
+
+        auto spmm_csc = [&]() {
+            std::fill(Y.begin(), Y.end(), value_t(0));
+            for ( index_t c = 0; c < ports; ++c ) {
+                value_t const * xc = X.data() + std::size_t(c) * n;
+                value_t * yc = Y.data() + std::size_t(c) * n;
+                for ( index_t j = 0; j < n; ++j ) {
+                    for ( index_t k = p[j]; k < p[j + 1]; ++k ) {
+                        yc[ri[k]] += x[k] * xc[j];
+                    }
+                }
+            }
+            sink = Y[0];
+        };
+        result r = measure(pc, "spmm_csc", spmm_csc);
+        r.n     = n;
+        r.nnz   = nnz;
+        r.bytes = bytes;
+        r.flops = 2.0 * nnz * ports;
+        results.push_back(r);
+
+        // The SELL results must match the plain loops: on X itself, and with an Inf in
+        // X[0], which should only reach the rows that use column 0
+        std::vector<value_t> const expected = Y;
+        X[0] = std::numeric_limits<value_t>::infinity();
+        spmm_csc();
+        std::vector<value_t> const expected_inf = Y;
+        X[0] = value_t(1);
+        auto agrees = [&Y]( std::vector<value_t> const & e ) {
+            for ( std::size_t k = 0; k < e.size(); ++k ) {
+                bool same = (Y[k] == e[k]) || ((Y[k] != Y[k]) && (e[k] != e[k]));     // Infs, NaNs
+                if ( !same && !(std::abs(Y[k] - e[k]) <= 1e-12 * std::max(value_t(1), std::abs(e[k]))) ) {
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        sell::matrix<index_t, value_t> S(n, n, G);
+        for ( sell::isa w : { sell::isa::scalar, sell::isa::avx2, sell::isa::avx512 } ) {
+            if ( w > sell::best_isa() ) {
+                break;
+            }
+            std::string kernel = std::string("spmm_sell_") + sell::isa_name(w);
+            result r = measure(pc, kernel, [&]() {
+                    S.multiply(X.data(), n, Y.data(), n, ports, w);
+                    sink = Y[0];
+                });
+            r.n     = n;
+            r.nnz   = nnz;
+            r.bytes = bytes + (S.fill() - 1.0) * nnz * (vsize + 4);
+            r.flops = 2.0 * nnz * ports;
+            results.push_back(r);
+
+            bool ok = agrees(expected);
+            X[0] = std::numeric_limits<value_t>::infinity();
+            S.multiply(X.data(), n, Y.data(), n, ports, w);
+            ok = agrees(expected_inf) && ok;
+            X[0] = value_t(1);
+            if ( !ok ) {
+                std::cerr << kernel << " disagrees with spmm_csc\n";
+                wrong = true;
+            }
+        }
+    }
+
+    L::lu_t lu(G);
+
+    // forward and back substitution, all ports at once
+    {
+        std::vector<value_t> x(std::size_t(n) * ports);
+        workspace_t ws;
+        double fnz = double(lu.factor_nonzeros());
+        result r = measure(pc, "tri_solve", [&]() { triangular_solve(lu, B, x, ws); });
+        r.n     = n;
+        r.nnz   = std::size_t(fnz);
+        r.bytes = fnz * (vsize + isize) + 2.0 * n * ports * vsize;
+        r.flops = 2.0 * fnz * ports;
+        results.push_back(r);
+    }
+
+    // the dense solution, back to sparse
+    auto A = lu.solve(B);
+    std::vector<value_t> Ad(std::size_t(n) * ports, value_t(0));
+    A.for_each_nonzero([&Ad, n](index_t i, index_t j, value_t v) { Ad[std::size_t(j) * n + i] = v; });
+    {
+        std::size_t anz = nonzeros(A);
+        result r = measure(pc, "dense_to_sparse", [&]() {
+                auto S = dense_to_sparse(Ad, n, ports);
+                sink = double(nonzeros(S));
+            });
+        r.n     = n;
+        r.nnz   = anz;
+        r.bytes = double(Ad.size()) * vsize + double(anz) * (vsize + isize) + (ports + 1.0) * isize;
+        results.push_back(r);
+    }
+
+    // Q of the Krylov block; the flops depend on the Householder vectors, which
+    // aren't exposed, so only the output is counted
+    {
+        L::qr_t qr(A);
+        std::vector<value_t> q;
+        workspace_t ws;
+        result r = measure(pc, "qr_Q", [&]() { form_Q(qr, q, ws); });
+        r.n     = n;
+        r.nnz   = std::size_t(n) * ports;
+        r.bytes = double(n) * ports * vsize;
+        results.push_back(r);
+
+        // a whole Krylov step, Q^T (G^-1 (G B)), in one pass and in narrow panels
+        // (G stands in for C); the narrower the panel, the smaller the temporaries
+        auto step = lazy::Q<L>(qr).transpose() * lazy::solve<L>(lu, G * lazy::ref<L>(B));
+        for ( index_t panel : { ports, index_t(2) } ) {
+            result r = measure(pc, "krylov_step_p" + std::to_string(panel), [&]() {
+                    sparsemat_t Y = step.eval(panel);
+                    sink = double(nonzeros(Y));
+                });
+            r.n     = n;
+            r.nnz   = nnz;
+            r.bytes = 0;
+            results.push_back(r);
+        }
+
+        // the reduced model's response over a frequency sweep, by a dense solve at each
+        // point and from its pole-residue form (unit capacitance to ground stands in for C)
+        std::vector<triplet_t> Ct;
+        for ( index_t i = 0; i < n; ++i ) {
+            Ct.push_back(triplet_t{i, i, 1.0});
+        }
+        sparsemat_t C(n, n, Ct.begin(), Ct.end());
+        pole_residue::model m = pole_residue::project<L>(qr.Q(), G, C, B, ports);
+        std::vector<pole_residue::complex_t> s(4096);
+        for ( std::size_t f = 0; f < s.size(); ++f ) {
+            s[f] = pole_residue::complex_t(0.0, std::pow(10.0, -6.0 + 6.0 * f / s.size()));
+        }
+        double kr = double(m.G.rows()), pairs = double(ports) * ports;
+        {
+            result r = measure(pc, "H_dense_solve", [&]() {
+                    double t = 0;
+                    for ( auto const & sf : s ) {
+                        t += pole_residue::solve_response(m, sf)(0, 0).real();
+                    }
+                    sink = t;
+                });
+            r.n     = index_t(kr);
+            r.nnz   = s.size();
+            r.flops = double(s.size()) * 8.0 * (2.0 / 3.0 * kr * kr * kr + 2.0 * kr * kr * ports + 2.0 * kr * pairs);
+            results.push_back(r);
+        }
+        {
+            pole_residue::expansion e(m);
+            result r = measure(pc, "H_pole_residue", [&]() {
+                    auto h = e.evaluate(s);
+                    sink = h.re[0];
+                });
+            r.n     = index_t(kr);
+            r.nnz   = s.size();
+            r.bytes = 2.0 * pairs * s.size() * vsize;
+            r.flops = double(s.size()) * double(e.poles().size()) * (8.0 * pairs + 6.0);
+            results.push_back(r);
+        }
+    }
+
+    double stream_bw = stream.bytes / stream.seconds;
+    csv << "library,kernel,n,nnz,repeats,seconds,cycles,instructions,ipc,llc_misses,branch_misses,"
+        << "bytes,flops,GB/s,GFLOP/s,stream_fraction\n";
+    auto row = [&csv, stream_bw](char const * lib, result const & r) {
+        double bw = r.bytes / r.seconds;
+        csv << lib << "," << r.kernel << "," << r.n << "," << r.nnz << "," << r.repeats << ","
+            << r.seconds << ",";
+        if ( r.counts.valid ) {
+            csv << r.counts.cycles << "," << r.counts.instructions << ","
+                << (r.counts.cycles ? double(r.counts.instructions) / r.counts.cycles : 0.0) << ","
+                << r.counts.llc_misses << "," << r.counts.branch_misses << ",";
+        } else {
+            csv << ",,,,,";
+        }
+        csv << r.bytes << "," << r.flops << "," << bw * 1e-9 << ",";
+        if ( r.flops > 0 ) {
+            csv << r.flops / r.seconds * 1e-9;
+        }
+        csv << "," << bw / stream_bw << "\n";
+    };
+    row("machine", stream);
+    for ( auto const & r : results ) {
+        row(library_name, r);
+    }
+    return wrong ? 1 : 0;
+}
@@ -0,0 +1,250 @@
+// Modified nodal analysis assembly of G, C and B, with fast re-stamping
+//
+// Elements are added once; the first assemble() builds the matrices from triplets in
+// the usual way and records where each element's stamp landed in the compressed value
+// arrays.  After that only values change: set_value() followed by assemble() copies
+// the constant entries back and scatters each element's new stamp directly, which is
+// O(elements) with no sorting or allocation.  Handy for sweeping corners.
+//
+// Node numbers run from 0 to nodes-1, with "ground" for the reference node.  Voltage
+// sources and ports add a branch current unknown each, numbered after the nodes, with
+// the same signs as the hand-written Gentries in policy_experiment.cpp.
+
+#ifndef MNA_ASSEMBLER_HPP
+#define MNA_ASSEMBLER_HPP
+
+#include <array>
+#include <vector>
+#include <memory>
+#include <cassert>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+
+#include "triplet_access.hpp"
+
+template<typename L>
+struct mna_assembler {
+    using index_t     = typename L::index_t;
+    using value_t     = typename L::value_t;
+    using triplet_t   = typename L::triplet_t;
+    using sparsemat_t = typename L::sparsemat_t;
+
+    static constexpr index_t ground = -1;
+
+    explicit mna_assembler( index_t nodes ) : nodes_(nodes) {}
+
+    // These return an element number for set_value()
+    index_t add_resistor( index_t a, index_t b, value_t ohms ) {
+        return add_element(resistor, a, b, ohms);
+    }
+    index_t add_capacitor( index_t a, index_t b, value_t farads ) {
+        return add_element(capacitor, a, b, farads);
+    }
+
+    // A voltage source from a (+) to b (-).  Returns the unknown for its branch current
+    index_t add_vsource( index_t a, index_t b = ground ) {
+        return branch(a, b);
+    }
+
+    // A port driving a to b.  Returns its column of B
+    index_t add_port( index_t a, index_t b = ground ) {
+        index_t k = branch(a, b);
+        B_stamps_.push_back(triplet_t{k, ports_, value_t(-1)});
+        return ports_++;
+    }
+
+    // ohms for a resistor, farads for a capacitor; takes effect at the next assemble()
+    void set_value( index_t element, value_t v ) {
+        elements_.at(element).value = v;
+    }
+
+    index_t size() const { return nodes_ + branches_; }
+    index_t ports() const { return ports_; }
+
+    // Build G, C and B the first time (or after new elements), re-stamp the values otherwise.
+    // Values are written in place, so copies sharing storage with G and C (those inside
+    // an lu_t, for some libraries) see them too; factor again after this
+    void assemble() {
+        if ( !G_ ) {
+            build();
+        } else {
+            restamp(G_->value_data(), G_base_, resistor);
+            restamp(C_->value_data(), C_base_, capacitor);
+        }
+    }
+
+    sparsemat_t const & G() const { assert(G_); return *G_; }
+    sparsemat_t const & C() const { assert(C_); return *C_; }
+    sparsemat_t const & B() const { assert(B_); return *B_; }
+
+private:
+    enum kind { resistor, capacitor };
+
+    struct element {
+        kind                    type;
+        index_t                 a, b;
+        value_t                 value;
+        std::array<index_t, 4>  slot;      // of aa, bb, ab, ba in the values (-1 at ground)
+    };
+
+    index_t add_element( kind type, index_t a, index_t b, value_t v ) {
+        check_node(a);
+        check_node(b);
+        elements_.push_back(element{type, a, b, v, {{-1, -1, -1, -1}}});
+        structure_changed();
+        return index_t(elements_.size() - 1);
+    }
+
+    index_t branch( index_t a, index_t b ) {
+        check_node(a);
+        check_node(b);
+        index_t k = nodes_ + branches_++;
+        if ( a != ground ) {
+            incidence_.push_back(triplet_t{a, k, value_t(1)});
+            incidence_.push_back(triplet_t{k, a, value_t(-1)});
+        }
+        if ( b != ground ) {
+            incidence_.push_back(triplet_t{b, k, value_t(-1)});
+            incidence_.push_back(triplet_t{k, b, value_t(1)});
+        }
+        structure_changed();
+        return k;
+    }
+
+    void check_node( index_t a ) const {
+        if ( (a != ground) && ((a < 0) || (a >= nodes_)) ) {
+            throw std::out_of_range("mna_assembler: no such node");
+        }
+    }
+
+    void structure_changed() {
+        G_.reset();
+        C_.reset();
+        B_.reset();
+    }
+
+    // the conductance (or capacitance) an element stamps
+    static value_t admittance( element const & e ) {
+        return (e.type == resistor) ? value_t(1) / e.value : e.value;
+    }
+
+    // Where each of "at" (row, column pairs) is stored in m's values.  Every one must be present
+    static std::vector<index_t>
+    locate( sparsemat_t const & m, index_t n, std::vector<std::array<index_t, 2>> const & at,
+            index_t & nnz ) {
+        // m's pattern, in storage order
+        std::vector<index_t> ptr(n + 1, 0), rows;
+        m.for_each_nonzero([&ptr, &rows](index_t i, index_t j, value_t) {
+                ++ptr[j + 1];
+                rows.push_back(i);
+            });
+        std::partial_sum(ptr.begin(), ptr.end(), ptr.begin());
+        nnz = ptr[n];
+
+        // the requests, grouped by column
+        std::vector<index_t> qptr(n + 1, 0), q(at.size());
+        for ( auto const & rc : at ) {
+            ++qptr[rc[1] + 1];
+        }
+        std::partial_sum(qptr.begin(), qptr.end(), qptr.begin());
+        std::vector<index_t> next(qptr.begin(), qptr.end() - 1);
+        for ( std::size_t k = 0; k < at.size(); ++k ) {
+            q[next[at[k][1]]++] = index_t(k);
+        }
+
+        // one column at a time, note where each row is and look the requests up
+        std::vector<index_t> where(n, -1), slot(at.size());
+        for ( index_t j = 0; j < n; ++j ) {
+            for ( index_t k = ptr[j]; k < ptr[j+1]; ++k ) {
+                where[rows[k]] = k;
+            }
+            for ( index_t t = qptr[j]; t < qptr[j+1]; ++t ) {
+                slot[q[t]] = where[at[q[t]][0]];
+                assert(slot[q[t]] >= 0);
+            }
+            for ( index_t k = ptr[j]; k < ptr[j+1]; ++k ) {
+                where[rows[k]] = -1;
+            }
+        }
+        return slot;
+    }
+
+    // compress one of G or C, recording element slots and the constant part of its values
+    std::unique_ptr<sparsemat_t>
+    build( kind type, std::vector<triplet_t> const & constant, std::vector<value_t> & base ) {
+        index_t n = size();
+        std::vector<triplet_t> t(constant);
+        std::vector<std::array<index_t, 2>> at;
+        for ( auto const & c : constant ) {
+            at.push_back({{triplet_access::row(c), triplet_access::col(c)}});
+        }
+        for ( auto const & e : elements_ ) {
+            if ( e.type != type ) {
+                continue;
+            }
+            value_t y = admittance(e);
+            index_t const rc[4][2] = { {e.a, e.a}, {e.b, e.b}, {e.a, e.b}, {e.b, e.a} };
+            value_t const v[4] = { y, y, -y, -y };
+            for ( int s = 0; s < 4; ++s ) {
+                if ( (rc[s][0] != ground) && (rc[s][1] != ground) ) {
+                    t.push_back(triplet_t{rc[s][0], rc[s][1], v[s]});
+                    at.push_back({{rc[s][0], rc[s][1]}});
+                }
+            }
+        }
+        std::unique_ptr<sparsemat_t> m(new sparsemat_t(n, n, t.begin(), t.end()));
+
+        index_t nnz;
+        auto slot = locate(*m, n, at, nnz);
+        base.assign(nnz, value_t(0));
+        std::size_t k = 0;
+        for ( auto const & c : constant ) {
+            base[slot[k++]] += triplet_access::value(c);
+        }
+        for ( auto & e : elements_ ) {
+            if ( e.type != type ) {
+                continue;
+            }
+            index_t const rc[4][2] = { {e.a, e.a}, {e.b, e.b}, {e.a, e.b}, {e.b, e.a} };
+            for ( int s = 0; s < 4; ++s ) {
+                e.slot[s] = ((rc[s][0] != ground) && (rc[s][1] != ground)) ? slot[k++] : index_t(-1);
+            }
+        }
+        return m;
+    }
+
+    void build() {
+        G_ = build(resistor, incidence_, G_base_);
+        C_ = build(capacitor, std::vector<triplet_t>(), C_base_);
+        B_.reset(new sparsemat_t(size(), ports_, B_stamps_.begin(), B_stamps_.end()));
+    }
+
+    void restamp( value_t * x, std::vector<value_t> const & base, kind type ) const {
+        std::copy(base.begin(), base.end(), x);
+        for ( auto const & e : elements_ ) {
+            if ( e.type != type ) {
+                continue;
+            }
+            value_t y = admittance(e);
+            value_t const v[4] = { y, y, -y, -y };
+            for ( int s = 0; s < 4; ++s ) {
+                if ( e.slot[s] >= 0 ) {
+                    x[e.slot[s]] += v[s];
+                }
+            }
+        }
+    }
+
+    index_t                       nodes_;
+    index_t                       branches_ = 0;
+    index_t                       ports_ = 0;
+    std::vector<element>          elements_;
+    std::vector<triplet_t>        incidence_;     // the voltage source and port entries of G
+    std::vector<triplet_t>        B_stamps_;
+
+    std::unique_ptr<sparsemat_t>  G_, C_, B_;
+    std::vector<value_t>          G_base_, C_base_;   // the constant part of each value array
+};
+
+#endif // MNA_ASSEMBLER_HPP
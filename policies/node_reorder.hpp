@@ -0,0 +1,240 @@
+// Renumbering the nodes of a net for locality
+//
+// Netlists number their nodes however the extractor happened to, which the
+// fill-reducing orderings inside the LU and QR don't care about, but every pass over
+// G, C and B themselves (products, projections, traversals) does.  Here we choose
+// a numbering that keeps connected nodes close: reverse Cuthill-McKee, or the parts
+// of a partition (graph_partition.hpp) one after another, RCM order within each.
+// G, C and B are permuted together before anything else sees them, and rows of
+// results (a basis for G^-1 B, say) are mapped back to the original numbering.
+//
+// Bandwidth (the largest |i - j| of any entry) and profile (the sum over rows of the
+// distance from the first entry to the diagonal) are measured before and after.
+
+#ifndef NODE_REORDER_HPP
+#define NODE_REORDER_HPP
+
+#include <deque>
+#include <vector>
+#include <cstdlib>
+#include <ostream>
+#include <iterator>
+#include <algorithm>
+
+#include "triplet_access.hpp"
+#include "graph_partition.hpp"
+
+namespace node_reorder {
+
+enum class method { none, rcm, partition };
+
+inline char const * method_name( method m ) {
+    switch ( m ) {
+    case method::rcm:       return "rcm";
+    case method::partition: return "partition";
+    default:                return "none";
+    }
+}
+
+struct envelope {
+    long long bandwidth = 0;
+    long long profile = 0;
+};
+
+template<typename Index>
+struct permutation {
+    method              how = method::none;
+    std::vector<Index>  perm;     // perm[new] is the old number (empty for none)
+    std::vector<Index>  iperm;    // iperm[old] is the new number
+    envelope            before, after;
+
+    bool identity() const { return perm.empty(); }
+    Index to_new( Index old ) const { return identity() ? old : iperm[old]; }
+    Index to_old( Index v ) const { return identity() ? v : perm[v]; }
+};
+
+// Bandwidth and profile of a symmetric structure, under numbering iperm (or as is, if empty)
+template<typename Index>
+envelope
+measure( graph_partition::adjacency<Index> const & g, std::vector<Index> const & iperm ) {
+    Index n = g.size();
+    auto num = [&iperm](Index v) { return iperm.empty() ? v : iperm[v]; };
+    envelope e;
+    for ( Index v = 0; v < n; ++v ) {
+        long long i = num(v), first = i;
+        for ( Index k = g.xadj[v]; k < g.xadj[v+1]; ++k ) {
+            long long j = num(g.adj[k]);
+            e.bandwidth = std::max(e.bandwidth, std::llabs(i - j));
+            first = std::min(first, j);
+        }
+        e.profile += i - first;
+    }
+    return e;
+}
+
+namespace detail {
+
+// Breadth-first levels from root, within root's component.  Returns the nodes in
+// visiting order (neighbours by increasing degree, as Cuthill-McKee wants) and sets
+// depth to the number of levels.  dist must be -1 everywhere and is left that way
+template<typename Index>
+std::vector<Index>
+levels( graph_partition::adjacency<Index> const & g, Index root, std::vector<Index> & dist,
+        Index & depth, Index & last_level_start ) {
+    auto degree = [&g](Index v) { return g.xadj[v+1] - g.xadj[v]; };
+    std::vector<Index> order{root}, nbrs;
+    dist[root] = 0;
+    depth = 1;
+    last_level_start = 0;
+    for ( std::size_t h = 0; h < order.size(); ++h ) {
+        Index v = order[h];
+        nbrs.clear();
+        for ( Index k = g.xadj[v]; k < g.xadj[v+1]; ++k ) {
+            if ( dist[g.adj[k]] < 0 ) {
+                dist[g.adj[k]] = dist[v] + 1;
+                nbrs.push_back(g.adj[k]);
+            }
+        }
+        std::stable_sort(nbrs.begin(), nbrs.end(), [&degree](Index a, Index b) {
+                return degree(a) < degree(b);
+            });
+        for ( Index u : nbrs ) {
+            if ( dist[u] + 1 > depth ) {
+                depth = dist[u] + 1;
+                last_level_start = Index(order.size());
+            }
+            order.push_back(u);
+        }
+    }
+    for ( Index v : order ) {
+        dist[v] = -1;
+    }
+    return order;
+}
+
+}
+
+// Reverse Cuthill-McKee, each component started from a pseudo-peripheral node
+// (George and Liu's method: move to a least-degree node of the deepest level until
+// the level structure stops getting deeper).  Returns perm, perm[new] = old
+template<typename Index>
+std::vector<Index>
+rcm_order( graph_partition::adjacency<Index> const & g ) {
+    Index n = g.size();
+    auto degree = [&g](Index v) { return g.xadj[v+1] - g.xadj[v]; };
+    std::vector<Index> by_degree(n);
+    for ( Index v = 0; v < n; ++v ) {
+        by_degree[v] = v;
+    }
+    std::stable_sort(by_degree.begin(), by_degree.end(), [&degree](Index a, Index b) {
+            return degree(a) < degree(b);
+        });
+
+    std::vector<Index> order, dist(n, -1);
+    order.reserve(n);
+    std::vector<bool> placed(n, false);
+    for ( Index start : by_degree ) {
+        if ( placed[start] ) {
+            continue;
+        }
+        Index root = start, depth, last;
+        auto comp = detail::levels(g, root, dist, depth, last);
+        for (;;) {
+            Index candidate = *std::min_element(comp.begin() + last, comp.end(),
+                                                [&degree](Index a, Index b) { return degree(a) < degree(b); });
+            Index cdepth, clast;
+            auto ccomp = detail::levels(g, candidate, dist, cdepth, clast);
+            if ( cdepth <= depth ) {
+                break;
+            }
+            root = candidate;
+            depth = cdepth;
+            last = clast;
+            comp.swap(ccomp);
+        }
+        for ( Index v : comp ) {
+            placed[v] = true;
+        }
+        order.insert(order.end(), comp.begin(), comp.end());
+    }
+    std::reverse(order.begin(), order.end());
+    return order;
+}
+
+// The parts of a partition consecutively, each in RCM order
+template<typename Index>
+std::vector<Index>
+partition_order( graph_partition::adjacency<Index> const & g, Index nparts ) {
+    auto part = graph_partition::partition(g, nparts);
+    auto order = rcm_order(g);
+    std::stable_sort(order.begin(), order.end(), [&part](Index a, Index b) { return part[a] < part[b]; });
+    return order;
+}
+
+// A numbering for the n nodes of a net with conductances [gfirst, glast) and
+// capacitances [cfirst, clast).  Branch unknowns (voltage sources, ports) are nodes too
+template<typename Index, typename Iter>
+permutation<Index>
+compute( Index n, Iter gfirst, Iter glast, Iter cfirst, Iter clast,
+         method how = method::rcm, Index nparts = 8 ) {
+    std::vector<typename std::iterator_traits<Iter>::value_type> gc(gfirst, glast);
+    gc.insert(gc.end(), cfirst, clast);
+    auto g = graph_partition::symmetric_adjacency(n, gc.begin(), gc.end());
+
+    permutation<Index> p;
+    p.how = how;
+    p.before = measure(g, p.iperm);
+    if ( how == method::none ) {
+        p.after = p.before;
+        return p;
+    }
+    p.perm = (how == method::rcm) ? rcm_order(g) : partition_order(g, nparts);
+    p.iperm.resize(n);
+    for ( Index k = 0; k < n; ++k ) {
+        p.iperm[p.perm[k]] = k;
+    }
+    p.after = measure(g, p.iperm);
+    return p;
+}
+
+// The same entries under the new numbering: rows always, columns too for G and C
+// but not for B (its columns are ports, not nodes)
+template<typename Index, typename Triplet>
+std::vector<Triplet>
+permute( permutation<Index> const & p, std::vector<Triplet> const & t, bool columns = true ) {
+    using namespace triplet_access;
+    if ( p.identity() ) {
+        return t;
+    }
+    std::vector<Triplet> out;
+    out.reserve(t.size());
+    for ( auto const & e : t ) {
+        out.push_back(Triplet{p.to_new(row(e)), columns ? p.to_new(col(e)) : Index(col(e)), value(e)});
+    }
+    return out;
+}
+
+// A rows x cols result with rows in the new numbering (Q, say), back in the original
+template<typename L, typename Index>
+typename L::sparsemat_t
+restore_rows( permutation<Index> const & p, typename L::sparsemat_t const & m,
+              typename L::index_t rows, typename L::index_t cols ) {
+    using index_t = typename L::index_t;
+    using value_t = typename L::value_t;
+    std::vector<typename L::triplet_t> t;
+    m.for_each_nonzero([&p, &t](index_t i, index_t j, value_t v) {
+            t.push_back(typename L::triplet_t{index_t(p.to_old(Index(i))), j, v});
+        });
+    return typename L::sparsemat_t(rows, cols, t.begin(), t.end());
+}
+
+template<typename Index>
+void print_report( std::ostream & os, permutation<Index> const & p ) {
+    os << "reordering (" << method_name(p.how) << "): bandwidth " << p.before.bandwidth
+       << " -> " << p.after.bandwidth << ", profile " << p.before.profile
+       << " -> " << p.after.profile << "\n";
+}
+
+}
+
+#endif // NODE_REORDER_HPP
@@ -0,0 +1,287 @@
+// Out-of-core LU for matrices whose factors don't fit in memory
+//
+// The matrix graph is split into pieces and a vertex separator S, giving
+//     A = [ A_II  A_IS ]     with A_II block diagonal
+//         [ A_SI  A_SS ]
+// Each diagonal block is factored on its own with the policy's lu_t, saved to a
+// scratch file, and dropped, so only one block's factors are in memory at a time.
+// The blocks are then used through read-only mappings of those files, with the
+// next block prefetched while the current one is in use.  The separator is
+// handled with a dense Schur complement
+//     S = A_SS - sum_i A_Si A_ii^-1 A_iS
+// so it must be small enough to store densely.
+//
+// Works with any policy whose lu_t supports save() (see lu_file.hpp)
+
+#ifndef OOC_LU_HPP
+#define OOC_LU_HPP
+
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <memory>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+
+#include <unistd.h>
+
+#include "triplet_access.hpp"
+#include "graph_partition.hpp"
+#include "lowrank_update.hpp"     // for dense_lu
+#include "lu_file.hpp"
+
+struct ooc_options {
+    // target for the factor storage of any one block, in bytes
+    std::size_t memory_budget = std::size_t(1) << 30;
+    // guess at nnz(L+U) / nnz(A), used to size the blocks before we've factored anything
+    double      expected_fill = 10.0;
+    // where factors are spilled; default $TMPDIR, or /tmp
+    std::string scratch_dir;
+};
+
+template<typename L>
+struct ooc_lu_t {
+    using index_t  = typename L::index_t;
+    using value_t  = typename L::value_t;
+    using mapped_t = lu_file::mapped_factor<value_t, index_t>;
+
+    template<typename Iter>
+    ooc_lu_t( index_t n, Iter first, Iter last, ooc_options const & opts = ooc_options() )
+        : n_(n) {
+        using namespace triplet_access;
+
+        // size the pieces so each one's factors should fit the budget
+        double factor_bytes = opts.expected_fill * std::distance(first, last) *
+            (sizeof(value_t) + sizeof(index_t));
+        index_t nparts = std::max<index_t>(1, index_t(std::ceil(factor_bytes / opts.memory_budget)));
+
+        auto g    = graph_partition::symmetric_adjacency(n, first, last);
+        auto part = graph_partition::partition(g, nparts);
+        auto sep  = graph_partition::bordered_separator(g, part, first, last);
+
+        // number the blocks (skipping any that ended up empty) and their members
+        std::vector<index_t> block_id(nparts, -1);
+        where_.resize(n);
+        local_.resize(n);
+        for ( index_t v = 0; v < n; ++v ) {
+            if ( sep[v] ) {
+                where_[v] = -1;
+                local_[v] = index_t(sep_.size());
+                sep_.push_back(v);
+                continue;
+            }
+            if ( block_id[part[v]] < 0 ) {
+                block_id[part[v]] = index_t(blocks_.size());
+                blocks_.emplace_back();
+            }
+            where_[v] = block_id[part[v]];
+            local_[v] = index_t(blocks_[where_[v]].size());
+            blocks_[where_[v]].push_back(v);
+        }
+
+        // the coupling entries, and the separator block
+        index_t s = separator_size();
+        index_t nb = blocks();
+        upper_.resize(nb);
+        lower_.resize(nb);
+        std::vector<value_t> S(s * s, value_t(0));
+        for ( auto it = first; it != last; ++it ) {
+            index_t r = row(*it), c = col(*it);
+            entry e{local_[r], local_[c], value(*it)};
+            if ( (where_[r] < 0) && (where_[c] < 0) ) {
+                S[e.col * s + e.row] += e.value;
+            } else if ( where_[c] < 0 ) {
+                upper_[where_[r]].push_back(e);
+            } else if ( where_[r] < 0 ) {
+                lower_[where_[c]].push_back(e);
+            }
+        }
+
+        // factor and spill each block in turn
+        std::string dir = opts.scratch_dir;
+        if ( dir.empty() ) {
+            char const * tmp = std::getenv("TMPDIR");
+            dir = tmp ? tmp : "/tmp";
+        }
+        for ( index_t b = 0; b < nb; ++b ) {
+            std::vector<typename L::triplet_t> entries;
+            for ( auto it = first; it != last; ++it ) {
+                index_t r = row(*it), c = col(*it);
+                if ( (where_[r] == b) && (where_[c] == b) ) {
+                    entries.push_back(typename L::triplet_t{local_[r], local_[c], value(*it)});
+                }
+            }
+            factors_.push_back(factor_block(dir, index_t(blocks_[b].size()), entries));
+        }
+
+        // form and factor the Schur complement, a few separator columns at a time
+        constexpr index_t panel = 64;
+        for ( index_t b = 0; b < nb; ++b ) {
+            if ( b + 1 < nb ) {
+                factors_[b+1]->prefetch();
+            }
+            index_t nbk = index_t(blocks_[b].size());
+
+            // only separator columns that reach into this block contribute
+            std::vector<index_t> cols;
+            for ( auto const & e : upper_[b] ) {
+                cols.push_back(e.col);
+            }
+            std::sort(cols.begin(), cols.end());
+            cols.erase(std::unique(cols.begin(), cols.end()), cols.end());
+            std::vector<index_t> slot(s, -1);
+
+            for ( std::size_t c0 = 0; c0 < cols.size(); c0 += panel ) {
+                index_t w = index_t(std::min<std::size_t>(panel, cols.size() - c0));
+                for ( index_t k = 0; k < w; ++k ) {
+                    slot[cols[c0 + k]] = k;
+                }
+                // W = A_bb^-1 A_bS(:, panel)
+                std::vector<value_t> W(nbk * w, value_t(0));
+                for ( auto const & e : upper_[b] ) {
+                    if ( slot[e.col] >= 0 ) {
+                        W[slot[e.col] * nbk + e.row] += e.value;
+                    }
+                }
+                factors_[b]->solve(W.data(), w);
+                // S(:, panel) -= A_Sb W
+                for ( auto const & e : lower_[b] ) {
+                    for ( index_t k = 0; k < w; ++k ) {
+                        S[cols[c0 + k] * s + e.row] -= e.value * W[k * nbk + e.col];
+                    }
+                }
+                for ( index_t k = 0; k < w; ++k ) {
+                    slot[cols[c0 + k]] = -1;
+                }
+            }
+            factors_[b]->release();
+        }
+        schur_ = dense_lu<value_t, index_t>(std::move(S), s);
+        if ( schur_.singular() ) {
+            throw std::runtime_error("out-of-core LU: singular separator block");
+        }
+    }
+
+    index_t size() const { return n_; }
+    index_t blocks() const { return index_t(blocks_.size()); }
+    index_t separator_size() const { return index_t(sep_.size()); }
+
+    // overwrite a column-major n x ncols matrix with the solution
+    void solve( value_t * x, index_t ncols ) const {
+        index_t s = separator_size();
+        index_t nb = blocks();
+
+        // y_b = A_bb^-1 x_b
+        std::vector<std::vector<value_t>> y(nb);
+        for ( index_t b = 0; b < nb; ++b ) {
+            if ( b + 1 < nb ) {
+                factors_[b+1]->prefetch();
+            }
+            y[b] = gather(blocks_[b], x, ncols);
+            factors_[b]->solve(y[b].data(), ncols);
+            factors_[b]->release();
+        }
+
+        // x_S = S^-1 (x_S - sum_b A_Sb y_b)
+        std::vector<value_t> xs = gather(sep_, x, ncols);
+        for ( index_t b = 0; b < nb; ++b ) {
+            index_t nbk = index_t(blocks_[b].size());
+            for ( auto const & e : lower_[b] ) {
+                for ( index_t c = 0; c < ncols; ++c ) {
+                    xs[c * s + e.row] -= e.value * y[b][c * nbk + e.col];
+                }
+            }
+        }
+        for ( index_t c = 0; c < ncols; ++c ) {
+            schur_.solve(&xs[c * s]);
+        }
+        scatter(sep_, xs, x, ncols);
+
+        // x_b = y_b - A_bb^-1 A_bS x_S
+        for ( index_t b = 0; b < nb; ++b ) {
+            index_t nbk = index_t(blocks_[b].size());
+            if ( !upper_[b].empty() ) {
+                if ( b + 1 < nb ) {
+                    factors_[b+1]->prefetch();
+                }
+                std::vector<value_t> t(nbk * ncols, value_t(0));
+                for ( auto const & e : upper_[b] ) {
+                    for ( index_t c = 0; c < ncols; ++c ) {
+                        t[c * nbk + e.row] += e.value * xs[c * s + e.col];
+                    }
+                }
+                factors_[b]->solve(t.data(), ncols);
+                factors_[b]->release();
+                for ( std::size_t k = 0; k < t.size(); ++k ) {
+                    y[b][k] -= t[k];
+                }
+            }
+            scatter(blocks_[b], y[b], x, ncols);
+        }
+    }
+
+private:
+    struct entry {
+        index_t row;
+        index_t col;
+        value_t value;
+    };
+
+    // factor one block, write it to a scratch file, and map it back in
+    static std::shared_ptr<mapped_t const>
+    factor_block( std::string const & dir, index_t nbk,
+                  std::vector<typename L::triplet_t> const & entries ) {
+        std::string path = dir + "/ooc_lu_XXXXXX";
+        int fd = mkstemp(&path[0]);
+        if ( fd < 0 ) {
+            throw std::runtime_error("out-of-core LU: cannot create scratch file in " + dir);
+        }
+        ::close(fd);
+        {
+            typename L::sparsemat_t A(nbk, nbk, entries.begin(), entries.end());
+            typename L::lu_t lu(A);
+            lu.save(path);
+        }   // factors released here
+        auto f = mapped_t::open(path);
+        ::unlink(path.c_str());    // the mapping keeps the data until we are done
+        f->release();
+        return f;
+    }
+
+    std::vector<value_t>
+    gather( std::vector<index_t> const & members, value_t const * x, index_t ncols ) const {
+        index_t m = index_t(members.size());
+        std::vector<value_t> v(m * ncols);
+        for ( index_t c = 0; c < ncols; ++c ) {
+            for ( index_t k = 0; k < m; ++k ) {
+                v[c * m + k] = x[c * n_ + members[k]];
+            }
+        }
+        return v;
+    }
+
+    void
+    scatter( std::vector<index_t> const & members, std::vector<value_t> const & v,
+             value_t * x, index_t ncols ) const {
+        index_t m = index_t(members.size());
+        for ( index_t c = 0; c < ncols; ++c ) {
+            for ( index_t k = 0; k < m; ++k ) {
+                x[c * n_ + members[k]] = v[c * m + k];
+            }
+        }
+    }
+
+    index_t                            n_;
+    std::vector<index_t>               where_;    // block of each unknown, -1 for separator
+    std::vector<index_t>               local_;    // position within its block or separator
+    std::vector<std::vector<index_t>>  blocks_;   // members of each block
+    std::vector<index_t>               sep_;      // members of the separator
+    std::vector<std::vector<entry>>    upper_;    // A_bS, local (block row, separator column)
+    std::vector<std::vector<entry>>    lower_;    // A_Sb, local (separator row, block column)
+    std::vector<std::shared_ptr<mapped_t const>> factors_;
+    dense_lu<value_t, index_t>         schur_;
+};
+
+#endif // OOC_LU_HPP
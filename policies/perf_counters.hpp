@@ -0,0 +1,110 @@
+// Hardware performance counters around a piece of code, through Linux perf_event
+//
+// Counts cycles, instructions, last level cache misses and branch misses for the
+// calling thread, as one group so they cover exactly the same interval.  Where the
+// counters can't be opened (not Linux, a VM without a PMU, perf_event_paranoid too
+// high) everything still runs and valid() is false.
+
+#ifndef PERF_COUNTERS_HPP
+#define PERF_COUNTERS_HPP
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+struct perf_counts {
+    bool          valid = false;
+    std::uint64_t cycles = 0;
+    std::uint64_t instructions = 0;
+    std::uint64_t llc_misses = 0;
+    std::uint64_t branch_misses = 0;
+};
+
+class perf_counters {
+public:
+    perf_counters() {
+        fds_.fill(-1);
+#ifdef __linux__
+        static constexpr std::uint64_t events[nevents] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+        for ( int e = 0; e < nevents; ++e ) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size           = sizeof(attr);
+            attr.type           = PERF_TYPE_HARDWARE;
+            attr.config         = events[e];
+            attr.disabled       = (e == 0);     // the leader starts and stops the group
+            attr.exclude_kernel = 1;
+            attr.exclude_hv     = 1;
+            attr.read_format    = PERF_FORMAT_GROUP;
+            fds_[e] = int(syscall(__NR_perf_event_open, &attr, 0, -1, (e == 0) ? -1 : fds_[0], 0));
+            if ( fds_[e] < 0 ) {
+                close_all();
+                return;
+            }
+        }
+#endif
+    }
+
+    ~perf_counters() {
+        close_all();
+    }
+
+    perf_counters( perf_counters const & ) = delete;
+    perf_counters & operator=( perf_counters const & ) = delete;
+
+    bool valid() const { return fds_[0] >= 0; }
+
+    void start() {
+#ifdef __linux__
+        if ( valid() ) {
+            ioctl(fds_[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#endif
+    }
+
+    perf_counts stop() {
+        perf_counts c;
+#ifdef __linux__
+        if ( valid() ) {
+            ioctl(fds_[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+            std::uint64_t buf[1 + nevents];     // count, then the values
+            if ( ::read(fds_[0], buf, sizeof(buf)) == ssize_t(sizeof(buf)) ) {
+                c.valid         = true;
+                c.cycles        = buf[1];
+                c.instructions  = buf[2];
+                c.llc_misses    = buf[3];
+                c.branch_misses = buf[4];
+            }
+        }
+#endif
+        return c;
+    }
+
+private:
+    static constexpr int nevents = 4;
+
+    void close_all() {
+#ifdef __linux__
+        for ( auto & fd : fds_ ) {
+            if ( fd >= 0 ) {
+                ::close(fd);
+            }
+            fd = -1;
+        }
+#endif
+    }
+
+    std::array<int, nevents> fds_;
+};
+
+#endif // PERF_COUNTERS_HPP
@@ -0,0 +1,302 @@
+// Reduced models in pole-residue form, and their frequency response
+//
+// A reduced model
+//     (Gr + s Cr) x = Br u,    y = Lr x        (Lr = Br^T unless given)
+// is small and dense, and downstream it is evaluated at thousands of frequencies for
+// every pair of ports.  Solving with Gr + s Cr at each point costs O(k^3); instead the
+// model is diagonalized once.  With Gr^-1 Cr = V diag(lambda) V^-1,
+//     H(s) = Lr (I + s Gr^-1 Cr)^-1 Gr^-1 Br = D + sum_i c_i b_i^T / (s - p_i)
+// where p_i = -1/lambda_i.  Eigenvalues at zero (directions Cr doesn't reach) add to
+// the constant D instead.  When Gr and Cr are symmetric and Gr is positive definite,
+// as for RC nets, the symmetric generalized eigensolver gives real poles and a well
+// conditioned V; otherwise a general eigensolver is used, and poles come in complex
+// conjugate pairs.
+//
+// evaluate() computes H at many points for all port pairs.  1/(s - p_i) is formed once
+// per tile of frequencies, and the sum over poles runs along the tile with real and
+// imaginary parts in separate arrays, so it vectorizes (omp simd).  With OpenMP, blocks
+// of port pairs are shared among threads.
+
+#ifndef POLE_RESIDUE_HPP
+#define POLE_RESIDUE_HPP
+
+#include <cmath>
+#include <vector>
+#include <complex>
+#include <cstddef>
+#include <algorithm>
+#include <stdexcept>
+
+#include <Eigen/Dense>
+
+#ifdef _OPENMP
+#define POLE_RESIDUE_SIMD _Pragma("omp simd")
+#else
+#define POLE_RESIDUE_SIMD
+#endif
+
+namespace pole_residue {
+
+using complex_t = std::complex<double>;
+
+// frequencies per tile, and port pairs per parallel task, unless evaluate() is told otherwise
+static constexpr std::size_t default_tile       = 256;
+static constexpr std::size_t default_port_block = 16;
+
+struct model {
+    Eigen::MatrixXd G, C;    // k x k
+    Eigen::MatrixXd B;       // k x inputs
+    Eigen::MatrixXd L;       // outputs x k; empty for B^T
+};
+
+namespace detail {
+
+// the first k columns of a sparse matrix, dense
+template<typename Lib>
+Eigen::MatrixXd
+dense( typename Lib::sparsemat_t const & m, long k ) {
+    using index_t = typename Lib::index_t;
+    Eigen::MatrixXd d = Eigen::MatrixXd::Zero(m.rows(), k);
+    m.for_each_nonzero([&d, k](index_t i, index_t j, typename Lib::value_t v) {
+            if ( j < k ) {
+                d(i, j) = v;
+            }
+        });
+    return d;
+}
+
+// Q^T A Q, visiting the entries of A once
+template<typename Lib>
+Eigen::MatrixXd
+congruence( Eigen::MatrixXd const & Q, typename Lib::sparsemat_t const & A ) {
+    using index_t = typename Lib::index_t;
+    Eigen::MatrixXd AQ = Eigen::MatrixXd::Zero(Q.rows(), Q.cols());
+    A.for_each_nonzero([&AQ, &Q](index_t i, index_t j, typename Lib::value_t v) {
+            AQ.row(i) += v * Q.row(j);
+        });
+    return Q.transpose() * AQ;
+}
+
+inline bool
+symmetric( Eigen::MatrixXd const & A ) {
+    return (A - A.transpose()).lpNorm<Eigen::Infinity>() <= 1e-12 * A.lpNorm<Eigen::Infinity>();
+}
+
+}
+
+// The model Q projects G, C and B onto, with any policy's matrices.  Q may have more
+// columns than the basis (some policies' qr_t return a square Q); k says how many to use
+template<typename Lib>
+model
+project( typename Lib::sparsemat_t const & Q,
+         typename Lib::sparsemat_t const & G, typename Lib::sparsemat_t const & C,
+         typename Lib::sparsemat_t const & B, long k = -1 ) {
+    k = (k < 0) ? long(Q.cols()) : std::min(k, long(Q.cols()));
+    Eigen::MatrixXd Qd = detail::dense<Lib>(Q, k);
+    model m;
+    m.G = detail::congruence<Lib>(Qd, G);
+    m.C = detail::congruence<Lib>(Qd, C);
+    m.B = Qd.transpose() * detail::dense<Lib>(B, long(B.cols()));
+    return m;
+}
+
+// H(s) by a dense solve; what the expansion replaces, and a check on it
+inline Eigen::MatrixXcd
+solve_response( model const & m, complex_t s ) {
+    Eigen::MatrixXcd A = m.G.cast<complex_t>() + s * m.C.cast<complex_t>();
+    Eigen::MatrixXcd X = A.partialPivLu().solve(m.B.cast<complex_t>());
+    return (m.L.size() ? m.L : Eigen::MatrixXd(m.B.transpose())).cast<complex_t>() * X;
+}
+
+// H at a list of points, for every output and input port
+struct response {
+    std::size_t outputs = 0, inputs = 0, points = 0;
+    std::vector<double> re, im;    // H(a, b) at point f is at (a * inputs + b) * points + f
+
+    complex_t operator()( std::size_t a, std::size_t b, std::size_t f ) const {
+        std::size_t at = (a * inputs + b) * points + f;
+        return complex_t(re[at], im[at]);
+    }
+};
+
+class expansion {
+public:
+    // eigenvalues of Gr^-1 Cr at most zero_tolerance times the largest count as zero
+    explicit expansion( model const & m, double zero_tolerance = 1e-12 )
+        : D_(Eigen::MatrixXd::Zero(m.L.size() ? m.L.rows() : m.B.cols(), m.B.cols())) {
+        if ( (m.G.rows() != m.G.cols()) || (m.C.rows() != m.G.rows()) || (m.C.cols() != m.G.cols()) ||
+             (m.B.rows() != m.G.rows()) || (m.L.size() && (m.L.cols() != m.G.rows())) ) {
+            throw std::logic_error("pole_residue: model dimensions do not agree");
+        }
+        Eigen::MatrixXd L = m.L.size() ? m.L : Eigen::MatrixXd(m.B.transpose());
+
+        // Gr^-1 Cr = V diag(lambda) V^-1, with Y = L V and X = V^-1 Gr^-1 B
+        Eigen::VectorXcd lambda;
+        Eigen::MatrixXcd Y, X;
+        Eigen::LLT<Eigen::MatrixXd> chol(m.G);
+        if ( detail::symmetric(m.G) && detail::symmetric(m.C) && (chol.info() == Eigen::Success) ) {
+            // C v = lambda G v, with V^T G V = I, so V^-1 = V^T G
+            Eigen::GeneralizedSelfAdjointEigenSolver<Eigen::MatrixXd> es(m.C, m.G);
+            if ( es.info() != Eigen::Success ) {
+                throw std::runtime_error("pole_residue: symmetric eigensolver failed");
+            }
+            lambda = es.eigenvalues().cast<complex_t>();
+            Y = (L * es.eigenvectors()).cast<complex_t>();
+            X = (es.eigenvectors().transpose() * m.B).cast<complex_t>();
+        } else {
+            Eigen::PartialPivLU<Eigen::MatrixXd> lu(m.G);
+            if ( !(lu.rcond() > 1e-14) ) {
+                throw std::runtime_error("pole_residue: Gr is singular");
+            }
+            Eigen::EigenSolver<Eigen::MatrixXd> es(lu.solve(m.C));
+            if ( es.info() != Eigen::Success ) {
+                throw std::runtime_error("pole_residue: eigensolver failed");
+            }
+            lambda = es.eigenvalues();
+            Eigen::MatrixXcd V = es.eigenvectors();
+            Y = L.cast<complex_t>() * V;
+            X = V.fullPivLu().solve(lu.solve(m.B).cast<complex_t>());
+        }
+
+        // each term y_i x_i^T / (1 + s lambda_i) is a pole at -1/lambda_i, or constant
+        double largest = lambda.size() ? lambda.cwiseAbs().maxCoeff() : 0.0;
+        std::vector<long> kept;
+        for ( long i = 0; i < lambda.size(); ++i ) {
+            if ( std::abs(lambda(i)) > zero_tolerance * largest ) {
+                kept.push_back(i);
+            } else {
+                D_ += (Y.col(i) * X.row(i)).real();
+            }
+        }
+        poles_.resize(kept.size());
+        c_.resize(Y.rows(), long(kept.size()));
+        b_.resize(long(kept.size()), X.cols());
+        for ( std::size_t t = 0; t < kept.size(); ++t ) {
+            long i = kept[t];
+            poles_[t] = -1.0 / lambda(i);
+            c_.col(long(t)) = Y.col(i) / lambda(i);
+            b_.row(long(t)) = X.row(i);
+        }
+
+        // the residues again, pole by pole for each port pair, as the kernel wants them
+        std::size_t npoles = poles_.size(), pairs = outputs() * inputs();
+        res_re_.resize(pairs * npoles);
+        res_im_.resize(pairs * npoles);
+        for ( std::size_t a = 0; a < outputs(); ++a ) {
+            for ( std::size_t b = 0; b < inputs(); ++b ) {
+                for ( std::size_t i = 0; i < npoles; ++i ) {
+                    complex_t r = residue(i, a, b);
+                    res_re_[(a * inputs() + b) * npoles + i] = r.real();
+                    res_im_[(a * inputs() + b) * npoles + i] = r.imag();
+                }
+            }
+        }
+    }
+
+    std::size_t outputs() const { return std::size_t(D_.rows()); }
+    std::size_t inputs() const { return std::size_t(D_.cols()); }
+
+    std::vector<complex_t> const & poles() const { return poles_; }
+
+    // the residue matrix of pole i is rank one: c_i b_i^T
+    complex_t residue( std::size_t i, std::size_t a, std::size_t b ) const {
+        return c_(long(a), long(i)) * b_(long(i), long(b));
+    }
+
+    // what is left at s -> infinity
+    Eigen::MatrixXd const & direct() const { return D_; }
+
+    // H(s) at one point
+    Eigen::MatrixXcd operator()( complex_t s ) const {
+        Eigen::MatrixXcd H = D_.cast<complex_t>();
+        for ( std::size_t i = 0; i < poles_.size(); ++i ) {
+            H += c_.col(long(i)) * b_.row(long(i)) / (s - poles_[i]);
+        }
+        return H;
+    }
+
+    // H at every point of s (for a frequency sweep, s = j 2 pi f)
+    response evaluate( std::vector<complex_t> const & s,
+                       std::size_t tile = default_tile,
+                       std::size_t port_block = default_port_block ) const {
+        response r;
+        r.outputs = outputs();
+        r.inputs  = inputs();
+        r.points  = s.size();
+        std::size_t F = s.size(), npoles = poles_.size(), pairs = r.outputs * r.inputs;
+        r.re.resize(pairs * F);
+        r.im.resize(pairs * F);
+        tile = std::max(std::size_t(1), std::min(tile, F));
+        port_block = std::max(std::size_t(1), port_block);
+
+        std::vector<double> sr(F), si(F), pr(npoles), pi(npoles);
+        for ( std::size_t f = 0; f < F; ++f ) {
+            sr[f] = s[f].real();
+            si[f] = s[f].imag();
+        }
+        for ( std::size_t i = 0; i < npoles; ++i ) {
+            pr[i] = poles_[i].real();
+            pi[i] = poles_[i].imag();
+        }
+
+        long nblocks = long((pairs + port_block - 1) / port_block);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) if (nblocks > 1)
+#endif
+        for ( long blk = 0; blk < nblocks; ++blk ) {
+            std::size_t first = std::size_t(blk) * port_block;
+            std::size_t last  = std::min(pairs, first + port_block);
+            std::vector<double> tr(npoles * tile), ti(npoles * tile);    // 1/(s - p_i)
+            for ( std::size_t f0 = 0; f0 < F; f0 += tile ) {
+                std::size_t nf = std::min(tile, F - f0);
+                double const * tsr = sr.data() + f0;
+                double const * tsi = si.data() + f0;
+                for ( std::size_t i = 0; i < npoles; ++i ) {
+                    double * ur = tr.data() + i * tile;
+                    double * ui = ti.data() + i * tile;
+                    double ar = pr[i], ai = pi[i];
+                    POLE_RESIDUE_SIMD
+                    for ( std::size_t f = 0; f < nf; ++f ) {
+                        double dr = tsr[f] - ar, di = tsi[f] - ai;
+                        double inv = 1.0 / (dr * dr + di * di);
+                        ur[f] = dr * inv;
+                        ui[f] = -di * inv;
+                    }
+                }
+                for ( std::size_t pair = first; pair < last; ++pair ) {
+                    double * hr = r.re.data() + pair * F + f0;
+                    double * hi = r.im.data() + pair * F + f0;
+                    double d = D_(long(pair / r.inputs), long(pair % r.inputs));
+                    std::fill(hr, hr + nf, d);
+                    std::fill(hi, hi + nf, 0.0);
+                    double const * rr = res_re_.data() + pair * npoles;
+                    double const * ri = res_im_.data() + pair * npoles;
+                    for ( std::size_t i = 0; i < npoles; ++i ) {
+                        double const * ur = tr.data() + i * tile;
+                        double const * ui = ti.data() + i * tile;
+                        double a = rr[i], b = ri[i];
+                        POLE_RESIDUE_SIMD
+                        for ( std::size_t f = 0; f < nf; ++f ) {
+                            hr[f] += a * ur[f] - b * ui[f];
+                            hi[f] += a * ui[f] + b * ur[f];
+                        }
+                    }
+                }
+            }
+        }
+        return r;
+    }
+
+private:
+    Eigen::MatrixXd        D_;
+    std::vector<complex_t> poles_;
+    Eigen::MatrixXcd       c_;         // outputs x poles
+    Eigen::MatrixXcd       b_;         // poles x inputs
+    std::vector<double>    res_re_, res_im_;   // residue of pole i for pair p at p * poles + i
+};
+
+}
+
+#undef POLE_RESIDUE_SIMD
+
+#endif // POLE_RESIDUE_HPP
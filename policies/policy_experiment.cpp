@@ -1,6 +1,8 @@
 #include <vector>
 #include <iostream>
 
+#include "trace.hpp"
+
 // choose library to use
 #if defined(USE_EIGEN)
 #include "eigen_shim.hpp"
@@ -11,6 +13,12 @@ using sparse_lib_t = CSparseShim;
 #elif defined(USE_SUITESPARSE)
 #include "suitesparse_shim.hpp"
 using sparse_lib_t = SuiteSparse::Shim;
+#elif defined(USE_ITERATIVE)
+#include "iterative_shim.hpp"
+using sparse_lib_t = IterativeShim;
+#elif defined(USE_DISPATCH)
+#include "dispatch_shim.hpp"
+using sparse_lib_t = Dispatch::Shim;
 #endif
 
 // describe the type requirements our code has from a sparse library
@@ -38,6 +46,7 @@ BOOST_CONCEPT_REQUIRES(((SparseLibrary<L>)),  // concept(s)
 #endif
 startPrima() {
     // run the first few steps of Prima using our SparseLibrary
+    SPARSELIB_TRACE_SCOPE("startPrima");
     using namespace std;
     vector<typename L::triplet_t> Gentries{
         {0, 0, 0.01},
@@ -0,0 +1,449 @@
+// An asynchronous version of the first steps of Prima, for a stream of nets
+//
+// Each submitted net goes through four stages: assemble (triplets to G and B),
+// factor G, solve G^-1 B, and orthogonalize the result with QR.  Every stage is
+// a separate task on a work-stealing pool, so the assembly of one net overlaps
+// the factoring of the one before and the QR of the one before that.  submit()
+// blocks once enough nets are in flight, which keeps memory bounded when the
+// producer is faster than the pipeline.  Optionally each net's nodes are renumbered
+// for locality first (node_reorder.hpp), and Q is returned in the original numbering.
+//
+// The threads inside each library call come from a thread_budget (thread_budget.hpp).
+// Before each stage it is shared among the nets that can be running at that moment:
+// with a deep queue every net gets one thread and the pool supplies the parallelism,
+// while the last few nets of a batch get the cores the idle workers leave behind.
+//
+// With a memory budget, each net's peak (its factors, from the policy's symbolic
+// analysis, plus G, B and the dense-ish solution and Q) is estimated once it is
+// assembled, and it is only factored once that fits (memory_admission.hpp).  Nets
+// waiting for memory don't hold a thread, so smaller ones keep the pool busy.
+
+#ifndef PRIMA_PIPELINE_HPP
+#define PRIMA_PIPELINE_HPP
+
+#include <array>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <condition_variable>
+
+#include "node_reorder.hpp"
+#include "thread_budget.hpp"
+#include "memory_admission.hpp"
+
+// A fixed set of threads, each with its own task deque.  Workers take their newest
+// task first (it's likely still in cache) and steal the oldest from the others
+class work_stealing_pool {
+public:
+    explicit work_stealing_pool( unsigned nthreads = std::max(1u, std::thread::hardware_concurrency()) ) {
+        for ( unsigned i = 0; i < nthreads; ++i ) {
+            queues_.emplace_back(new worker_queue);
+        }
+        for ( unsigned i = 0; i < nthreads; ++i ) {
+            threads_.emplace_back([this, i] { run(i); });
+        }
+    }
+
+    // runs whatever is still queued first
+    ~work_stealing_pool() {
+        {
+            std::lock_guard<std::mutex> lk(m_);
+            done_ = true;
+        }
+        cv_.notify_all();
+        for ( auto & t : threads_ ) {
+            t.join();
+        }
+    }
+
+    work_stealing_pool( work_stealing_pool const & ) = delete;
+    work_stealing_pool & operator=( work_stealing_pool const & ) = delete;
+
+    unsigned size() const { return unsigned(threads_.size()); }
+
+    // tasks posted from one of our workers go on its own deque, others are spread around
+    void post( std::function<void()> task ) {
+        auto const & self = current();
+        unsigned q = (self.first == this) ? self.second : (next_++ % size());
+        {
+            std::lock_guard<std::mutex> lk(queues_[q]->m);
+            queues_[q]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lk(m_);
+            ++pending_;
+        }
+        cv_.notify_one();
+    }
+
+private:
+    struct worker_queue {
+        std::mutex                        m;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    // which pool (if any) the calling thread works for, and its index there
+    static std::pair<work_stealing_pool const *, unsigned> & current() {
+        static thread_local std::pair<work_stealing_pool const *, unsigned> w{nullptr, 0};
+        return w;
+    }
+
+    bool pop( unsigned self, std::function<void()> & task ) {
+        for ( unsigned k = 0; k < size(); ++k ) {
+            unsigned q = (self + k) % size();
+            std::lock_guard<std::mutex> lk(queues_[q]->m);
+            auto & tasks = queues_[q]->tasks;
+            if ( tasks.empty() ) {
+                continue;
+            }
+            if ( k == 0 ) {
+                task = std::move(tasks.back());
+                tasks.pop_back();
+            } else {
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void run( unsigned self ) {
+        current() = std::make_pair(this, self);
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lk(m_);
+                cv_.wait(lk, [this] { return (pending_ > 0) || done_; });
+                if ( pending_ == 0 ) {
+                    return;     // done, and nothing left
+                }
+                --pending_;     // one of the queued tasks is ours
+            }
+            std::function<void()> task;
+            while ( !pop(self, task) ) {
+                std::this_thread::yield();   // someone else has it locked; it's there
+            }
+            task();
+        }
+    }
+
+    std::vector<std::unique_ptr<worker_queue>> queues_;
+    std::vector<std::thread>                   threads_;
+    std::mutex                                 m_;
+    std::condition_variable                    cv_;
+    std::size_t                                pending_ = 0;   // queued, not yet claimed
+    bool                                       done_ = false;
+    std::atomic<unsigned>                      next_{0};
+};
+
+// Libraries may declare "static constexpr bool thread_safe = false" if their calls
+// share state (SuiteSparse keeps a common object per index type, for example).
+// The pipeline then makes one library call at a time
+template<typename... T> struct make_void { using type = void; };
+
+template<typename L, typename = void>
+struct library_thread_safe : std::true_type {};
+
+template<typename L>
+struct library_thread_safe<L, typename make_void<decltype(L::thread_safe)>::type>
+    : std::integral_constant<bool, L::thread_safe> {};
+
+template<typename L>
+struct prima_pipeline {
+    using index_t     = typename L::index_t;
+    using triplet_t   = typename L::triplet_t;
+    using sparsemat_t = typename L::sparsemat_t;
+
+    // G is nodes x nodes, B is nodes x ports
+    struct net_t {
+        index_t                nodes;
+        index_t                ports;
+        std::vector<triplet_t> G;
+        std::vector<triplet_t> B;
+    };
+
+    enum stage { assemble, factor, solve, orthogonalize, nstages };
+
+    struct stage_report {
+        char const * name;
+        std::size_t  jobs;
+        double       busy;        // seconds spent in this stage, over all threads
+        double       occupancy;   // busy as a fraction of the pool's capacity
+    };
+
+    // by default up to two nets per thread are in flight, and memory is unlimited
+    explicit prima_pipeline( unsigned threads = std::max(1u, std::thread::hardware_concurrency()),
+                             std::size_t max_in_flight = 0,
+                             node_reorder::method reorder = node_reorder::method::none,
+                             thread_budget budget = thread_budget(),
+                             std::size_t memory_budget = 0 )
+        : max_in_flight_(max_in_flight ? max_in_flight : 2 * threads), reorder_(reorder),
+          budget_(budget), admission_(memory_budget), pool_(threads) {}
+
+    ~prima_pipeline() {
+        wait();
+    }
+
+    // Queue a net; the future delivers Q, an orthonormal basis for G^-1 B
+    std::future<sparsemat_t> submit( net_t net ) {
+        {
+            std::unique_lock<std::mutex> lk(m_);
+            cv_.wait(lk, [this] { return in_flight_ < max_in_flight_; });
+            if ( submitted_++ == 0 ) {
+                start_ = clock::now();
+            }
+            ++in_flight_;
+        }
+        auto j = std::make_shared<job>();
+        j->net = std::move(net);
+        auto result = j->result.get_future();
+
+        run_stage(assemble, j, [this](job & j) {
+                j.nodes = j.net.nodes;
+                if ( reorder_ != node_reorder::method::none ) {
+                    j.order = node_reorder::compute(j.net.nodes, j.net.G.cbegin(), j.net.G.cend(),
+                                                    j.net.G.cend(), j.net.G.cend(), reorder_);
+                    j.net.G = node_reorder::permute(j.order, j.net.G);
+                    j.net.B = node_reorder::permute(j.order, j.net.B, false);
+                    std::lock_guard<std::mutex> lk(m_);
+                    reordered_before_.bandwidth += j.order.before.bandwidth;
+                    reordered_before_.profile   += j.order.before.profile;
+                    reordered_after_.bandwidth  += j.order.after.bandwidth;
+                    reordered_after_.profile    += j.order.after.profile;
+                }
+                j.G.reset(new sparsemat_t(j.net.nodes, j.net.nodes, j.net.G.begin(), j.net.G.end()));
+                j.B.reset(new sparsemat_t(j.net.nodes, j.net.ports, j.net.B.begin(), j.net.B.end()));
+                if ( admission_.budget() ) {
+                    j.estimate = memory_estimate::lu_bytes<L>(*j.G);
+                    j.reserved = calibration_.corrected(j.estimate) + matrix_bytes(j.net);
+                }
+                j.net = net_t{};
+                return factor;
+            });
+        return result;
+    }
+
+    // until everything submitted so far is finished
+    void wait() {
+        std::unique_lock<std::mutex> lk(m_);
+        cv_.wait(lk, [this] { return in_flight_ == 0; });
+    }
+
+    // completed nets per second, from the first submission to the latest completion
+    double throughput() const {
+        std::lock_guard<std::mutex> lk(m_);
+        double elapsed = std::chrono::duration<double>(finish_ - start_).count();
+        return (elapsed > 0) ? completed_ / elapsed : 0.0;
+    }
+
+    std::array<stage_report, nstages> report() const {
+        static char const * const names[nstages] = { "assemble", "factor", "solve", "orthogonalize" };
+        std::lock_guard<std::mutex> lk(m_);
+        double capacity = std::chrono::duration<double>(finish_ - start_).count() * pool_.size();
+        std::array<stage_report, nstages> r;
+        for ( int s = 0; s < nstages; ++s ) {
+            double busy = stats_[s].busy_ns * 1e-9;
+            r[s] = stage_report{ names[s], stats_[s].jobs, busy, (capacity > 0) ? busy / capacity : 0.0 };
+        }
+        return r;
+    }
+
+    void print_report( std::ostream & os ) const {
+        std::size_t completed;
+        {
+            std::lock_guard<std::mutex> lk(m_);
+            completed = completed_;
+        }
+        auto flags = os.flags();
+        auto prec = os.precision();
+        os << completed << " nets, " << throughput() << " nets/s on " << pool_.size() << " threads"
+           << " (budget " << budget_.total() << ")\n";
+        if ( admission_.budget() ) {
+            os << "memory: budget " << admission_.budget() << " bytes, peak reserved " << admission_.peak()
+               << ", " << admission_.delayed() << " nets waited, estimates scaled by "
+               << std::max(1.0, calibration_.ratio());
+            if ( memory_estimate::has_memory_peak<L>::value ) {
+                os << ", library peak " << memory_estimate::library_peak<L>();
+            }
+            os << "\n";
+        }
+        if ( (reorder_ != node_reorder::method::none) && (completed > 0) ) {
+            std::lock_guard<std::mutex> lk(m_);
+            os << "reordering (" << node_reorder::method_name(reorder_) << "): mean bandwidth "
+               << reordered_before_.bandwidth / completed << " -> " << reordered_after_.bandwidth / completed
+               << ", mean profile " << reordered_before_.profile / completed
+               << " -> " << reordered_after_.profile / completed << "\n";
+        }
+        for ( auto const & s : report() ) {
+            os << std::setw(14) << std::left << s.name << std::right << std::setw(8) << s.jobs << " jobs "
+               << std::fixed << std::setprecision(3) << std::setw(10) << s.busy << " s "
+               << std::setprecision(1) << std::setw(6) << 100 * s.occupancy << "%\n";
+            os.flags(flags);
+        }
+        os.precision(prec);
+    }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    // one net's progress through the stages
+    struct job {
+        net_t                               net;
+        index_t                             nodes = 0;
+        node_reorder::permutation<index_t>  order;
+        std::unique_ptr<sparsemat_t>        G, B, A;
+        std::unique_ptr<typename L::lu_t>   lu;
+        std::promise<sparsemat_t>           result;
+        std::size_t                         estimate = 0;    // of the factors, before calibration
+        std::size_t                         reserved = 0;    // of the whole net, once admitted
+        bool                                admitted = false;
+    };
+
+    struct stage_stats {
+        std::size_t jobs = 0;
+        long long   busy_ns = 0;
+    };
+
+    // Queue one stage of a job.  "work" returns the stage to run next (nstages when done)
+    template<typename F>
+    void run_stage( stage s, std::shared_ptr<job> j, F work ) {
+        pool_.post([this, s, j, work]() {
+                stage next = nstages;
+                try {
+                    std::unique_lock<std::mutex> lib(library_m_, std::defer_lock);
+                    if ( !library_thread_safe<L>::value ) {
+                        lib.lock();
+                    }
+                    apply_threads<L>(budget_.share(concurrent()));
+                    auto start = clock::now();
+                    next = work(*j);
+                    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+                    std::lock_guard<std::mutex> lk(m_);
+                    ++stats_[s].jobs;
+                    stats_[s].busy_ns += ns;
+                } catch ( ... ) {
+                    j->result.set_exception(std::current_exception());
+                    finished(*j);
+                    return;
+                }
+                if ( next == nstages ) {
+                    finished(*j);
+                } else {
+                    continue_with(next, j);
+                }
+            });
+    }
+
+    // how many library calls may be running now: one at a time if the library says so,
+    // otherwise as many as there are nets in flight, up to the size of the pool
+    std::size_t concurrent() const {
+        if ( !library_thread_safe<L>::value ) {
+            return 1;
+        }
+        std::lock_guard<std::mutex> lk(m_);
+        return std::min(in_flight_, std::size_t(pool_.size()));
+    }
+
+    void continue_with( stage s, std::shared_ptr<job> j ) {
+        switch ( s ) {
+        case factor:
+            if ( admission_.budget() ) {
+                admission_.submit(j->reserved, [this, j] {
+                        j->admitted = true;
+                        run_factor(j);
+                    });
+            } else {
+                run_factor(j);
+            }
+            break;
+        case solve:
+            run_stage(solve, j, [](job & j) {
+                    j.A.reset(new sparsemat_t(j.lu->solve(*j.B)));
+                    j.lu.reset();
+                    j.B.reset();
+                    return orthogonalize;
+                });
+            break;
+        case orthogonalize:
+            run_stage(orthogonalize, j, [](job & j) {
+                    typename L::qr_t QR(*j.A);
+                    j.A.reset();
+                    if ( j.order.identity() ) {
+                        j.result.set_value(QR.Q());
+                    } else {
+                        // the columns of Q are orthonormal, so the last one has an entry
+                        auto Q = QR.Q();
+                        index_t cols = 0;
+                        Q.for_each_nonzero([&cols](index_t, index_t c, typename L::value_t) {
+                                cols = std::max(cols, index_t(c + 1));
+                            });
+                        j.result.set_value(node_reorder::restore_rows<L>(j.order, Q, j.nodes, cols));
+                    }
+                    return nstages;
+                });
+            break;
+        default:
+            break;
+        }
+    }
+
+    void run_factor( std::shared_ptr<job> j ) {
+        run_stage(factor, j, [this](job & j) {
+                j.lu.reset(new typename L::lu_t(*j.G));
+                j.G.reset();
+                if ( j.estimate ) {
+                    calibration_.observe(j.estimate, memory_estimate::factored_bytes<L>(*j.lu));
+                }
+                return solve;
+            });
+    }
+
+    // G and B as triplets, and the solution and Q at worst dense
+    static std::size_t matrix_bytes( net_t const & net ) {
+        return (net.G.size() + net.B.size()) * sizeof(triplet_t) +
+            3 * std::size_t(net.nodes) * std::size_t(net.ports) * memory_estimate::entry_bytes<L>();
+    }
+
+    void finished( job & j ) {
+        if ( j.admitted ) {
+            j.admitted = false;
+            admission_.release(j.reserved);
+        }
+        {
+            std::lock_guard<std::mutex> lk(m_);
+            --in_flight_;
+            ++completed_;
+            finish_ = clock::now();
+        }
+        cv_.notify_all();
+    }
+
+    std::size_t                        max_in_flight_;
+    mutable std::mutex                 m_;              // for everything below
+    std::condition_variable            cv_;
+    std::size_t                        in_flight_ = 0;
+    std::size_t                        submitted_ = 0;
+    std::size_t                        completed_ = 0;
+    clock::time_point                  start_, finish_;
+    std::array<stage_stats, nstages>   stats_;
+    node_reorder::method               reorder_;
+    node_reorder::envelope             reordered_before_, reordered_after_;   // summed over nets
+    thread_budget                      budget_;
+    memory_admission                   admission_;
+    memory_estimate::calibration       calibration_;
+    std::mutex                         library_m_;
+
+    work_stealing_pool                 pool_;           // last, so its threads stop first
+};
+
+#endif // PRIMA_PIPELINE_HPP
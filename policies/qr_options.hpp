@@ -0,0 +1,36 @@
+// Rank handling for the qr_t of each policy
+//
+// Nearly dependent columns (deflated Krylov directions, for example) would otherwise
+// each add a column to Q, and so to the order of the reduced model.  Given a tolerance,
+// a direction is dropped when what is left of its column after orthogonalizing against
+// the others - its R diagonal - is at most tolerance times the largest column norm.
+// Libraries that don't pivot columns (CSparse) also require the rest of that row of R
+// to be that small, since a later column may depend on the direction.
+
+#ifndef QR_OPTIONS_HPP
+#define QR_OPTIONS_HPP
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+struct qr_options {
+    double tolerance = -1;      // negative for the library's own rank handling
+    bool   pivoting  = false;   // order columns so the R diagonal reveals the rank
+};
+
+// The largest 2-norm of any column, for anything with for_each_nonzero()
+template<typename Matrix>
+double
+max_column_norm( Matrix const & m ) {
+    std::vector<double> sq;
+    m.for_each_nonzero([&sq](std::size_t, std::size_t col, double v) {
+            if ( col >= sq.size() ) {
+                sq.resize(col + 1, 0.0);
+            }
+            sq[col] += v * v;
+        });
+    return sq.empty() ? 0.0 : std::sqrt(*std::max_element(sq.begin(), sq.end()));
+}
+
+#endif // QR_OPTIONS_HPP
@@ -0,0 +1,312 @@
+// Sparse matrix times a tall dense panel, in the SELL-C-sigma layout
+//
+// None of the libraries multiplies a sparse matrix by a block of dense vectors
+// directly, yet Krylov steps, congruence projection and refinement residuals all
+// want exactly that.  sell::matrix copies any sparsemat_t once into "sliced ELLPACK":
+// the rows are cut into slices of C = 8, each slice padded to its longest row and
+// stored column by column, so one SIMD lane handles one row.  Padding has column -1
+// and is masked off, so it never reads X (where an Inf or NaN would poison the row).  To keep the padding
+// down, rows are first sorted by length within windows of sigma rows; the result is
+// scattered back to the original order.
+//
+// The kernels are chosen at run time: AVX-512 (one 8-wide vector per slice), AVX2
+// with FMA (two 4-wide halves), or plain loops elsewhere.  Only doubles have SIMD
+// kernels.  With OpenMP the slices are shared among threads.
+
+#ifndef SELL_SPMM_HPP
+#define SELL_SPMM_HPP
+
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+#if ( defined(__GNUC__) || defined(__clang__) ) && ( defined(__x86_64__) || defined(__i386__) )
+#define SELL_SPMM_X86 1
+#include <immintrin.h>
+#endif
+
+namespace sell {
+
+enum class isa { scalar, avx2, avx512 };
+
+inline char const * isa_name( isa w ) {
+    switch ( w ) {
+    case isa::avx512: return "avx512";
+    case isa::avx2:   return "avx2";
+    default:          return "scalar";
+    }
+}
+
+// The best this processor runs
+inline isa best_isa() {
+#ifdef SELL_SPMM_X86
+    static isa const best = []() {
+        __builtin_cpu_init();
+        if ( __builtin_cpu_supports("avx512f") ) {
+            return isa::avx512;
+        }
+        if ( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ) {
+            return isa::avx2;
+        }
+        return isa::scalar;
+    }();
+    return best;
+#else
+    return isa::scalar;
+#endif
+}
+
+// rows per slice: one AVX-512 vector of doubles
+static constexpr int C = 8;
+
+// below this much work (stored entries times panel columns) we stay on one thread
+static constexpr std::size_t min_parallel_work = std::size_t(1) << 16;
+
+namespace detail {
+
+// One slice against up to NB panel columns: y[q][r] = sum over j of val[j][r] * x[q][col[j][r]]
+// Slices are stored column by column, C entries to each column of the slice; lanes
+// with col < 0 are padding and contribute nothing
+
+template<int NB, typename Value>
+void slice_scalar( std::int32_t const * col, Value const * val, std::size_t width,
+                   Value const * const * x, Value (*y)[C] ) {
+    for ( int q = 0; q < NB; ++q ) {
+        for ( int r = 0; r < C; ++r ) {
+            y[q][r] = Value(0);
+        }
+    }
+    for ( std::size_t j = 0; j < width; ++j ) {
+        for ( int q = 0; q < NB; ++q ) {
+            for ( int r = 0; r < C; ++r ) {
+                std::int32_t c = col[j * C + r];
+                if ( c >= 0 ) {
+                    y[q][r] += val[j * C + r] * x[q][c];
+                }
+            }
+        }
+    }
+}
+
+#ifdef SELL_SPMM_X86
+
+template<int NB>
+__attribute__((target("avx2,fma")))
+void slice_avx2( std::int32_t const * col, double const * val, std::size_t width,
+                 double const * const * x, double (*y)[C] ) {
+    // masked gathers: padding lanes (negative column) load zero instead of reading x
+    __m256d const zero = _mm256_setzero_pd();
+    __m128i const none = _mm_set1_epi32(-1);
+    __m256d lo[NB], hi[NB];
+    for ( int q = 0; q < NB; ++q ) {
+        lo[q] = _mm256_setzero_pd();
+        hi[q] = _mm256_setzero_pd();
+    }
+    for ( std::size_t j = 0; j < width; ++j ) {
+        __m128i ilo = _mm_loadu_si128(reinterpret_cast<__m128i const *>(col + j * C));
+        __m128i ihi = _mm_loadu_si128(reinterpret_cast<__m128i const *>(col + j * C + 4));
+        __m256d vlo = _mm256_loadu_pd(val + j * C);
+        __m256d vhi = _mm256_loadu_pd(val + j * C + 4);
+        __m256d mlo = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm_cmpgt_epi32(ilo, none)));
+        __m256d mhi = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm_cmpgt_epi32(ihi, none)));
+        for ( int q = 0; q < NB; ++q ) {
+            lo[q] = _mm256_fmadd_pd(vlo, _mm256_mask_i32gather_pd(zero, x[q], ilo, mlo, 8), lo[q]);
+            hi[q] = _mm256_fmadd_pd(vhi, _mm256_mask_i32gather_pd(zero, x[q], ihi, mhi, 8), hi[q]);
+        }
+    }
+    for ( int q = 0; q < NB; ++q ) {
+        _mm256_storeu_pd(y[q], lo[q]);
+        _mm256_storeu_pd(y[q] + 4, hi[q]);
+    }
+}
+
+template<int NB>
+__attribute__((target("avx512f")))
+void slice_avx512( std::int32_t const * col, double const * val, std::size_t width,
+                   double const * const * x, double (*y)[C] ) {
+    __m512d const zero = _mm512_setzero_pd();
+    __m512d acc[NB];
+    for ( int q = 0; q < NB; ++q ) {
+        acc[q] = _mm512_setzero_pd();
+    }
+    for ( std::size_t j = 0; j < width; ++j ) {
+        __m256i idx = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(col + j * C));
+        __m512d v = _mm512_loadu_pd(val + j * C);
+        // padding lanes (negative column) load zero instead of reading x
+        __mmask8 m = __mmask8(_mm512_cmpge_epi32_mask(_mm512_castsi256_si512(idx), _mm512_setzero_si512()));
+        for ( int q = 0; q < NB; ++q ) {
+            acc[q] = _mm512_fmadd_pd(v, _mm512_mask_i32gather_pd(zero, m, idx, x[q], 8), acc[q]);
+        }
+    }
+    for ( int q = 0; q < NB; ++q ) {
+        _mm512_storeu_pd(y[q], acc[q]);
+    }
+}
+
+#endif // SELL_SPMM_X86
+
+// panel columns handled together, so each slice's indices and values are loaded once for all
+static constexpr int max_block = 4;
+
+template<int NB, typename Value>
+void slice( isa w, std::int32_t const * col, Value const * val, std::size_t width,
+            Value const * const * x, Value (*y)[C], std::false_type ) {
+    (void)w;
+    slice_scalar<NB>(col, val, width, x, y);
+}
+
+template<int NB>
+void slice( isa w, std::int32_t const * col, double const * val, std::size_t width,
+            double const * const * x, double (*y)[C], std::true_type ) {
+#ifdef SELL_SPMM_X86
+    if ( w == isa::avx512 ) {
+        return slice_avx512<NB>(col, val, width, x, y);
+    }
+    if ( w == isa::avx2 ) {
+        return slice_avx2<NB>(col, val, width, x, y);
+    }
+#endif
+    (void)w;
+    slice_scalar<NB>(col, val, width, x, y);
+}
+
+}
+
+template<typename Index, typename Value>
+class matrix {
+public:
+    // A is anything with for_each_nonzero(); sigma is the sorting window, a multiple of C
+    // (C itself means no sorting beyond each slice, rows() means a global sort)
+    template<typename Sparse>
+    matrix( Index rows, Index cols, Sparse const & A, Index sigma = 256 )
+        : rows_(rows), cols_(cols), nnz_(0) {
+        if ( cols > Index(std::numeric_limits<std::int32_t>::max()) ) {
+            // the gathers take 32 bit indices
+            throw std::length_error("sell::matrix: too many columns");
+        }
+        if ( (sigma < C) || (sigma % C) ) {
+            throw std::invalid_argument("sell::matrix: sigma must be a positive multiple of C");
+        }
+
+        // by row, via counts
+        std::vector<Index> len(rows, 0);
+        A.for_each_nonzero([&len](Index i, Index, Value) { ++len[i]; });
+        std::vector<std::size_t> rp(rows + 1, 0);
+        for ( Index i = 0; i < rows; ++i ) {
+            rp[i + 1] = rp[i] + len[i];
+        }
+        nnz_ = rp[rows];
+        std::vector<std::int32_t> rc(nnz_);
+        std::vector<Value> rv(nnz_);
+        std::vector<std::size_t> next(rp.begin(), rp.end() - 1);
+        A.for_each_nonzero([&](Index i, Index j, Value v) {
+                rc[next[i]] = std::int32_t(j);
+                rv[next[i]++] = v;
+            });
+
+        // longest rows first within each window
+        std::size_t nslices = (std::size_t(rows) + C - 1) / C;
+        perm_.resize(nslices * C);
+        std::iota(perm_.begin(), perm_.end(), Index(0));
+        for ( Index w = 0; w < rows; w += sigma ) {
+            auto b = perm_.begin() + w, e = perm_.begin() + std::min(w + sigma, rows);
+            std::stable_sort(b, e, [&len](Index a, Index c) { return len[a] > len[c]; });
+        }
+
+        // each slice padded to its longest row, with column -1 (masked off in the kernels)
+        slice_ptr_.assign(nslices + 1, 0);
+        for ( std::size_t s = 0; s < nslices; ++s ) {
+            std::size_t width = 0;
+            for ( int r = 0; r < C; ++r ) {
+                Index i = perm_[s * C + r];
+                if ( i < rows ) {
+                    width = std::max(width, std::size_t(len[i]));
+                }
+            }
+            slice_ptr_[s + 1] = slice_ptr_[s] + width * C;
+        }
+        col_.assign(slice_ptr_[nslices], -1);
+        val_.assign(slice_ptr_[nslices], Value(0));
+        for ( std::size_t s = 0; s < nslices; ++s ) {
+            for ( int r = 0; r < C; ++r ) {
+                Index i = perm_[s * C + r];
+                if ( i >= rows ) {
+                    continue;
+                }
+                for ( std::size_t k = rp[i]; k < rp[i + 1]; ++k ) {
+                    std::size_t at = slice_ptr_[s] + (k - rp[i]) * C + r;
+                    col_[at] = rc[k];
+                    val_[at] = rv[k];
+                }
+            }
+        }
+    }
+
+    Index rows() const { return rows_; }
+    Index cols() const { return cols_; }
+    std::size_t nonzeros() const { return nnz_; }
+
+    // stored entries including padding, over nonzeros(): the cost of the layout
+    double fill() const {
+        return nnz_ ? double(val_.size()) / double(nnz_) : 1.0;
+    }
+
+    // Y = A X for column-major panels: X is cols() x k with leading dimension ldx,
+    // Y is rows() x k with leading dimension ldy
+    void multiply( Value const * X, Index ldx, Value * Y, Index ldy, Index k,
+                   isa w = best_isa() ) const {
+        w = std::min(w, best_isa());
+        for ( Index c = 0; c < k; c += detail::max_block ) {
+            switch ( std::min(Index(detail::max_block), k - c) ) {
+            case 4: block<4>(X + c * ldx, ldx, Y + c * ldy, ldy, w); break;
+            case 3: block<3>(X + c * ldx, ldx, Y + c * ldy, ldy, w); break;
+            case 2: block<2>(X + c * ldx, ldx, Y + c * ldy, ldy, w); break;
+            default: block<1>(X + c * ldx, ldx, Y + c * ldy, ldy, w); break;
+            }
+        }
+    }
+
+private:
+    template<int NB>
+    void block( Value const * X, Index ldx, Value * Y, Index ldy, isa w ) const {
+        Value const * x[NB];
+        for ( int q = 0; q < NB; ++q ) {
+            x[q] = X + q * ldx;
+        }
+        long const nslices = long(slice_ptr_.size()) - 1;
+        bool const parallel = nnz_ * NB >= min_parallel_work;
+        (void)parallel;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64) if (parallel)
+#endif
+        for ( long s = 0; s < nslices; ++s ) {
+            Value y[NB][C];
+            std::size_t off = slice_ptr_[s];
+            detail::slice<NB>(w, col_.data() + off, val_.data() + off, (slice_ptr_[s + 1] - off) / C,
+                              x, y, std::is_same<Value, double>());
+            for ( int r = 0; r < C; ++r ) {
+                Index i = perm_[s * C + r];
+                if ( i < rows_ ) {
+                    for ( int q = 0; q < NB; ++q ) {
+                        Y[i + q * ldy] = y[q][r];
+                    }
+                }
+            }
+        }
+    }
+
+    Index                      rows_, cols_;
+    std::size_t                nnz_;
+    std::vector<Index>         perm_;        // the original row of each slice lane (rows_ or more for padding)
+    std::vector<std::size_t>   slice_ptr_;   // where each slice starts in col_ and val_
+    std::vector<std::int32_t>  col_;
+    std::vector<Value>         val_;
+};
+
+}
+
+#endif // SELL_SPMM_HPP
@@ -0,0 +1,17 @@
+// Scratch storage for repeated solves
+// The caller owns a workspace and passes it back in on every call, so once it has
+// grown to the size of the problem an iteration makes no heap allocations at all.
+// The buffers are only ever resized, which never gives back capacity
+
+#ifndef SOLVE_WORKSPACE_HPP
+#define SOLVE_WORKSPACE_HPP
+
+#include <vector>
+
+template<typename Value>
+struct solve_workspace {
+    std::vector<Value> factor;    // for the triangular solves
+    std::vector<Value> update;    // for low-rank corrections
+};
+
+#endif // SOLVE_WORKSPACE_HPP
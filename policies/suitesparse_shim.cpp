@@ -2,102 +2,622 @@
 
 #include <iostream>
 #include <cassert>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
 
 #include "suitesparse_shim.hpp"
+#include "symbolic_cache.hpp"
 
 namespace SuiteSparse {
 
-// definition of specializations
+namespace {
 
-template<>
-common_wrapper<cholmod_common>::common_wrapper() {
-    cholmod_l_start(&common_);
+// klu_analyze, reusing the orderings from the on-disk symbolic cache (if enabled)
+template<typename Index>
+typename ss_traits<Index>::klu_symbolic_t *
+klu_analysis( cholmod_sparse * A ) {
+    using traits = ss_traits<Index>;
+    Index   n  = A->nrow;
+    Index * Ap = reinterpret_cast<Index*>(A->p);
+    Index * Ai = reinterpret_cast<Index*>(A->i);
+
+    if ( !symbolic_cache::enabled() ) {
+        return traits::analyze( n, Ap, Ai, klu_common<Index>.get() );
+    }
+
+    auto hash = symbolic_cache::pattern_hash( n, Index(A->ncol), Ap, Ai );
+    symbolic_cache::record rec( n, Index(A->ncol), Ap[A->ncol] );
+    if ( symbolic_cache::load( "klu", hash, rec ) && ( rec.arrays.size() == 2 ) &&
+         rec.arrays[0].present && rec.fits( 0, n, 0, n ) &&
+         rec.arrays[1].present && rec.fits( 1, n, 0, n ) ) {
+        // KLU will redo the (cheap) block triangular form search on A(P, Q),
+        // but the matching and fill-reducing ordering come from the cache
+        std::vector<Index> P( rec.arrays[0].data.begin(), rec.arrays[0].data.end() );
+        std::vector<Index> Q( rec.arrays[1].data.begin(), rec.arrays[1].data.end() );
+        return traits::analyze_given( n, Ap, Ai, P.data(), Q.data(), klu_common<Index>.get() );
+    }
+
+    auto S = traits::analyze( n, Ap, Ai, klu_common<Index>.get() );
+    if ( S ) {
+        rec.add_array( S->P, n );
+        rec.add_array( S->Q, n );
+        symbolic_cache::store( "klu", hash, rec );
+    }
+    return S;
+}
+
+// KLU's factors are spread over per-block storage; this asks for them in compressed column form
+// (Rs comes back in pivotal order, which is what lu_file expects)
+template<typename Index>
+struct klu_factors {
+    using traits = ss_traits<Index>;
+
+    klu_factors( Index n_, typename traits::klu_symbolic_t * S, typename traits::klu_numeric_t * N )
+        : n(n_), nblocks(S->nblocks), scaled(N->Rs != nullptr),
+          Lp(n+1), Li(N->lnz), Up(n+1), Ui(N->unz), Fp(n+1), Fi(N->nzoff),
+          P(n), Q(n), R(nblocks+1), Lx(N->lnz), Ux(N->unz), Fx(N->nzoff), Rs(n) {
+        traits::extract( N, S,
+                         Lp.data(), Li.data(), Lx.data(),
+                         Up.data(), Ui.data(), Ux.data(),
+                         Fp.data(), Fi.data(), Fx.data(),
+                         P.data(), Q.data(), Rs.data(), R.data(),
+                         klu_common<Index>.get() );
+    }
+
+    lu_file::factor_view<double, Index> view() const {
+        return lu_file::factor_view<double, Index>{
+            n, P.data(), Q.data(), scaled ? Rs.data() : nullptr, nblocks, R.data(),
+            Lp.data(), Li.data(), Lx.data(), Up.data(), Ui.data(), Ux.data(),
+            Fp.data(), Fi.data(), Fx.data() };
+    }
+
+    Index n, nblocks;
+    bool  scaled;
+    std::vector<Index>  Lp, Li, Up, Ui, Fp, Fi, P, Q, R;
+    std::vector<double> Lx, Ux, Fx, Rs;
+};
+
+// UMFPACK gives L by rows and the diagonal of U on its own; this rearranges its factors
+// into the layout above (one block, L's unit diagonal first in each column and U's
+// diagonal last) so the same solver and file format serve both
+template<typename Index>
+struct umf_factors {
+    using traits = ss_traits<Index>;
+
+    umf_factors( Index n_, void * numeric )
+        : n(n_), Lp(n+1, 0), Up(n+1, 0), P(n), Q(n), D(n), Rs(n) {
+        Index lnz, unz, nrow, ncol, nz_udiag, do_recip = 0;
+        traits::umf_get_lunz( &lnz, &unz, &nrow, &ncol, &nz_udiag, numeric );
+        std::vector<Index>  Rp(n+1), Rj(lnz), Cp(n+1), Ci(unz);
+        std::vector<double> Rx(lnz), Cx(unz);
+        traits::umf_get_numeric( Rp.data(), Rj.data(), Rx.data(), Cp.data(), Ci.data(), Cx.data(),
+                                 P.data(), Q.data(), D.data(), &do_recip, Rs.data(), numeric );
+        // UMFPACK's scale factors are by original row, and multiply when do_recip is
+        // set; lu_file wants divisors in pivotal order
+        std::vector<double> by_row( Rs );
+        for ( Index k = 0; k < n; ++k ) {
+            Rs[k] = do_recip ? 1.0 / by_row[P[k]] : by_row[P[k]];
+        }
+
+        // L by columns, leaving room for the diagonal at the start of each
+        for ( Index i = 0; i < n; ++i ) {
+            for ( Index p = Rp[i]; p < Rp[i+1]; ++p ) {
+                if ( Rj[p] != i ) {
+                    ++Lp[Rj[p] + 1];
+                }
+            }
+        }
+        for ( Index j = 0; j < n; ++j ) {
+            Lp[j+1] += Lp[j] + 1;
+        }
+        Li.resize( Lp[n] );
+        Lx.resize( Lp[n] );
+        std::vector<Index> next( Lp.begin(), Lp.end() - 1 );
+        for ( Index j = 0; j < n; ++j ) {
+            Li[next[j]] = j;
+            Lx[next[j]++] = 1.0;
+        }
+        for ( Index i = 0; i < n; ++i ) {
+            for ( Index p = Rp[i]; p < Rp[i+1]; ++p ) {
+                Index j = Rj[p];
+                if ( j != i ) {
+                    Li[next[j]] = i;
+                    Lx[next[j]++] = Rx[p];
+                }
+            }
+        }
+
+        // U with the diagonal moved to the end of each column
+        Ui.reserve( unz + n );
+        Ux.reserve( unz + n );
+        for ( Index j = 0; j < n; ++j ) {
+            for ( Index p = Cp[j]; p < Cp[j+1]; ++p ) {
+                if ( Ci[p] != j ) {
+                    Ui.push_back( Ci[p] );
+                    Ux.push_back( Cx[p] );
+                }
+            }
+            Ui.push_back( j );
+            Ux.push_back( D[j] );
+            Up[j+1] = Index( Ui.size() );
+        }
+    }
+
+    lu_file::factor_view<double, Index> view() const {
+        return lu_file::factor_view<double, Index>{
+            n, P.data(), Q.data(), Rs.data(), 1, nullptr,
+            Lp.data(), Li.data(), Lx.data(), Up.data(), Ui.data(), Ux.data(),
+            nullptr, nullptr, nullptr };
+    }
+
+    // largest |U_ij| over the largest entry of the scaled (packed) A
+    double growth( cholmod_sparse const * A ) const {
+        Index const *  Ap = static_cast<Index const *>(A->p);
+        Index const *  Ai = static_cast<Index const *>(A->i);
+        double const * Ax = static_cast<double const *>(A->x);
+        std::vector<double> by_row( n );
+        for ( Index k = 0; k < n; ++k ) {
+            by_row[P[k]] = Rs[k];
+        }
+        double amax = 0, umax = 0;
+        for ( Index p = 0; p < Ap[A->ncol]; ++p ) {
+            amax = std::max( amax, std::abs( Ax[p] / by_row[Ai[p]] ) );
+        }
+        for ( double u : Ux ) {
+            umax = std::max( umax, std::abs( u ) );
+        }
+        return ( amax > 0 ) ? umax / amax : 0.0;
+    }
+
+    Index n;
+    std::vector<Index>  Lp, Li, Up, Ui, P, Q;
+    std::vector<double> Lx, Ux, D, Rs;
+};
+
+// KLU takes its pivot tolerance from the common object all our factorizations share,
+// so it is set for the duration of one call and then put back
+template<typename Index>
+struct klu_tolerance {
+    explicit klu_tolerance( double tol ) : c( klu_common<Index>.get() ), saved( c->tol ) {
+        if ( tol >= 0 ) {
+            c->tol = tol;
+        }
+    }
+    ~klu_tolerance() { c->tol = saved; }
+
+    klu_tolerance( klu_tolerance const & ) = delete;
+    klu_tolerance & operator=( klu_tolerance const & ) = delete;
+
+    typename ss_traits<Index>::klu_common_t * c;
+    double saved;
+};
+
+// Copy a (packed) matrix to another index type
+template<typename To, typename From>
+ss_shared_ptr<cholmod_sparse>
+convert_index( ss_shared_ptr<cholmod_sparse> A, std::false_type ) {
+    assert( A->packed );
+    From const * Ap = static_cast<From const *>(A->p);
+    From const * Ai = static_cast<From const *>(A->i);
+    double const * Ax = static_cast<double const *>(A->x);
+    std::size_t nnz = Ap[A->ncol];
+    auto B = make_ss_shared_ptr(
+        ss_traits<To>::allocate_sparse( A->nrow, A->ncol, nnz, A->sorted, 1, A->stype,
+                                        CHOLMOD_REAL, spqr_common<To>.get() ),
+        spqr_common<To> );
+    std::copy( Ap, Ap + A->ncol + 1, static_cast<To *>(B->p) );
+    std::copy( Ai, Ai + nnz, static_cast<To *>(B->i) );
+    std::copy( Ax, Ax + nnz, static_cast<double *>(B->x) );
+    return B;
 }
 
-template<>
-common_wrapper<cholmod_common>::~common_wrapper() {
-    cholmod_l_finish(&common_);
+template<typename To, typename From>
+ss_shared_ptr<cholmod_sparse>
+convert_index( ss_shared_ptr<cholmod_sparse> A, std::true_type ) {
+    return A;
 }
 
-template<>
-common_wrapper<klu_l_common>::common_wrapper() {
-    klu_l_defaults(&common_);
+template<typename To, typename From>
+ss_shared_ptr<cholmod_sparse>
+convert_index( ss_shared_ptr<cholmod_sparse> A ) {
+    return convert_index<To, From>( std::move(A), std::is_same<To, From>() );
+}
+
+}
+
+// SPQR only ever sees the SuiteSparse_long common, whichever Index we use
+template<typename Index, typename Value>
+void
+ShimT<Index, Value>::set_threads( thread_counts const & c ) {
+    if ( c.spqr > 0 ) {
+        spqr_common<SuiteSparse_long>.get()->SPQR_nthreads = c.spqr;
+    }
+    set_blas_threads( c.blas );
+}
+
+// CHOLMOD's counters are per common, and QR uses the SuiteSparse_long one whatever Index is
+template<typename Index, typename Value>
+std::size_t
+ShimT<Index, Value>::memory_in_use() {
+    std::size_t bytes = klu_common<Index>.get()->memusage + spqr_common<Index>.get()->memory_inuse;
+    if ( !std::is_same<Index, SuiteSparse_long>::value ) {
+        bytes += spqr_common<SuiteSparse_long>.get()->memory_inuse;
+    }
+    return bytes;
+}
+
+template<typename Index, typename Value>
+std::size_t
+ShimT<Index, Value>::memory_peak() {
+    std::size_t bytes = klu_common<Index>.get()->mempeak + spqr_common<Index>.get()->memory_usage;
+    if ( !std::is_same<Index, SuiteSparse_long>::value ) {
+        bytes += spqr_common<SuiteSparse_long>.get()->memory_usage;
+    }
+    return bytes;
 }
 
 // sparse matrix constructors
-Shim::sparsemat_t::sparsemat_t( ss_shared_ptr<cholmod_sparse> mat )
+template<typename Index, typename Value>
+ShimT<Index, Value>::sparsemat_t::sparsemat_t( ss_shared_ptr<cholmod_sparse> mat )
     : mat_(mat) {}
 
 
-Shim::sparsemat_t::sparsemat_t( ss_unique_ptr<cholmod_sparse, cholmod_common> && mat )
+template<typename Index, typename Value>
+ShimT<Index, Value>::sparsemat_t::sparsemat_t( ss_unique_ptr<cholmod_sparse, cholmod_common, Index> && mat )
     : mat_(std::move(mat)) {}
 
-std::ostream&
-operator<< ( std::ostream& os, Shim::sparsemat_t const& mat ) {
+template<typename Index, typename Value>
+void
+ShimT<Index, Value>::sparsemat_t::print( std::ostream& os ) const {
     // only works for cout/stdout
     assert( &os == &std::cout );
-    cholmod_l_write_sparse( stdout, mat.wrapped().get(), nullptr, nullptr,
-                            spqr_common.get() );
+    (void)os;
+    traits::write_sparse( stdout, mat_.get(), spqr_common<Index>.get() );
     fflush(stdout);
-    return os;
 }
 
 // definitions for calculation methods
 
 // LU
-Shim::lu_t::lu_t(Shim::sparsemat_t const& mat)
-    : KS_(make_ss_unique_ptr(
-              klu_l_analyze(  mat.wrapped()->nrow,
-                              reinterpret_cast<long*>(mat.wrapped()->p),
-                              reinterpret_cast<long*>(mat.wrapped()->i),
-                              klu_common.get() ),
-              klu_common)),
-      KN_(make_ss_unique_ptr(
-              klu_l_factor(   reinterpret_cast<long*>(mat.wrapped()->p),
-                              reinterpret_cast<long*>(mat.wrapped()->i),
-                              reinterpret_cast<double*>(mat.wrapped()->x),
-                              KS_.get(),
-                              klu_common.get()),
-              klu_common))
-{}
-
-Shim::sparsemat_t
-Shim::lu_t::solve(sparsemat_t const& B) const {
+template<typename Index, typename Value>
+ShimT<Index, Value>::lu_t::lu_t(sparsemat_t const& mat, index_t max_update_rank)
+    : lu_t(mat, lu_options(), max_update_rank) {}
+
+template<typename Index, typename Value>
+ShimT<Index, Value>::lu_t::lu_t(sparsemat_t const& mat, lu_options const& opts, index_t max_update_rank)
+    : mat_(mat), max_update_rank_(max_update_rank), opts_(opts) {
+    factor();
+}
+
+template<typename Index, typename Value>
+ShimT<Index, Value>::lu_t::lu_t( std::shared_ptr<mapped_t const> mapped )
+    : mat_(ss_shared_ptr<cholmod_sparse>()), max_update_rank_(default_max_update_rank),
+      mapped_(std::move(mapped)) {}
+
+template<typename Index, typename Value>
+auto
+ShimT<Index, Value>::lu_t::size() const -> index_t {
+    return mapped_ ? mapped_->size() : index_t(mat_.wrapped()->nrow);
+}
+
+template<typename Index, typename Value>
+std::size_t
+ShimT<Index, Value>::lu_t::estimate_bytes( sparsemat_t const& mat ) {
+    auto S = make_ss_unique_ptr( klu_analysis<Index>( mat.wrapped().get() ), klu_common<Index> );
+    if ( !S ) {
+        throw std::runtime_error( "KLU symbolic analysis failed" );
+    }
+    return std::size_t( S->lnz + S->unz + double( S->nzoff ) ) * ( sizeof(value_t) + sizeof(index_t) );
+}
+
+template<typename Index, typename Value>
+bool
+ShimT<Index, Value>::lu_t::supernodal() const {
+    if ( opts_.method != lu_method::automatic ) {
+        return opts_.method == lu_method::supernodal;
+    }
+    // est_flops is negative when KLU has no estimate
+    if ( !KS_ || ( KS_->est_flops < 0 ) ) {
+        return false;
+    }
+    double entries = KS_->lnz + KS_->unz;
+    return ( entries > 0 ) && ( KS_->est_flops >= opts_.supernodal_intensity * entries );
+}
+
+template<typename Index, typename Value>
+void
+ShimT<Index, Value>::lu_t::factor() {
+    SPARSELIB_TRACE_SCOPE("suitesparse lu factor");
+    KN_.reset();
+    umf_.reset();
+    KS_.reset();
+    if ( opts_.method != lu_method::supernodal ) {
+        KS_ = make_ss_unique_ptr( klu_analysis<Index>( mat_.wrapped().get() ), klu_common<Index> );
+    }
+    if ( supernodal() ) {
+        SPARSELIB_TRACE_SCOPE("suitesparse lu supernodal analysis");
+        umf_.reset( new umf_factor<Index> );
+        if ( opts_.pivot_tolerance >= 0 ) {
+            umf_->control[UMFPACK_PIVOT_TOLERANCE] = opts_.pivot_tolerance;
+        }
+        if ( traits::umf_symbolic( index_t(mat_.wrapped()->nrow),
+                                   reinterpret_cast<index_t*>(mat_.wrapped()->p),
+                                   reinterpret_cast<index_t*>(mat_.wrapped()->i),
+                                   reinterpret_cast<double*>(mat_.wrapped()->x),
+                                   &umf_->symbolic, umf_->control, umf_->info ) != UMFPACK_OK ) {
+            throw std::runtime_error( "UMFPACK symbolic analysis failed" );
+        }
+    }
+    factor_numeric();
+}
+
+template<typename Index, typename Value>
+void
+ShimT<Index, Value>::lu_t::factor_numeric() {
+    KN_.reset();
+    if ( umf_ ) {
+        umf_numeric();
+    } else {
+        klu_tolerance<Index> tol( opts_.pivot_tolerance );
+        KN_ = make_ss_unique_ptr(
+            traits::factor( reinterpret_cast<index_t*>(mat_.wrapped()->p),
+                            reinterpret_cast<index_t*>(mat_.wrapped()->i),
+                            reinterpret_cast<double*>(mat_.wrapped()->x),
+                            KS_.get(),
+                            klu_common<Index>.get()),
+            klu_common<Index>);
+    }
+    factored( false );
+}
+
+template<typename Index, typename Value>
+void
+ShimT<Index, Value>::lu_t::umf_numeric() {
+    SPARSELIB_TRACE_SCOPE("suitesparse lu supernodal factor");
+    traits::umf_free_numeric( &umf_->numeric );
+    auto status = traits::umf_numeric( reinterpret_cast<index_t*>(mat_.wrapped()->p),
+                                       reinterpret_cast<index_t*>(mat_.wrapped()->i),
+                                       reinterpret_cast<double*>(mat_.wrapped()->x),
+                                       umf_->symbolic, &umf_->numeric, umf_->control, umf_->info );
+    if ( status != UMFPACK_OK ) {
+        // singular (a warning to UMFPACK) or out of memory; either way, no usable
+        // factors, just as when klu_factor fails
+        traits::umf_free_numeric( &umf_->numeric );
+    }
+}
+
+template<typename Index, typename Value>
+void
+ShimT<Index, Value>::lu_t::factored( bool static_pivots ) {
+    diag_.static_pivots = static_pivots;
+    diag_.supernodal    = bool( umf_ );
+    if ( umf_ ? !umf_->numeric : !KN_ ) {
+        schedule_.reset();
+        diag_.rcond = diag_.min_pivot = diag_.max_pivot = 0;
+        return;
+    }
+    index_t n = mat_.wrapped()->nrow;
+    if ( umf_ ) {
+        umf_factors<Index> f( n, umf_->numeric );
+        umf_->nonzeros = f.Lp[n] + f.Up[n];
+        schedule_.reset( new level_schedule::lu_solver<value_t, index_t>( f.view() ) );
+        record_pivots( diag_, f.D.begin(), f.D.end() );
+        diag_.pivot_growth = f.growth( mat_.wrapped().get() );
+        return;
+    }
+
+    klu_factors<Index> f( n, KS_.get(), KN_.get() );
+    schedule_.reset( new level_schedule::lu_solver<value_t, index_t>( f.view() ) );
+
+    double const * Udiag = static_cast<double const *>(KN_->Udiag);
+    record_pivots( diag_, Udiag, Udiag + n );
+    auto c = klu_common<Index>.get();
+    if ( traits::rcond( KS_.get(), KN_.get(), c ) ) {
+        diag_.rcond = c->rcond;
+    }
+    if ( traits::rgrowth( reinterpret_cast<index_t*>(mat_.wrapped()->p),
+                          reinterpret_cast<index_t*>(mat_.wrapped()->i),
+                          reinterpret_cast<double*>(mat_.wrapped()->x),
+                          KS_.get(), KN_.get(), c ) ) {
+        diag_.pivot_growth = (c->rgrowth > 0) ? 1.0 / c->rgrowth : 0.0;
+    }
+}
+
+template<typename Index, typename Value>
+void
+ShimT<Index, Value>::lu_t::refactor(sparsemat_t const& mat) {
+    SPARSELIB_TRACE_SCOPE("suitesparse lu refactor");
+    if ( mapped_ ) {
+        throw std::logic_error( "a read-only LU cannot be refactored" );
+    }
+    mat_ = mat;
+    delta_.clear();
+    update_.reset();
+    ++diag_.refactors;
+
+    if ( opts_.static_pivoting && KN_ &&
+         traits::refactor( reinterpret_cast<index_t*>(mat_.wrapped()->p),
+                           reinterpret_cast<index_t*>(mat_.wrapped()->i),
+                           reinterpret_cast<double*>(mat_.wrapped()->x),
+                           KS_.get(), KN_.get(), klu_common<Index>.get() ) ) {
+        factored( true );
+        if ( !pivots_too_small( diag_, opts_ ) ) {
+            return;
+        }
+    }
+
+    // a fresh pivot search (always, for UMFPACK); the pattern, and so the symbolic
+    // analysis, is the same
+    ++diag_.searches;
+    factor_numeric();
+}
+
+template<typename Index, typename Value>
+void
+ShimT<Index, Value>::lu_t::solve_factored(value_t * x, index_t ncols, std::vector<value_t> & w) const {
+    if ( mapped_ ) {
+        mapped_->solve( x, ncols, w );
+        return;
+    }
+
+    // the same arithmetic as klu_solve, but all columns at once and level by level
+    schedule_->solve( x, ncols, w );
+}
+
+template<typename Index, typename Value>
+auto
+ShimT<Index, Value>::lu_t::solve(sparsemat_t const& B) const -> sparsemat_t {
+    SPARSELIB_TRACE_SCOPE("suitesparse lu solve");
     // convert B (right hand side) to a dense matrix
     auto Bdense = make_ss_unique_ptr(
-        cholmod_l_sparse_to_dense( B.wrapped().get(), spqr_common.get() ),
-        spqr_common);
+        traits::sparse_to_dense( B.wrapped().get(), spqr_common<Index>.get() ),
+        spqr_common<Index>);
 
-    klu_l_solve ( KS_.get(),          // Symbolic factorization
-                  KN_.get(),          // Numeric
-                  B.wrapped()->nrow,
-                  B.wrapped()->ncol,
-                  reinterpret_cast<double*>(Bdense->x),
-                  klu_common.get() );
+    workspace_t ws;
+    double * x = reinterpret_cast<double*>(Bdense->x);
+    solve_into( x, B.wrapped()->ncol, x, ws );
 
     // convert to cholmod_sparse
-    return make_ss_unique_ptr( cholmod_l_dense_to_sparse( Bdense.get(), 1, spqr_common.get() ),
-                               spqr_common);
+    return make_ss_unique_ptr( traits::dense_to_sparse( Bdense.get(), 1, spqr_common<Index>.get() ),
+                               spqr_common<Index>);
+}
+
+template<typename Index, typename Value>
+void
+ShimT<Index, Value>::lu_t::solve_into(value_t const * b, index_t ncols, value_t * x, workspace_t & ws) const {
+    SPARSELIB_TRACE_SCOPE("suitesparse lu solve_into");
+    if ( b != x ) {
+        std::copy( b, b + size() * ncols, x );
+    }
+    solve_factored( x, ncols, ws.factor );
+    if ( update_ ) {
+        update_->apply( x, ncols, ws.update );
+    }
+}
+
+template<typename Index, typename Value>
+void
+ShimT<Index, Value>::lu_t::solve_into(sparsemat_t const& rhs, value_t * x, workspace_t & ws) const {
+    // scatter the right hand side into x (instead of making a cholmod_dense), then solve in place
+    cholmod_sparse const * B = rhs.wrapped().get();
+    index_t m = B->nrow, ncols = B->ncol;
+    index_t const * Bp  = static_cast<index_t const *>(B->p);
+    index_t const * Bi  = static_cast<index_t const *>(B->i);
+    index_t const * Bnz = static_cast<index_t const *>(B->nz);
+    double const *  Bx  = static_cast<double const *>(B->x);
+    std::fill( x, x + m * ncols, value_t{0} );
+    for ( index_t j = 0; j < ncols; ++j ) {
+        index_t end = B->packed ? Bp[j+1] : Bp[j] + Bnz[j];
+        for ( index_t k = Bp[j]; k < end; ++k ) {
+            x[j * m + Bi[k]] = Bx[k];
+        }
+    }
+    solve_into( x, ncols, x, ws );
+}
+
+template<typename Index, typename Value>
+void
+ShimT<Index, Value>::lu_t::update(std::vector<triplet_t> const& delta) {
+    workspace_t ws;
+    update( delta, ws );
+}
+
+template<typename Index, typename Value>
+void
+ShimT<Index, Value>::lu_t::update(std::vector<triplet_t> const& delta, workspace_t & ws) {
+    SPARSELIB_TRACE_SCOPE("suitesparse lu update");
+    delta_.insert( delta_.end(), delta.begin(), delta.end() );
+
+    if ( changed_columns( delta_.begin(), delta_.end() ) <= std::size_t(max_update_rank_) ) {
+        update_.reset( new lowrank_update<value_t, index_t>(
+                           size(), delta_.begin(), delta_.end(),
+                           [this, &ws](value_t * x, index_t ncols) {
+                               solve_factored(x, ncols, ws.factor);
+                           }) );
+        if ( !update_->singular() ) {
+            return;
+        }
+    }
+
+    if ( mapped_ ) {
+        throw std::logic_error( "change is too large to apply to a read-only LU" );
+    }
+
+    // too many changes (or a bad correction) - fold them into the matrix and start over
+    index_t n = mat_.wrapped()->nrow;
+    sparsemat_t dG( n, n, delta_.begin(), delta_.end() );
+    double one[2] = {1, 0};
+    mat_ = make_ss_unique_ptr( traits::add( mat_.wrapped().get(), dG.wrapped().get(),
+                                            one, one, 1, 1, spqr_common<Index>.get() ),
+                               spqr_common<Index> );
+    factor();
+    delta_.clear();
+    update_.reset();
+}
+
+template<typename Index, typename Value>
+void
+ShimT<Index, Value>::lu_t::save(std::string const& path) const {
+    SPARSELIB_TRACE_SCOPE("suitesparse lu save");
+    if ( mapped_ || update_ ) {
+        throw std::logic_error( "only a freshly computed LU can be saved" );
+    }
+
+    if ( umf_ ) {
+        umf_factors<Index> f( size(), umf_->numeric );
+        lu_file::write_factor( path, f.view() );
+        return;
+    }
+    klu_factors<Index> f( size(), KS_.get(), KN_.get() );
+    lu_file::write_factor( path, f.view() );
+}
+
+template<typename Index, typename Value>
+auto
+ShimT<Index, Value>::lu_t::load(std::string const& path) -> lu_t {
+    SPARSELIB_TRACE_SCOPE("suitesparse lu load");
+    return lu_t( mapped_t::open( path ) );
 }
 
 // QR
-Shim::qr_t::qr_t( sparsemat_t const & mat ) {
+template<typename Index, typename Value>
+ShimT<Index, Value>::qr_t::qr_t( sparsemat_t const & mat, qr_options const & opts ) {
+    SPARSELIB_TRACE_SCOPE("suitesparse qr factor");
+    using long_t = SuiteSparse_long;
+    auto A = convert_index<long_t, Index>( mat.wrapped() );
+
+    // with a tolerance, ask for just the columns of Q within the rank we find
+    double tol = SPQR_DEFAULT_TOL;
+    long_t econ = 3;
+    if ( opts.tolerance >= 0 ) {
+        tol  = opts.tolerance * max_column_norm( mat );
+        econ = 0;
+    }
+
     cholmod_sparse * Q;   // results
     cholmod_sparse * R;
     // This is kind of ugly :( SuiteSparseQR returns two pointers by reference
     // Not clear what happens if it can allocate one but not the other
-    assert( SuiteSparseQR<double> ( SPQR_ORDERING_DEFAULT, SPQR_DEFAULT_TOL, 3,
-                                    mat.wrapped().get(),
-                                    &Q, &R, nullptr, spqr_common.get() ) >= 0);
+    long_t rank = SuiteSparseQR<double> ( SPQR_ORDERING_DEFAULT, tol, econ,
+                                          A.get(),
+                                          &Q, &R, nullptr, spqr_common<long_t>.get() );
+    assert( rank >= 0 );
+    (void)rank;
 
     // Now we can finally take ownership
-    Q_ = make_ss_shared_ptr( Q, spqr_common );
-    R_ = make_ss_unique_ptr( R, spqr_common );
+    Q_ = convert_index<Index, long_t>( make_ss_shared_ptr( Q, spqr_common<long_t> ) );
+    R_ = make_ss_unique_ptr( R, spqr_common<long_t> );
 }
 
-Shim::sparsemat_t
-Shim::qr_t::Q() const {
+template<typename Index, typename Value>
+auto
+ShimT<Index, Value>::qr_t::Q() const -> sparsemat_t {
     return Q_;
 }
 
+// the flavors we build
+template struct ShimT<int>;
+template struct ShimT<SuiteSparse_long>;
+
 }
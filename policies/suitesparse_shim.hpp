@@ -1,35 +1,149 @@
 // SuiteSparse policy definition
 
+#ifndef SUITESPARSE_SHIM_HPP
+#define SUITESPARSE_SHIM_HPP
+
 #include <memory>
+#include <vector>
+#include <string>
+#include <new>
+#include <cassert>
+#include <type_traits>
 
 #include <SuiteSparseQR.hpp>
 #include <klu.h>
+#include <umfpack.h>
+
+#include "lowrank_update.hpp"
+#include "lu_file.hpp"
+#include "level_schedule.hpp"
+#include "solve_workspace.hpp"
+#include "qr_options.hpp"
+#include "lu_options.hpp"
+#include "trace.hpp"
+#include "triplet_compress.hpp"
+#include "thread_budget.hpp"
 
 namespace SuiteSparse {
 
+// KLU, UMFPACK and CHOLMOD each come in an int and a SuiteSparse_long version (klu_ and
+// klu_l_, umfpack_di_ and umfpack_dl_, cholmod_ and cholmod_l_).  ss_traits picks one by index type, through inline
+// forwarding functions, so there is no cost over calling it directly.
+template<typename Index> struct ss_traits;
+
+#define SUITESPARSE_TRAITS(I, KLU, UMF, CHOLMOD, ITYPE)                                        \
+template<> struct ss_traits<I> {                                                               \
+    using klu_symbolic_t = KLU##symbolic;                                                      \
+    using klu_numeric_t  = KLU##numeric;                                                       \
+    using klu_common_t   = KLU##common;                                                        \
+    static constexpr int itype = ITYPE;                                                        \
+                                                                                               \
+    static void start(cholmod_common * c) { CHOLMOD##start(c); }                               \
+    static void start(klu_common_t * c) { KLU##defaults(c); }                                  \
+    static void finish(cholmod_common * c) { CHOLMOD##finish(c); }                             \
+    static void finish(klu_common_t *) {}                                                      \
+                                                                                               \
+    /* the free routines want to null out the caller's pointer, so give them a copy */         \
+    static void free(cholmod_triplet * p, cholmod_common * c) { CHOLMOD##free_triplet(&p, c); } \
+    static void free(cholmod_sparse * p, cholmod_common * c) { CHOLMOD##free_sparse(&p, c); }   \
+    static void free(cholmod_dense * p, cholmod_common * c) { CHOLMOD##free_dense(&p, c); }     \
+    static void free(klu_symbolic_t * p, klu_common_t * c) { KLU##free_symbolic(&p, c); }      \
+    static void free(klu_numeric_t * p, klu_common_t * c) { KLU##free_numeric(&p, c); }        \
+                                                                                               \
+    static cholmod_triplet * allocate_triplet(size_t nrow, size_t ncol, size_t nzmax, int stype, \
+                                              int xtype, cholmod_common * c) {                 \
+        return CHOLMOD##allocate_triplet(nrow, ncol, nzmax, stype, xtype, c);                  \
+    }                                                                                          \
+    static cholmod_sparse * allocate_sparse(size_t nrow, size_t ncol, size_t nzmax, int sorted, \
+                                            int packed, int stype, int xtype, cholmod_common * c) { \
+        return CHOLMOD##allocate_sparse(nrow, ncol, nzmax, sorted, packed, stype, xtype, c);   \
+    }                                                                                          \
+    static cholmod_sparse * triplet_to_sparse(cholmod_triplet * T, size_t nzmax, cholmod_common * c) { \
+        return CHOLMOD##triplet_to_sparse(T, nzmax, c);                                        \
+    }                                                                                          \
+    static cholmod_dense * sparse_to_dense(cholmod_sparse * A, cholmod_common * c) {           \
+        return CHOLMOD##sparse_to_dense(A, c);                                                 \
+    }                                                                                          \
+    static cholmod_sparse * dense_to_sparse(cholmod_dense * X, int values, cholmod_common * c) { \
+        return CHOLMOD##dense_to_sparse(X, values, c);                                         \
+    }                                                                                          \
+    static cholmod_sparse * add(cholmod_sparse * A, cholmod_sparse * B, double alpha[2],       \
+                                double beta[2], int values, int sorted, cholmod_common * c) {  \
+        return CHOLMOD##add(A, B, alpha, beta, values, sorted, c);                             \
+    }                                                                                          \
+    static cholmod_sparse * ssmult(cholmod_sparse * A, cholmod_sparse * B, int stype, int values, \
+                                   int sorted, cholmod_common * c) {                           \
+        return CHOLMOD##ssmult(A, B, stype, values, sorted, c);                                \
+    }                                                                                          \
+    static int write_sparse(FILE * f, cholmod_sparse * A, cholmod_common * c) {               \
+        return CHOLMOD##write_sparse(f, A, nullptr, nullptr, c);                               \
+    }                                                                                          \
+                                                                                               \
+    static klu_symbolic_t * analyze(I n, I * Ap, I * Ai, klu_common_t * c) {                   \
+        return KLU##analyze(n, Ap, Ai, c);                                                     \
+    }                                                                                          \
+    static klu_symbolic_t * analyze_given(I n, I * Ap, I * Ai, I * P, I * Q, klu_common_t * c) { \
+        return KLU##analyze_given(n, Ap, Ai, P, Q, c);                                         \
+    }                                                                                          \
+    static klu_numeric_t * factor(I * Ap, I * Ai, double * Ax, klu_symbolic_t * S, klu_common_t * c) { \
+        return KLU##factor(Ap, Ai, Ax, S, c);                                                  \
+    }                                                                                          \
+    static I refactor(I * Ap, I * Ai, double * Ax, klu_symbolic_t * S, klu_numeric_t * N, klu_common_t * c) { \
+        return KLU##refactor(Ap, Ai, Ax, S, N, c);                                             \
+    }                                                                                          \
+    static I rcond(klu_symbolic_t * S, klu_numeric_t * N, klu_common_t * c) {                  \
+        return KLU##rcond(S, N, c);                                                            \
+    }                                                                                          \
+    static I rgrowth(I * Ap, I * Ai, double * Ax, klu_symbolic_t * S, klu_numeric_t * N, klu_common_t * c) { \
+        return KLU##rgrowth(Ap, Ai, Ax, S, N, c);                                              \
+    }                                                                                          \
+    static I solve(klu_symbolic_t * S, klu_numeric_t * N, I ldim, I nrhs, double * B, klu_common_t * c) { \
+        return KLU##solve(S, N, ldim, nrhs, B, c);                                             \
+    }                                                                                          \
+    static I extract(klu_numeric_t * N, klu_symbolic_t * S,                                    \
+                     I * Lp, I * Li, double * Lx, I * Up, I * Ui, double * Ux,                 \
+                     I * Fp, I * Fi, double * Fx, I * P, I * Q, double * Rs, I * R,            \
+                     klu_common_t * c) {                                                       \
+        return KLU##extract(N, S, Lp, Li, Lx, Up, Ui, Ux, Fp, Fi, Fx, P, Q, Rs, R, c);         \
+    }                                                                                          \
+                                                                                               \
+    static void umf_defaults(double * control) { UMF##defaults(control); }                    \
+    static I umf_symbolic(I n, I const * Ap, I const * Ai, double const * Ax, void ** S,       \
+                          double const * control, double * info) {                             \
+        return UMF##symbolic(n, n, Ap, Ai, Ax, S, control, info);                              \
+    }                                                                                          \
+    static I umf_numeric(I const * Ap, I const * Ai, double const * Ax, void * S, void ** N,   \
+                         double const * control, double * info) {                              \
+        return UMF##numeric(Ap, Ai, Ax, S, N, control, info);                                  \
+    }                                                                                          \
+    static void umf_free_symbolic(void ** S) { UMF##free_symbolic(S); }                        \
+    static void umf_free_numeric(void ** N) { UMF##free_numeric(N); }                          \
+    static I umf_get_lunz(I * lnz, I * unz, I * nrow, I * ncol, I * nz_udiag, void * N) {      \
+        return UMF##get_lunz(lnz, unz, nrow, ncol, nz_udiag, N);                               \
+    }                                                                                          \
+    static I umf_get_numeric(I * Lp, I * Lj, double * Lx, I * Up, I * Ui, double * Ux,         \
+                             I * P, I * Q, double * D, I * do_recip, double * Rs, void * N) {  \
+        return UMF##get_numeric(Lp, Lj, Lx, Up, Ui, Ux, P, Q, D, do_recip, Rs, N);             \
+    }                                                                                          \
+}
+
+SUITESPARSE_TRAITS(int, klu_, umfpack_di_, cholmod_, CHOLMOD_INT);
+SUITESPARSE_TRAITS(SuiteSparse_long, klu_l_, umfpack_dl_, cholmod_l_, CHOLMOD_LONG);
+
+#undef SUITESPARSE_TRAITS
+
 // utility classes
 
 // wrapping SuiteSparse memory allocation
-template<typename Common>
+template<typename Common, typename Index>
 struct ss_deleter {
     ss_deleter() : cc_(nullptr) {}
 
     ss_deleter(Common * cc) : cc_(cc) {}
 
-    void operator()(cholmod_triplet *& p) const {
-        cholmod_l_free_triplet(&p, cc_);
-    }
-    void operator()(cholmod_sparse *& p) const {
-        cholmod_l_free_sparse(&p, cc_);
-    }
-    void operator()(cholmod_dense *& p) const {
-        cholmod_l_free_dense(&p, cc_);
-    }
-    void operator()(klu_l_symbolic *& p) const {
-        klu_l_free_symbolic (&p, cc_);
-    }
-    void operator()(klu_l_numeric *& p) const {
-        klu_l_free_numeric (&p, cc_);
+    template<typename T>
+    void operator()(T * p) const {
+        ss_traits<Index>::free(p, cc_);
     }
 
 private:
@@ -37,13 +151,13 @@ private:
 
 };
 
-template<typename T, typename Common>
-using ss_unique_ptr = std::unique_ptr<T, ss_deleter<Common>>;
+template<typename T, typename Common, typename Index>
+using ss_unique_ptr = std::unique_ptr<T, ss_deleter<Common, Index>>;
 
 template<typename T, typename Common>
-ss_unique_ptr<T, typename Common::wrapped_t>
+ss_unique_ptr<T, typename Common::wrapped_t, typename Common::index_t>
 make_ss_unique_ptr( T* p, Common & c ) {
-    return ss_unique_ptr<T, typename Common::wrapped_t>(p, c.get());
+    return ss_unique_ptr<T, typename Common::wrapped_t, typename Common::index_t>(p, c.get());
 }
 
 template<typename T>
@@ -52,20 +166,41 @@ using ss_shared_ptr = std::shared_ptr<T>;
 template<typename T, typename Common>
 ss_shared_ptr<T>
 make_ss_shared_ptr( T* p, Common & c ) {
-    return ss_shared_ptr<T>(p, ss_deleter<typename Common::wrapped_t>(c.get()));
+    return ss_shared_ptr<T>(p, ss_deleter<typename Common::wrapped_t, typename Common::index_t>(c.get()));
 }
 
+// UMFPACK has no common object; its analysis and factors are opaque pointers, each
+// with its own free routine, and its settings an array passed to every call
+template<typename Index>
+struct umf_factor {
+    umf_factor() { ss_traits<Index>::umf_defaults(control); }
+    ~umf_factor() {
+        ss_traits<Index>::umf_free_numeric(&numeric);
+        ss_traits<Index>::umf_free_symbolic(&symbolic);
+    }
+
+    umf_factor( umf_factor const & ) = delete;
+    umf_factor & operator=( umf_factor const & ) = delete;
+
+    void * symbolic = nullptr;
+    void * numeric  = nullptr;
+    Index  nonzeros = 0;            // in L and U, once numeric is computed
+    double control[UMFPACK_CONTROL];
+    double info[UMFPACK_INFO];
+};
+
 // Define a wrapper for SuiteSparse "common" objects
 // takes care of calling start and finish cleanly,
 // and supplies a deleter (which needs a common reference)
 
-template<typename Common>
+template<typename Common, typename Index>
 struct common_wrapper {
 
     using wrapped_t = Common;
+    using index_t = Index;
 
-    common_wrapper() {}
-    ~common_wrapper() {}
+    common_wrapper() { ss_traits<Index>::start(&common_); }
+    ~common_wrapper() { ss_traits<Index>::finish(&common_); }
 
     // no copies, no assignments
     common_wrapper(common_wrapper const& other) = delete;
@@ -75,8 +210,8 @@ struct common_wrapper {
         return &common_;
     }
 
-    ss_deleter<Common> deleter() {
-        return ss_deleter<Common>(&common_);
+    ss_deleter<Common, Index> deleter() {
+        return ss_deleter<Common, Index>(&common_);
     }
 
     private:
@@ -84,15 +219,6 @@ struct common_wrapper {
     Common common_;
 };
 
-// specialize constructor/destructor for the different kinds of common objects
-// to call the appropriate C routine
-template<>
-common_wrapper<cholmod_common>::common_wrapper();
-template<>
-common_wrapper<cholmod_common>::~common_wrapper();
-template<>
-common_wrapper<klu_l_common>::common_wrapper();
-
 
 // SPQR and KLU both require the use of a "common" object that gets passed in
 // to each method call.  It seems like it the options for handling this are:
@@ -103,13 +229,35 @@ common_wrapper<klu_l_common>::common_wrapper();
 //    (also a Concept change)
 // None of these options make me happy.  For now I'm just going to do item 1)
 // since this is an exercise anyway.
+// There is one of each per index type, since CHOLMOD records the type in its common.
+
+template<typename Index>
+common_wrapper<typename ss_traits<Index>::klu_common_t, Index> klu_common;
+template<typename Index>
+common_wrapper<cholmod_common, Index> spqr_common;
+
+// Index selects the int or SuiteSparse_long routines: 32 bit indices for most matrices,
+// 64 bit for those with more than 2^31 nonzeros in the matrix or its factors.
+// SPQR only has a SuiteSparse_long version, so QR converts when Index is int
+template<typename Index = SuiteSparse_long, typename Value = double>
+struct ShimT {
+    static_assert(std::is_same<Value, double>::value, "only real matrices are wrapped so far");
+
+    using value_t = Value;
+    using index_t = Index;
 
-static common_wrapper<klu_l_common> klu_common;
-static common_wrapper<cholmod_common> spqr_common;
+    using traits = ss_traits<index_t>;
+    using klu_common_t = typename traits::klu_common_t;
 
-struct Shim {
-    using value_t = double;
-    using index_t = long;    // Compatible with "_l" functions
+    // every object shares the common structures above, so calls must not overlap
+    static constexpr bool thread_safe = false;
+
+    // SPQR's fronts (when built with TBB) and the BLAS under SPQR and CHOLMOD
+    static void set_threads( thread_counts const & c );
+
+    // What KLU and CHOLMOD have allocated now, and at most so far, by their own counters
+    static std::size_t memory_in_use();
+    static std::size_t memory_peak();
 
     struct triplet_t {
         index_t row;
@@ -121,66 +269,195 @@ struct Shim {
         template<typename Iter>
         sparsemat_t( index_t rows, index_t cols,
                      Iter first, Iter last ) {
-            // load into "triplet matrix"
-            auto Gct = make_ss_unique_ptr(
-                cholmod_l_allocate_triplet(
-                    rows, cols, std::distance(first, last),
-                    0,  // stype: both upper and lower are stored
-                    CHOLMOD_REAL,
-                    spqr_common.get()),
-                spqr_common);
-            for ( Iter it = first; it < last; ++it) {
-                index_t idx = std::distance(first, it);
-                reinterpret_cast<long *>(Gct->i)[idx]   = it->row;
-                reinterpret_cast<long *>(Gct->j)[idx]   = it->col;
-                reinterpret_cast<double *>(Gct->x)[idx] = it->value;
-            }
-            Gct->nnz = std::distance(first, last);
-
-            // convert triplet matrix to sparse
-            mat_ = make_ss_unique_ptr(
-                cholmod_l_triplet_to_sparse(Gct.get(), std::distance(first, last), spqr_common.get()),
-                spqr_common);
+            SPARSELIB_TRACE_SCOPE("suitesparse compress");
+            // straight into a packed, sorted cholmod_sparse, duplicates summed
+            ss_unique_ptr<cholmod_sparse, cholmod_common, Index> A;
+            triplet_compress::compress<index_t, value_t>(
+                rows, cols, first, last,
+                [&A, rows, cols](index_t nnz) {
+                    A = make_ss_unique_ptr(
+                        traits::allocate_sparse(rows, cols, nnz, 1, 1,
+                                                0,  // stype: both upper and lower are stored
+                                                CHOLMOD_REAL, spqr_common<Index>.get()),
+                        spqr_common<Index>);
+                    if ( !A ) {
+                        throw std::bad_alloc();
+                    }
+                    return triplet_compress::csc_arrays<index_t, value_t>{
+                        static_cast<index_t *>(A->p), static_cast<index_t *>(A->i), static_cast<value_t *>(A->x)};
+                });
+            mat_ = std::move(A);
         }
 
         sparsemat_t( ss_shared_ptr<cholmod_sparse> );
 
-        sparsemat_t( ss_unique_ptr<cholmod_sparse, cholmod_common> && );
+        sparsemat_t( ss_unique_ptr<cholmod_sparse, cholmod_common, Index> && );
 
-        friend sparsemat_t operator*(sparsemat_t const& a, sparsemat_t const& b);
-        friend std::ostream& operator<<(std::ostream& os, sparsemat_t const & m);
+        friend sparsemat_t operator*(sparsemat_t const& a, sparsemat_t const& b) {
+            return make_ss_unique_ptr( traits::ssmult( a.mat_.get(), b.mat_.get(), 0, 1, 1,
+                                                       spqr_common<Index>.get() ),
+                                       spqr_common<Index> );
+        }
+        friend std::ostream& operator<<(std::ostream& os, sparsemat_t const & m) {
+            m.print(os);
+            return os;
+        }
 
         ss_shared_ptr<cholmod_sparse> wrapped() const {
             return mat_;
         }
 
+        index_t rows() const { return index_t(mat_->nrow); }
+        index_t cols() const { return index_t(mat_->ncol); }
+
+        // the stored values, in the order for_each_nonzero visits them, for changing
+        // values in place.  Copies of this matrix (including the ones inside lu_t) share them
+        value_t * value_data() {
+            assert( mat_->packed );
+            return static_cast<value_t *>(mat_->x);
+        }
+
+        // visit each stored entry as f(row, col, value)
+        template<typename F>
+        void for_each_nonzero( F && f ) const {
+            index_t const * p  = static_cast<index_t const *>(mat_->p);
+            index_t const * i  = static_cast<index_t const *>(mat_->i);
+            index_t const * nz = static_cast<index_t const *>(mat_->nz);
+            double const *  x  = static_cast<double const *>(mat_->x);
+            for ( index_t j = 0; j < index_t(mat_->ncol); ++j ) {
+                index_t end = mat_->packed ? p[j+1] : p[j] + nz[j];
+                for ( index_t k = p[j]; k < end; ++k ) {
+                    f(i[k], j, x[k]);
+                }
+            }
+        }
+
     private:
+        void print(std::ostream& os) const;
+
         ss_shared_ptr<cholmod_sparse> mat_;
 
     };
 
     struct lu_t {
-        lu_t( sparsemat_t const & mat );
+        // update() refactors instead once the change touches more columns than this
+        static constexpr index_t default_max_update_rank = 32;
+
+        lu_t( sparsemat_t const & mat, index_t max_update_rank = default_max_update_rank );
+
+        // Without a pivot tolerance, KLU's default (0.001) applies (UMFPACK's, 0.1, for
+        // supernodal factors).  With lu_method::automatic, matrices whose elimination is
+        // dense enough (by KLU's estimate of flops per factor entry) go to UMFPACK, which
+        // does its updates as BLAS-3 on frontal matrices; the rest stay with KLU
+        lu_t( sparsemat_t const & mat, lu_options const & opts,
+              index_t max_update_rank = default_max_update_rank );
+
+        using workspace_t = solve_workspace<value_t>;
 
         sparsemat_t solve(sparsemat_t const& rhs) const;
 
+        // Solve into caller-owned dense column-major storage (size x ncols), taking scratch
+        // space from "ws".  Given the same workspace each time, repeated calls don't allocate.
+        // b and x may be the same
+        void solve_into(value_t const * b, index_t ncols, value_t * x, workspace_t & ws) const;
+        void solve_into(sparsemat_t const& rhs, value_t * x, workspace_t & ws) const;
+
+        // entries in L, U and the off-diagonal blocks; each costs a multiply and an add per solved column
+        index_t factor_nonzeros() const {
+            return mapped_ ? mapped_->nonzeros() :
+                umf_ ? umf_->nonzeros : KN_->lnz + KN_->unz + KN_->nzoff;
+        }
+
+        // Bytes the factors of mat should take, from klu_analyze's estimates of the entries
+        // in L and U (plus the off-diagonal blocks, which are copied from mat)
+        static std::size_t estimate_bytes(sparsemat_t const& mat);
+
+        // Add "delta" (e.g. the changed stamps of a few elements) to the factored matrix.
+        // Small changes become a low-rank correction applied during solves; large ones
+        // are folded into the matrix, which is then refactored
+        void update(std::vector<triplet_t> const& delta);
+        // the same, taking scratch space for the solves that build the correction from "ws"
+        void update(std::vector<triplet_t> const& delta, workspace_t & ws);
+
+        // Factor new values with the pattern already factored (mat may be the same matrix,
+        // its values changed in place).  Any update()s are discarded.  With static pivoting
+        // this is klu_refactor, which keeps the pivot order and the symbolic analysis;
+        // supernodal factors always search again, reusing UMFPACK's symbolic analysis
+        void refactor(sparsemat_t const& mat);
+
+        // rcond from klu_rcond, pivot growth from klu_rgrowth (by column: its reciprocal).
+        // For supernodal factors, rcond is the rough one from the pivots
+        lu_diagnostics const & diagnostics() const { return diag_; }
+
+        // Write the factors to a file, for later use by load()
+        void save(std::string const& path) const;
+
+        // Map a saved factorization back in, read-only.  The result solves straight
+        // out of the mapping; it accepts small updates but cannot be refactored
+        static lu_t load(std::string const& path);
+
     private:
-        ss_unique_ptr<klu_l_symbolic, klu_l_common> KS_;
-        ss_unique_ptr<klu_l_numeric, klu_l_common>  KN_;
+        using mapped_t = lu_file::mapped_factor<value_t, index_t>;
+
+        explicit lu_t( std::shared_ptr<mapped_t const> mapped );
+
+        void factor();
+
+        // klu_factor (or umfpack_numeric) with the symbolic analysis we have
+        void factor_numeric();
+        void umf_numeric();
+
+        // whether the KLU analysis in KS_ says the elimination is dense enough for UMFPACK
+        bool supernodal() const;
+
+        // level sets and diagnostics for newly computed KN_ or umf_
+        void factored( bool static_pivots );
+
+        index_t size() const;
+
+        // overwrite dense column-major data with the solution, ignoring any update
+        void solve_factored(value_t * x, index_t ncols, std::vector<value_t> & w) const;
+
+        sparsemat_t    mat_;          // what KS_ and KN_ describe
+        index_t        max_update_rank_;
+        lu_options     opts_;
+        lu_diagnostics diag_;
+
+        ss_unique_ptr<typename traits::klu_symbolic_t, klu_common_t, Index> KS_;
+        ss_unique_ptr<typename traits::klu_numeric_t, klu_common_t, Index>  KN_;
+        std::unique_ptr<umf_factor<Index>> umf_;     // instead of KN_, for supernodal factors
+
+        // level sets of the extracted factors, computed once per factorization
+        // so solves can run in parallel (klu_solve is strictly sequential)
+        std::unique_ptr<level_schedule::lu_solver<value_t, index_t>> schedule_;
+
+        std::shared_ptr<mapped_t const> mapped_;     // instead of the above, when loaded
+
+        std::vector<triplet_t> delta_;   // accumulated changes since the last factor
+        std::unique_ptr<lowrank_update<value_t, index_t>> update_;
 
     };
 
     struct qr_t {
-        qr_t( sparsemat_t const & mat );
+        // SPQR finds the rank as it goes (Heath's method), dropping columns whose norm
+        // falls below its tolerance, so it needs no separate pivoting
+        qr_t( sparsemat_t const & mat, qr_options const & opts = qr_options() );
 
         sparsemat_t Q() const;
 
     private:
         ss_shared_ptr<cholmod_sparse> Q_;
-        ss_unique_ptr<cholmod_sparse, cholmod_common>  R_;
+        ss_unique_ptr<cholmod_sparse, cholmod_common, SuiteSparse_long> R_;
     };
 
 };
 
+extern template struct ShimT<int>;
+extern template struct ShimT<SuiteSparse_long>;
+
+using Shim   = ShimT<>;
+using Shim32 = ShimT<int>;
 
 }
+
+#endif // SUITESPARSE_SHIM_HPP
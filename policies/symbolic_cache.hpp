@@ -0,0 +1,194 @@
+// On-disk cache of symbolic analyses (orderings, elimination trees, etc.)
+// keyed by a hash of the sparsity pattern they were computed from
+// Each policy decides what goes into a record and how to rebuild its own
+// symbolic object from one; this file only knows about arrays of integers.
+
+#ifndef SYMBOLIC_CACHE_HPP
+#define SYMBOLIC_CACHE_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include <unistd.h>
+
+namespace symbolic_cache {
+
+// One cached analysis: some integer arrays (permutations, trees, counts) and a few scalars
+// A missing (null) array is distinguished from an empty one.  The shape of the pattern
+// is kept too, so a hash collision or a stale file can't hand back arrays of the wrong size
+struct record {
+    struct array {
+        bool                      present;
+        std::vector<std::int64_t> data;
+    };
+    std::vector<array>  arrays;
+    std::vector<double> scalars;
+    std::int64_t        rows = 0, cols = 0, nonzeros = 0;
+
+    record() = default;
+    record( std::int64_t r, std::int64_t c, std::int64_t nnz ) : rows(r), cols(c), nonzeros(nnz) {}
+
+    template<typename Index>
+    void add_array(Index const * p, std::int64_t len) {
+        arrays.push_back(array{p != nullptr, p ? std::vector<std::int64_t>(p, p + len)
+                                               : std::vector<std::int64_t>()});
+    }
+
+    // whether array i is absent, or has len entries, all in [lo, hi)
+    bool fits( std::size_t i, std::int64_t len, std::int64_t lo, std::int64_t hi ) const {
+        array const & a = arrays[i];
+        if ( !a.present ) {
+            return true;
+        }
+        if ( std::int64_t(a.data.size()) != len ) {
+            return false;
+        }
+        for ( std::int64_t v : a.data ) {
+            if ( (v < lo) || (v >= hi) ) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Where records live.  Empty means caching is off; the default comes from
+// the environment variable SPARSELIB_SYMBOLIC_CACHE
+inline std::string & directory() {
+    static std::string dir = [] {
+        char const * env = std::getenv("SPARSELIB_SYMBOLIC_CACHE");
+        return std::string(env ? env : "");
+    }();
+    return dir;
+}
+
+inline void set_directory( std::string dir ) { directory() = std::move(dir); }
+
+inline bool enabled() { return !directory().empty(); }
+
+// Identify a compressed column structure.  Indices are widened first so a
+// pattern hashes the same regardless of the index type that stores it
+template<typename Index>
+std::uint64_t
+pattern_hash( Index rows, Index cols, Index const * colptr, Index const * rowind ) {
+    std::uint64_t h = 14695981039346656037ull;     // FNV-1a, applied to whole words
+    auto mix = [&h](std::int64_t v) {
+        h ^= static_cast<std::uint64_t>(v);
+        h *= 1099511628211ull;
+    };
+    mix(rows);
+    mix(cols);
+    for ( Index j = 0; j <= cols; ++j ) {
+        mix(colptr[j]);
+    }
+    for ( Index k = 0; k < colptr[cols]; ++k ) {
+        mix(rowind[k]);
+    }
+    return h;
+}
+
+namespace detail {
+
+constexpr std::uint64_t magic = 0x324d5953504c5053ull;   // "SPLPSYM2"
+
+inline std::string
+filename( std::string const & kind, std::uint64_t hash ) {
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+    return directory() + "/" + kind + "-" + hex + ".sym";
+}
+
+template<typename T>
+void put( std::ostream & os, T const & v ) {
+    os.write(reinterpret_cast<char const *>(&v), sizeof(T));
+}
+
+template<typename T>
+bool get( std::istream & is, T & v ) {
+    return bool(is.read(reinterpret_cast<char *>(&v), sizeof(T)));
+}
+
+}
+
+// Look up the analysis of type "kind" (e.g. "cs-lu") for a pattern.  rec comes in with
+// the shape of the pattern; a record made for any other shape is a miss
+inline bool
+load( std::string const & kind, std::uint64_t hash, record & rec ) {
+    using namespace detail;
+    if ( !enabled() ) {
+        return false;
+    }
+    std::ifstream is(filename(kind, hash), std::ios::binary);
+    std::uint64_t m, h, nscalars, narrays;
+    std::int64_t rows, cols, nonzeros;
+    if ( !is || !get(is, m) || (m != magic) || !get(is, h) || (h != hash) ||
+         !get(is, rows) || (rows != rec.rows) || !get(is, cols) || (cols != rec.cols) ||
+         !get(is, nonzeros) || (nonzeros != rec.nonzeros) ||
+         !get(is, nscalars) || !get(is, narrays) ) {
+        return false;
+    }
+    rec.scalars.resize(nscalars);
+    for ( auto & s : rec.scalars ) {
+        if ( !get(is, s) ) {
+            return false;
+        }
+    }
+    rec.arrays.resize(narrays);
+    for ( auto & a : rec.arrays ) {
+        std::int64_t len;
+        if ( !get(is, len) ) {
+            return false;
+        }
+        a.present = (len >= 0);
+        a.data.resize(a.present ? len : 0);
+        if ( !is.read(reinterpret_cast<char *>(a.data.data()),
+                      a.data.size() * sizeof(std::int64_t)) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Save an analysis.  Written to a temporary and renamed into place, so concurrent
+// jobs never see a partial record
+inline void
+store( std::string const & kind, std::uint64_t hash, record const & rec ) {
+    using namespace detail;
+    if ( !enabled() ) {
+        return;
+    }
+    std::string fn = filename(kind, hash);
+    std::string tmp = fn + ".tmp" + std::to_string(::getpid()) + "-" +
+        std::to_string(reinterpret_cast<std::uintptr_t>(&rec));
+    {
+        std::ofstream os(tmp, std::ios::binary);
+        put(os, magic);
+        put(os, hash);
+        put(os, rec.rows);
+        put(os, rec.cols);
+        put(os, rec.nonzeros);
+        put(os, std::uint64_t(rec.scalars.size()));
+        put(os, std::uint64_t(rec.arrays.size()));
+        for ( double s : rec.scalars ) {
+            put(os, s);
+        }
+        for ( auto const & a : rec.arrays ) {
+            put(os, a.present ? std::int64_t(a.data.size()) : std::int64_t(-1));
+            os.write(reinterpret_cast<char const *>(a.data.data()),
+                     a.data.size() * sizeof(std::int64_t));
+        }
+        if ( !os ) {
+            std::remove(tmp.c_str());
+            return;     // a cache that can't be written is just a cache miss next time
+        }
+    }
+    std::rename(tmp.c_str(), fn.c_str());
+}
+
+}
+
+#endif // SYMBOLIC_CACHE_HPP
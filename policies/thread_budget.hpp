@@ -0,0 +1,109 @@
+// How many threads each library may use, from one budget
+//
+// Several layers can run in parallel at once: the pipeline runs nets side by side,
+// our own loops (level schedules, compression, SELL products) use OpenMP, Eigen's
+// products follow OpenMP too, SPQR uses TBB for its fronts, and the BLAS underneath
+// CHOLMOD and SPQR (OpenBLAS, usually) starts its own threads.  Left alone, each one
+// assumes it has the whole machine.  A thread_budget holds the number of cores to be
+// used, and share() splits it between jobs running concurrently: with as many jobs as
+// cores each job gets one thread (all the parallelism is across jobs), with a single
+// job it gets them all.
+//
+// apply_threads<L>() sets the counts.  The OpenMP count belongs to the calling thread;
+// the others are process-wide.  A library policy takes part by declaring
+//     static void set_threads( thread_counts const & );
+// Zero in any count means "leave it as it is".
+
+#ifndef THREAD_BUDGET_HPP
+#define THREAD_BUDGET_HPP
+
+#include <mutex>
+#include <thread>
+#include <cstddef>
+#include <algorithm>
+#include <type_traits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// present only if OpenBLAS is linked in
+extern "C" void openblas_set_num_threads( int ) __attribute__((weak));
+
+struct thread_counts {
+    int openmp = 0;     // the calling thread's parallel regions (ours, and Eigen's by default)
+    int eigen  = 0;     // Eigen::setNbThreads, which overrides OpenMP for every thread
+    int blas   = 0;     // OpenBLAS
+    int spqr   = 0;     // SPQR_nthreads in the SPQR common object
+};
+
+class thread_budget {
+public:
+    explicit thread_budget( unsigned total = std::max(1u, std::thread::hardware_concurrency()) )
+        : total_(std::max(1u, total)) {}
+
+    unsigned total() const { return total_; }
+
+    // Counts for each of "jobs" jobs running at the same time.  Eigen is left to follow
+    // OpenMP, since its own setting would be shared by every job
+    thread_counts share( std::size_t jobs ) const {
+        int per_job = int(std::max(std::size_t(1), total_ / std::max(std::size_t(1), jobs)));
+        thread_counts c;
+        c.openmp = per_job;
+        c.blas   = per_job;
+        c.spqr   = per_job;
+        return c;
+    }
+
+private:
+    unsigned total_;
+};
+
+inline void
+set_openmp_threads( int n ) {
+#ifdef _OPENMP
+    if ( n > 0 ) {
+        omp_set_num_threads(n);
+    }
+#else
+    (void)n;
+#endif
+}
+
+inline void
+set_blas_threads( int n ) {
+    if ( (n > 0) && openblas_set_num_threads ) {
+        openblas_set_num_threads(n);
+    }
+}
+
+template<typename... T> struct threads_void { using type = void; };
+
+// whether L declares set_threads
+template<typename L, typename = void>
+struct library_threads : std::false_type {
+    static void set( thread_counts const & ) {}
+};
+
+template<typename L>
+struct library_threads<L, typename threads_void<decltype(L::set_threads(std::declval<thread_counts const &>()))>::type>
+    : std::true_type {
+    static void set( thread_counts const & c ) { L::set_threads(c); }
+};
+
+// The process-wide settings are changed one caller at a time, and only when they differ
+// from what was last applied
+template<typename L>
+void
+apply_threads( thread_counts const & c ) {
+    set_openmp_threads(c.openmp);
+    static std::mutex m;
+    static thread_counts last;
+    std::lock_guard<std::mutex> lk(m);
+    if ( (c.eigen != last.eigen) || (c.blas != last.blas) || (c.spqr != last.spqr) ) {
+        library_threads<L>::set(c);
+        last = c;
+    }
+}
+
+#endif // THREAD_BUDGET_HPP
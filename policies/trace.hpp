@@ -0,0 +1,147 @@
+// Timeline tracing of the phases of a run, in Chrome's trace event format
+//
+// SPARSELIB_TRACE_SCOPE("name") records the time from that point to the end of the
+// enclosing block.  Without SPARSELIB_TRACE defined it expands to nothing, so the
+// scopes can stay in the code permanently.  With it, each thread appends to its own
+// fixed-size ring buffer (the oldest events are overwritten), so recording takes no
+// locks; only a thread's first event registers its buffer.
+//
+// trace::dump() writes everything recorded so far as JSON for chrome://tracing or
+// Perfetto; call it while no other thread is recording.  If SPARSELIB_TRACE_FILE is
+// set in the environment, that happens automatically at exit.
+
+#ifndef SPARSELIB_TRACE_HPP
+#define SPARSELIB_TRACE_HPP
+
+#ifdef SPARSELIB_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+namespace trace {
+
+struct event {
+    char const *  name;       // a string literal
+    std::uint64_t begin_ns;
+    std::uint64_t end_ns;
+};
+
+// Written only by its own thread.  head is published with release ordering, so a
+// reader sees complete events up to head
+struct ring_buffer {
+    static constexpr std::size_t capacity = std::size_t(1) << 16;
+
+    explicit ring_buffer( unsigned tid_ ) : tid(tid_), events(capacity) {}
+
+    void push( event const & e ) {
+        std::size_t h = head.load(std::memory_order_relaxed);
+        events[h % capacity] = e;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    unsigned                 tid;
+    std::atomic<std::size_t> head{0};
+    std::vector<event>       events;
+};
+
+inline std::uint64_t now_ns() {
+    return std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+inline void dump( std::ostream & os );
+
+// Every thread's buffer, kept after the thread exits so its events can still be dumped
+struct registry {
+    ~registry() {
+        if ( char const * path = std::getenv("SPARSELIB_TRACE_FILE") ) {
+            std::ofstream os(path);
+            dump(os);
+        }
+    }
+
+    std::mutex                                m;
+    std::vector<std::shared_ptr<ring_buffer>> buffers;
+    std::uint64_t                             start_ns = now_ns();
+
+    static registry & get() {
+        static registry r;
+        return r;
+    }
+};
+
+inline ring_buffer & this_thread_buffer() {
+    static thread_local std::shared_ptr<ring_buffer> buf;
+    if ( !buf ) {
+        registry & r = registry::get();
+        std::lock_guard<std::mutex> lk(r.m);
+        buf = std::make_shared<ring_buffer>(unsigned(r.buffers.size()));
+        r.buffers.push_back(buf);
+    }
+    return *buf;
+}
+
+// Complete ("X") events, one per scope, in microseconds since the registry started
+inline void dump( std::ostream & os ) {
+    registry & r = registry::get();
+    std::lock_guard<std::mutex> lk(r.m);
+    auto flags = os.flags();
+    auto prec = os.precision();
+    os << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+    bool first = true;
+    for ( auto const & b : r.buffers ) {
+        std::size_t head = b->head.load(std::memory_order_acquire);
+        std::size_t tail = (head > ring_buffer::capacity) ? head - ring_buffer::capacity : 0;
+        for ( std::size_t k = tail; k < head; ++k ) {
+            event const & e = b->events[k % ring_buffer::capacity];
+            os << (first ? "" : ",\n")
+               << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid
+               << ",\"ts\":" << (e.begin_ns - r.start_ns) * 1e-3
+               << ",\"dur\":" << (e.end_ns - e.begin_ns) * 1e-3 << "}";
+            first = false;
+        }
+    }
+    os << "\n]}\n";
+    os.flags(flags);
+    os.precision(prec);
+}
+
+struct scope {
+    // registering the buffer (on first use) comes before the clock is read
+    explicit scope( char const * name )
+        : buf_(this_thread_buffer()), name_(name), begin_ns_(now_ns()) {}
+    ~scope() {
+        buf_.push(event{name_, begin_ns_, now_ns()});
+    }
+
+    scope( scope const & ) = delete;
+    scope & operator=( scope const & ) = delete;
+
+private:
+    ring_buffer & buf_;
+    char const *  name_;
+    std::uint64_t begin_ns_;
+};
+
+}
+
+#define SPARSELIB_TRACE_CONCAT2(a, b) a##b
+#define SPARSELIB_TRACE_CONCAT(a, b) SPARSELIB_TRACE_CONCAT2(a, b)
+#define SPARSELIB_TRACE_SCOPE(name) \
+    ::trace::scope SPARSELIB_TRACE_CONCAT(sparselib_trace_scope_, __LINE__)(name)
+
+#else
+
+#define SPARSELIB_TRACE_SCOPE(name) do {} while (0)
+
+#endif // SPARSELIB_TRACE
+
+#endif // SPARSELIB_TRACE_HPP
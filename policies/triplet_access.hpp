@@ -0,0 +1,21 @@
+// Uniform access to the fields of the different triplet types
+// CSparse and SuiteSparse triplets are plain structs, Eigen's have accessors;
+// generic helpers use these so they can accept either kind
+
+#ifndef TRIPLET_ACCESS_HPP
+#define TRIPLET_ACCESS_HPP
+
+namespace triplet_access {
+
+template<typename T> auto row(T const& t) -> decltype(t.row) { return t.row; }
+template<typename T> auto row(T const& t) -> decltype(t.row()) { return t.row(); }
+
+template<typename T> auto col(T const& t) -> decltype(t.col) { return t.col; }
+template<typename T> auto col(T const& t) -> decltype(t.col()) { return t.col(); }
+
+template<typename T> auto value(T const& t) -> decltype(t.value) { return t.value; }
+template<typename T> auto value(T const& t) -> decltype(t.value()) { return t.value(); }
+
+}
+
+#endif // TRIPLET_ACCESS_HPP
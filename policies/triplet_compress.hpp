@@ -0,0 +1,200 @@
+// Compressed column storage from a range of triplets, in parallel
+//
+// A counting sort by column: each thread counts its share of the range, the counts
+// give every thread its own place in each column, and the threads scatter their
+// shares there.  Entries within a column are thus in range order whatever the
+// number of threads, so the results are reproducible.  Each column is then
+// sorted by row (if asked) and its duplicates summed, in range order.
+//
+// The range is read in place, with no triplet matrix in between.  The compressed
+// arrays go wherever allocate(nnz) says, which for the shims is straight into the
+// library's own matrix.  Built without OpenMP all of this runs on one thread.
+
+#ifndef TRIPLET_COMPRESS_HPP
+#define TRIPLET_COMPRESS_HPP
+
+#include <vector>
+#include <cassert>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "triplet_access.hpp"
+
+namespace triplet_compress {
+
+// where allocate() wants the result: cols+1 column pointers, nnz row indices and values
+template<typename Index, typename Value>
+struct csc_arrays {
+    Index * p;
+    Index * i;
+    Value * x;
+};
+
+// below this many triplets one thread is faster
+static constexpr std::size_t min_parallel_triplets = std::size_t(1) << 15;
+
+// columns up to this long are sorted by insertion
+static constexpr std::ptrdiff_t short_column = 32;
+
+// Iter must be random access.  With "sorted" the rows of each column are increasing,
+// as Eigen and CHOLMOD expect; otherwise they stay in first appearance order
+template<typename Index, typename Value, typename Iter, typename Allocate>
+void
+compress( Index rows, Index cols, Iter first, Iter last, Allocate && allocate, bool sorted = true ) {
+    using namespace triplet_access;
+    std::size_t const n = std::size_t(std::distance(first, last));
+
+    // the number of threads asked for; the team we get may be smaller
+    int nthreads = 1;
+#ifdef _OPENMP
+    if ( n >= min_parallel_triplets ) {
+        nthreads = omp_get_max_threads();
+    }
+#endif
+
+    // count[t * cols + j] is first thread t's entries in column j, then where they go.
+    // It is sized once the team is known
+    std::vector<Index> count, start(cols + 1, 0);
+    std::vector<Index> ri(n);
+    std::vector<Value> rx(n);
+    std::vector<Index> unique(cols + 1, 0);
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthreads)
+#endif
+    {
+#ifdef _OPENMP
+#pragma omp single
+        {
+            nthreads = omp_get_num_threads();
+            count.assign(std::size_t(nthreads) * cols, 0);
+        }
+        // (the implied barrier at the end of "single" publishes nthreads and count)
+        int t = omp_get_thread_num();
+#else
+        count.assign(std::size_t(cols), 0);
+        int t = 0;
+#endif
+        std::size_t lo = n * t / nthreads, hi = n * (t + 1) / nthreads;
+        Index * mine = count.data() + std::size_t(t) * cols;
+        for ( std::size_t k = lo; k < hi; ++k ) {
+            auto const & e = first[k];
+            assert((row(e) >= 0) && (row(e) < rows) && (col(e) >= 0) && (col(e) < cols));
+            ++mine[col(e)];
+        }
+#ifdef _OPENMP
+#pragma omp barrier
+#pragma omp for schedule(static)
+#endif
+        for ( Index j = 0; j < cols; ++j ) {
+            Index s = 0;
+            for ( int u = 0; u < nthreads; ++u ) {
+                Index c = count[std::size_t(u) * cols + j];
+                count[std::size_t(u) * cols + j] = s;
+                s += c;
+            }
+            start[j + 1] = s;
+        }
+#ifdef _OPENMP
+#pragma omp single
+#endif
+        for ( Index j = 0; j < cols; ++j ) {
+            start[j + 1] += start[j];
+        }
+        // (the implied barrier at the end of "single" makes start complete)
+
+        for ( std::size_t k = lo; k < hi; ++k ) {
+            auto const & e = first[k];
+            Index pos = start[col(e)] + mine[col(e)]++;
+            ri[pos] = Index(row(e));
+            rx[pos] = Value(value(e));
+        }
+#ifdef _OPENMP
+#pragma omp barrier
+#endif
+
+        // each column in place: sort (stably, so duplicates sum in range order) and combine
+        std::vector<std::pair<Index, Value>> seg;
+        std::vector<Index> where(sorted ? 0 : rows, -1);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 256)
+#endif
+        for ( Index j = 0; j < cols; ++j ) {
+            Index b = start[j], e = start[j + 1], out = b;
+            if ( sorted ) {
+                if ( e - b <= short_column ) {
+                    // insertion sort where it is (circuit matrices have mostly short columns)
+                    for ( Index k = b + 1; k < e; ++k ) {
+                        Index r = ri[k];
+                        Value v = rx[k];
+                        Index m = k;
+                        for ( ; (m > b) && (ri[m - 1] > r); --m ) {
+                            ri[m] = ri[m - 1];
+                            rx[m] = rx[m - 1];
+                        }
+                        ri[m] = r;
+                        rx[m] = v;
+                    }
+                } else {
+                    seg.clear();
+                    for ( Index k = b; k < e; ++k ) {
+                        seg.emplace_back(ri[k], rx[k]);
+                    }
+                    std::stable_sort(seg.begin(), seg.end(),
+                                     [](std::pair<Index, Value> const & a, std::pair<Index, Value> const & c) {
+                                         return a.first < c.first;
+                                     });
+                    for ( Index k = b; k < e; ++k ) {
+                        ri[k] = seg[k - b].first;
+                        rx[k] = seg[k - b].second;
+                    }
+                }
+                for ( Index k = b; k < e; ++k ) {
+                    if ( (out > b) && (ri[out - 1] == ri[k]) ) {
+                        rx[out - 1] += rx[k];
+                    } else {
+                        ri[out] = ri[k];
+                        rx[out++] = rx[k];
+                    }
+                }
+            } else {
+                // as in cs_dupl: where[r] >= b means row r was already seen in this column
+                for ( Index k = b; k < e; ++k ) {
+                    Index r = ri[k];
+                    if ( where[r] >= b ) {
+                        rx[where[r]] += rx[k];
+                    } else {
+                        where[r] = out;
+                        ri[out] = r;
+                        rx[out++] = rx[k];
+                    }
+                }
+            }
+            unique[j + 1] = out - b;
+        }
+    }
+
+    for ( Index j = 0; j < cols; ++j ) {
+        unique[j + 1] += unique[j];
+    }
+    csc_arrays<Index, Value> out = allocate(unique[cols]);
+    std::copy(unique.begin(), unique.end(), out.p);
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(static)
+#endif
+    for ( Index j = 0; j < cols; ++j ) {
+        Index len = unique[j + 1] - unique[j];
+        std::copy(ri.begin() + start[j], ri.begin() + start[j] + len, out.i + unique[j]);
+        std::copy(rx.begin() + start[j], rx.begin() + start[j] + len, out.x + unique[j]);
+    }
+}
+
+}
+
+#endif // TRIPLET_COMPRESS_HPP